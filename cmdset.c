@@ -1,3 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE
+#endif
 #include "cmdset.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,15 +12,38 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <time.h>
 #include <termios.h>
+#include <math.h>
+#include <ctype.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 #include <openssl/aes.h>
 #include <json-c/json.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #include <conio.h>
@@ -23,36 +53,456 @@
 #define MAX_NAME_LEN 50
 #define MAX_COMMAND_LEN 500
 #define PRESET_FILE ".cmdset_presets"
+#define INDEX_SUFFIX ".idx"
+#define INDEX_MAGIC 0x58495343
+#define INDEX_VERSION 1
+#define COMPLETION_SUFFIX ".complete"
+#define COMPLETION_MAGIC 0x50435343
+#define COMPLETION_VERSION 3
+#define COMPLETION_HEADER_SIZE (sizeof(uint32_t) * 4 + sizeof(completion_stamp_t))
+#define MAX_TAG_LEN 32
+#define MAX_TAGS 65535
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITSET_WORDS 1024
+#define WRITER_BUFFER_SIZE (256 * 1024)
+#define KEY_CACHE_SIZE 8
+#define SNAPSHOT_READERS 64
+#define FLUSH_MIN_BACKOFF_MS 100
+#define FLUSH_MAX_BACKOFF_MS 60000
 #define JSON_LINE_BUFFER 1024
 #define ENCRYPTED_COMMAND_LEN (MAX_COMMAND_LEN * 2)
 #define SALT_LEN 16
 #define IV_LEN 16
 #define KEY_LEN 32
 #define SESSION_TIMEOUT 300
+#define FRECENCY_HALF_LIFE (7 * 24 * 3600)
+#define FRECENCY_COUNT_WEIGHT 1.0
+#define SEARCH_EXACT_SCORE 1000
+#define SEARCH_MATCH_SCORE 16
+#define SEARCH_BOUNDARY_BONUS 8
+#define SEARCH_CONSECUTIVE_BONUS 8
+#define SEARCH_COMMAND_SCORE 10
+#define SUGGEST_MAX_DISTANCE 3
+#define QUERY_MAX_STACK 64
+
+typedef struct {
+    char *token;
+    unsigned char *postings;
+    size_t length;
+    size_t capacity;
+    int count;
+    int last;
+} token_entry_t;
+
+typedef struct {
+    token_entry_t *entries;
+    size_t capacity;
+    size_t used;
+} token_index_t;
+
+// Roaring-style bitmap: values are split into containers by their high 16
+// bits, and each container is a sorted array until it holds more than
+// ROARING_ARRAY_MAX values, after which it becomes a 65536-bit bitset.
+typedef struct {
+    uint16_t key;
+    int cardinality;
+    int capacity;
+    uint16_t *array;
+    uint64_t *bits;
+} roaring_container_t;
+
+typedef struct {
+    roaring_container_t *containers;
+    int count;
+    int capacity;
+} roaring_t;
+
+typedef struct {
+    uint16_t *ids;
+    int count;
+} preset_tags_t;
+
+typedef struct {
+    const char *name;
+    double key;
+} completion_entry_t;
+
+typedef struct {
+    double key;
+    int slot;
+} rank_entry_t;
+
+typedef struct {
+    uint32_t name_offset;
+    uint32_t name_len;
+    double key;
+} completion_record_t;
+
+// The store a completion cache was built from: its hash and, so that one
+// stat can tell it is unchanged, the identity of its file.
+typedef struct {
+    uint64_t hash;
+    uint64_t inode;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} completion_stamp_t;
+
+// --where filters compile to a postfix program for a small stack machine.
+enum {
+    QUERY_FIELD,
+    QUERY_CONST,
+    QUERY_NOW,
+    QUERY_ADD,
+    QUERY_SUB,
+    QUERY_LT,
+    QUERY_LE,
+    QUERY_GT,
+    QUERY_GE,
+    QUERY_EQ,
+    QUERY_NE,
+    QUERY_NOT,
+    QUERY_AND,
+    QUERY_OR
+};
+
+enum {
+    QUERY_FIELD_USE_COUNT,
+    QUERY_FIELD_LAST_USED,
+    QUERY_FIELD_CREATED_AT,
+    QUERY_FIELD_ENCRYPT
+};
+
+typedef struct {
+    int op;
+    int64_t value;
+} query_insn_t;
+
+struct cmdset_query {
+    query_insn_t *code;
+    int length;
+    int capacity;
+};
+
+typedef struct {
+    const char *input;
+    const char *cursor;
+    cmdset_query_t *query;
+    int depth;
+    int nesting;
+    int failed;
+} query_parser_t;
+
+// Compact radix trie over preset names. Edges carry whole label strings,
+// children are kept sorted by their first byte and every node counts the
+// names below it, so prefix resolution is O(length of the prefix).
+typedef struct trie_node {
+    char *label;
+    int label_len;
+    int slot;
+    int count;
+    struct trie_node **children;
+    int child_count;
+} trie_node_t;
+
+typedef struct {
+    int fd;
+    int failed;
+    size_t length;
+    char *buffer;
+} writer_t;
+
+#define SCHED_MAX_CPUS 1024
+#define PROFILE_CPUS 1
+#define PROFILE_NICE 2
+#define PROFILE_IO 4
+
+// How a preset's command is scheduled: applied in the child before exec.
+// io_class uses the kernel's IOPRIO_CLASS_* numbering.
+typedef struct {
+    int flags;
+    int nice;
+    int io_class;
+    int io_level;
+    uint64_t cpus[SCHED_MAX_CPUS / 64];
+} sched_profile_t;
+
+// A copy of the active presets and their tags. Writers build a new version
+// after every structural change and publish it through state->current, so
+// readers never wait for them. Executions only touch the published version in
+// place: use_count and last_used atomically, usage under usage_lock (set once
+// published). by_name holds preset indices sorted by name.
+typedef struct store_version {
+    unsigned long version;
+    int count;
+    cmdset_preset_t *presets;
+    int *by_name;
+    int *tag_offsets;
+    int *limits;
+    sched_profile_t *profiles;
+    cmdset_usage_t *usage;
+    pthread_mutex_t *usage_lock;
+    const char **tags;
+    uint64_t retire_epoch;
+    struct store_version *next_retired;
+} store_version_t;
+
+// A reader slot. While epoch is non-zero the version it pinned, and every
+// version retired at or after that epoch, stays allocated.
+struct cmdset_snapshot {
+    int busy;
+    uint64_t epoch;
+    const store_version_t *version;
+};
+
+typedef struct {
+    int remove;
+    int encrypt;
+    char name[MAX_NAME_LEN];
+    char command[MAX_COMMAND_LEN];
+} txn_op_t;
+
+// Mutations staged by cmdset_txn_add/remove. Commands are encrypted while
+// staging, so committing never prompts. The first staging error is kept and
+// makes the commit fail without touching the store.
+struct cmdset_txn {
+    cmdset_manager_t *manager;
+    txn_op_t *ops;
+    int count;
+    int capacity;
+    int error;
+    char message[256];
+};
+
+// A started command. A synchronous run keeps SIGINT and SIGQUIT ignored and
+// SIGCHLD blocked, as system() does, until it is reaped.
+struct cmdset_run {
+    cmdset_manager_t *manager;
+    char name[MAX_NAME_LEN];
+    pid_t pid;
+    int pidfd;
+    int slot_fd;
+    int sync;
+    int finished;
+    int status;
+    sigset_t saved_mask;
+    struct timespec started;
+};
+
+typedef struct {
+    unsigned char salt[SALT_LEN];
+    unsigned char key[KEY_LEN];
+    int used;
+} key_cache_entry_t;
+
+// Everything that used to be process-global: the store location, the password
+// session and its derived keys, and the allocator for manager state. lock
+// guards the session and key cache.
+struct cmdset_ctx {
+    pthread_mutex_t lock;
+    char store_path[512];
+    int persist_session;
+    int fixed_password;
+    int managers;
+    char session_file[512];
+    char session_password[256];
+    char current_preset_name[256];
+    time_t session_start_time;
+    int session_active;
+    key_cache_entry_t key_cache[KEY_CACHE_SIZE];
+    int key_cache_next;
+    cmdset_allocator_t allocator;
+};
 
-static char session_password[256] = {0};
-static time_t session_start_time = 0;
-static int session_active = 0;
-static char session_file[512];
-static char current_preset_name[256] = {0};
-static char last_error_message[256] = {0};
+// Public entry points take lock shared or exclusive. Executions only hold it
+// shared: use_count and last_used are updated atomically, and rank_lock
+// serialises the reordering of the frecency ranking, usage updates and
+// snapshot publication.
+// Saves also run shared; save_lock keeps two of them from interleaving.
+// flush_lock guards the count of unsaved changes and the write-behind thread.
+struct cmdset_state {
+    cmdset_ctx_t *ctx;
+    pthread_rwlock_t lock;
+    pthread_mutex_t rank_lock;
+    token_index_t index;
+    trie_node_t *trie;
+    int bk_root;
+    int bk_child[MAX_PRESETS];
+    int bk_sibling[MAX_PRESETS];
+    int bk_distance[MAX_PRESETS];
+    char **tag_names;
+    roaring_t *tag_bitmaps;
+    int tag_count;
+    int tag_capacity;
+    preset_tags_t slot_tags[MAX_PRESETS];
+    double half_life;
+    double count_weight;
+    double keys[MAX_PRESETS];
+    int rank[MAX_PRESETS];
+    int rank_pos[MAX_PRESETS];
+    int rank_count;
+    cmdset_manager_t *writer;
+    pthread_mutex_t save_lock;
+    store_version_t *current;
+    store_version_t *retired;
+    unsigned long next_version;
+    uint64_t epoch;
+    struct cmdset_snapshot readers[SNAPSHOT_READERS];
+    pthread_mutex_t flush_lock;
+    pthread_cond_t flush_cond;
+    int pending;
+    struct timespec dirty_since;
+    int flush_delay_ms;
+    int flush_threshold;
+    int flusher_running;
+    int flusher_stop;
+    int flush_failures;
+    struct timespec flush_retry;
+    pthread_t flusher;
+    uint64_t store_hash;
+    struct stat store_stat;
+    int watch_fd;
+    int watch_pipe[2];
+    int watcher_running;
+    pthread_t watcher;
+    int max_concurrency[MAX_PRESETS];
+    sched_profile_t profiles[MAX_PRESETS];
+    cmdset_usage_t usage[MAX_PRESETS];
+    char unsaved[MAX_PRESETS];
+    char (*removed)[MAX_NAME_LEN];
+    int removed_count;
+    int removed_capacity;
+};
+
+// Flags in unsaved[] for changes made here that the store file does not
+// have yet. A merge keeps whatever they mark instead of the file's value,
+// and keeps presets named in removed instead of bringing them back.
+#define UNSAVED_ADDED 1
+#define UNSAVED_TAGS 2
+#define UNSAVED_LIMIT 4
+#define UNSAVED_SCHED 8
+
+// The CLI and cmdset_init() use the default context: the store in the current
+// directory and a password session persisted in ~/.cmdset_session.
+static cmdset_ctx_t default_ctx = {.lock = PTHREAD_MUTEX_INITIALIZER, .store_path = PRESET_FILE, .persist_session = 1};
+static __thread const cmdset_allocator_t *active_allocator = NULL;
+static __thread char last_error_message[256] = {0};
 
 static int derive_key(const char *password, const unsigned char *salt, unsigned char *key);
 static int get_master_password(char *password, int max_len);
-static int get_session_password(char *password, int max_len, const char *preset_name);
-static int is_session_valid(void);
-static void clear_session(void);
-static int encrypt_command_internal(const char *plaintext, char *encrypted, const char *preset_name);
-static int decrypt_command_internal(const char *encrypted, char *plaintext, const char *preset_name);
-
-#define CMDSET_SUCCESS 0
-#define CMDSET_ERROR_MEMORY -1
-#define CMDSET_ERROR_FILE -2
-#define CMDSET_ERROR_NOT_FOUND -3
-#define CMDSET_ERROR_EXISTS -4
-#define CMDSET_ERROR_INVALID -5
-#define CMDSET_ERROR_ENCRYPTION -6
-#define CMDSET_ERROR_JSON -7
+static int derive_key_cached(cmdset_ctx_t *context, const char *password, const unsigned char *salt, unsigned char *key);
+static int get_session_password(cmdset_ctx_t *context, char *password, int max_len, const char *preset_name);
+static int is_session_valid(cmdset_ctx_t *context);
+static void clear_session(cmdset_ctx_t *context);
+static void session_remove(cmdset_ctx_t *context);
+static int encrypt_command_internal(cmdset_ctx_t *context, const char *plaintext, char *encrypted, const char *preset_name);
+static int decrypt_command_internal(cmdset_ctx_t *context, const char *encrypted, char *plaintext, const char *preset_name);
+static int encrypt_command_unlocked(cmdset_ctx_t *context, const char *plaintext, char *encrypted, const char *preset_name);
+static int decrypt_command_unlocked(cmdset_ctx_t *context, const char *encrypted, char *plaintext, const char *preset_name);
+static cmdset_ctx_t* manager_ctx(cmdset_manager_t *manager);
+static void store_path(cmdset_manager_t *manager, const char *suffix, char *path, size_t size);
+static void* mem_malloc(size_t size);
+static void* mem_calloc(size_t count, size_t size);
+static void* mem_realloc(void *pointer, size_t size);
+static void mem_free(void *pointer);
+static struct cmdset_state* get_state(cmdset_manager_t *manager);
+static struct cmdset_state* state_lock(cmdset_manager_t *manager, int exclusive);
+static void state_unlock(struct cmdset_state *state);
+static double frecency_key(const struct cmdset_state *state, const cmdset_preset_t *preset);
+static void rank_insert(cmdset_manager_t *manager, int slot);
+static void rank_remove(cmdset_manager_t *manager, int slot);
+static void rank_promote(cmdset_manager_t *manager, int slot);
+static void rank_rebuild(cmdset_manager_t *manager);
+static const char* find_substring(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len);
+static int fuzzy_score(const char *name, const char *query, size_t query_len);
+static uint64_t hash_content(const char *content, size_t length);
+static token_entry_t* index_entry(token_index_t *index, const char *token, int create);
+static int posting_decode(const token_entry_t *entry, int *ids);
+static void index_add(cmdset_manager_t *manager, int slot);
+static void index_remove(cmdset_manager_t *manager, int slot);
+static void index_clear(token_index_t *index);
+static void index_rebuild(cmdset_manager_t *manager);
+static int index_save(cmdset_manager_t *manager, uint64_t store_hash);
+static int index_load(cmdset_manager_t *manager, uint64_t store_hash);
+static int roaring_and_values(const roaring_t *a, const roaring_t *b, uint32_t *out);
+static int roaring_values(const roaring_t *bitmap, uint32_t *out);
+static int roaring_contains(const roaring_t *bitmap, uint32_t value);
+static int roaring_cardinality(const roaring_t *bitmap);
+static int is_valid_tag(const char *tag);
+static int tag_id(struct cmdset_state *state, const char *tag, int create);
+static int tag_attach(cmdset_manager_t *manager, int slot, const char *tag);
+static int tag_detach(cmdset_manager_t *manager, int slot, const char *tag);
+static void tags_detach_all(cmdset_manager_t *manager, int slot);
+static void tags_clear(struct cmdset_state *state);
+static void presets_compact(cmdset_manager_t *manager);
+static void tags_from_json(cmdset_manager_t *manager, int slot, json_object *preset);
+static void limit_from_json(cmdset_manager_t *manager, int slot, json_object *preset);
+static void sched_from_json(cmdset_manager_t *manager, int slot, json_object *preset);
+static int sched_parse(const char *spec, sched_profile_t *profile);
+static int sched_format(const sched_profile_t *profile, char *spec, int max_len);
+static int run_start(cmdset_manager_t *manager, const char *name, const char *additional_args, int flags, struct cmdset_run *run);
+static int run_reap(struct cmdset_run *run, int blocking);
+static void signals_hold(sigset_t *saved_mask, struct sigaction *child_int, struct sigaction *child_quit);
+static void signals_release(const sigset_t *saved_mask);
+static pid_t command_spawn(const char *command, const sched_profile_t *profile, const struct sigaction *child_int, const struct sigaction *child_quit, const sigset_t *child_mask);
+static void usage_add(cmdset_usage_t *total, const cmdset_usage_t *run);
+static void usage_from_json(cmdset_manager_t *manager, int slot, json_object *preset, int keep_max);
+static void trie_insert(struct cmdset_state *state, const char *name, int slot);
+static void trie_remove(struct cmdset_state *state, const char *name);
+static int trie_find(const struct cmdset_state *state, const char *name);
+static const trie_node_t* trie_locate(const struct cmdset_state *state, const char *prefix);
+static int trie_collect(const trie_node_t *node, int *slots, int found, int max_slots);
+static void trie_clear(trie_node_t *node);
+static void trie_rebuild(cmdset_manager_t *manager);
+static int edit_distance(const char *a, const char *b);
+static void query_parse_or(query_parser_t *parser);
+static int query_eval(const cmdset_query_t *query, const cmdset_preset_t *preset, int64_t now);
+static void bk_insert(cmdset_manager_t *manager, int slot);
+static void bk_rebuild(cmdset_manager_t *manager);
+static int find_slot(cmdset_manager_t *manager, const char *name);
+static void copy_preset(cmdset_preset_t *destination, const cmdset_preset_t *source);
+static void state_free(struct cmdset_state *state);
+static void dirty_mark(struct cmdset_state *state);
+static void unsaved_clear(struct cmdset_state *state);
+static void removed_add(struct cmdset_state *state, const char *name);
+static int removed_contains(const struct cmdset_state *state, const char *name);
+static void dirty_clear(struct cmdset_state *state, int count);
+static int dirty_count(struct cmdset_state *state);
+static void* flusher_main(void *argument);
+static void flusher_stop(cmdset_manager_t *manager);
+static int store_read(cmdset_manager_t *manager, char **content, size_t *length);
+static void preset_from_json(json_object *object, cmdset_preset_t *preset);
+static void tags_sync(cmdset_manager_t *manager, int slot, json_object *preset);
+#ifdef __linux__
+static void* watcher_main(void *argument);
+#endif
+static int store_merge_unlocked(cmdset_manager_t *manager);
+static void watcher_stop(cmdset_manager_t *manager);
+static store_version_t* snapshot_build(cmdset_manager_t *manager, const char *skip, const cmdset_preset_t *extra, int extra_count);
+static int store_write(cmdset_manager_t *manager, const char *json_string);
+static FILE* replace_open(cmdset_manager_t *manager, const char *suffix, char *temporary, size_t size);
+static int replace_close(cmdset_manager_t *manager, const char *suffix, FILE *file, const char *temporary, int failed);
+static void preset_insert(cmdset_manager_t *manager, const char *name, const char *command, int encrypt, long created_at);
+static int concurrency_acquire(cmdset_manager_t *manager, const char *name, int limit, int wait);
+static txn_op_t* txn_push(cmdset_txn_t *txn);
+static int txn_fail(cmdset_txn_t *txn, int error);
+static void snapshot_publish(cmdset_manager_t *manager);
+static void snapshot_touch(struct cmdset_state *state, const cmdset_preset_t *preset, const cmdset_usage_t *usage);
+static void version_usage(const store_version_t *version, int index, cmdset_usage_t *usage);
+static void snapshot_reclaim(struct cmdset_state *state, int all);
+static cmdset_snapshot_t* snapshot_enter(struct cmdset_state *state);
+static const store_version_t* version_pin(cmdset_manager_t *manager, cmdset_snapshot_t **reader);
+static void version_unpin(cmdset_manager_t *manager, const store_version_t *version, cmdset_snapshot_t *reader);
+static const cmdset_preset_t* version_find(const store_version_t *version, const char *name);
+static json_object* version_to_json(const store_version_t *version, int exported);
+static void append_output(char *output, int max_len, int *offset, int *truncated, const char *format, ...);
+static void writer_flush(writer_t *writer);
+static void writer_puts(writer_t *writer, const char *text);
+static void write_preset_record(cmdset_manager_t *manager, writer_t *writer, const cmdset_preset_t *preset, int format, int first);
+static int completion_save(cmdset_manager_t *manager);
+static int completion_is_stale(cmdset_ctx_t *ctx, const unsigned char *map);
+static void completion_stamp(completion_stamp_t *stamp, uint64_t hash, const struct stat *info);
+static int compare_completion_keys(const void *a, const void *b);
 
 static const char* error_messages[] = {
     "Success",
@@ -62,7 +512,9 @@ static const char* error_messages[] = {
     "Preset already exists",
     "Invalid parameters",
     "Encryption error",
-    "JSON parsing error"
+    "JSON parsing error",
+    "Output truncated",
+    "Concurrency limit reached"
 };
 
 const char* cmdset_get_error_message(int error_code) {
@@ -71,20 +523,133 @@ const char* cmdset_get_error_message(int error_code) {
     return "Unknown error";
 }
 
+const char* cmdset_get_last_error(void) {
+    return last_error_message;
+}
+
 int cmdset_init(cmdset_manager_t *manager) {
+    return cmdset_init_with_ctx(manager, NULL);
+}
+
+int cmdset_init_with_ctx(cmdset_manager_t *manager, cmdset_ctx_t *ctx) {
     if (manager == NULL) {
         strcpy(last_error_message, "Manager is NULL");
         return CMDSET_ERROR_INVALID;
     }
+    if (ctx == NULL) ctx = &default_ctx;
     memset(manager, 0, sizeof(cmdset_manager_t));
+    active_allocator = &ctx->allocator;
+    struct cmdset_state *state = get_state(manager);
+    active_allocator = NULL;
+    if (state == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    state->ctx = ctx;
+    __atomic_add_fetch(&ctx->managers, 1, __ATOMIC_SEQ_CST);
     return cmdset_load_presets(manager);
 }
 
-int cmdset_add_preset(cmdset_manager_t *manager, const char *name, const char *command, int encrypt) {
+cmdset_ctx_t* cmdset_ctx_new(void) {
+    cmdset_ctx_t *ctx = calloc(1, sizeof(cmdset_ctx_t));
+    if (ctx == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+    strcpy(ctx->store_path, PRESET_FILE);
+    return ctx;
+}
+
+void cmdset_ctx_free(cmdset_ctx_t *ctx) {
+    if (ctx == NULL || ctx == &default_ctx) return;
+    pthread_mutex_destroy(&ctx->lock);
+    memset(ctx, 0, sizeof(cmdset_ctx_t));
+    free(ctx);
+}
+
+int cmdset_ctx_set_store(cmdset_ctx_t *ctx, const char *path) {
+    if (ctx == NULL || path == NULL || path[0] == '\0') {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (strlen(path) + strlen(COMPLETION_SUFFIX ".XXXXXX") >= sizeof(ctx->store_path)) {
+        strcpy(last_error_message, "Store path too long");
+        return CMDSET_ERROR_INVALID;
+    }
+    strcpy(ctx->store_path, path);
+    return CMDSET_SUCCESS;
+}
+
+int cmdset_ctx_set_password(cmdset_ctx_t *ctx, const char *password) {
+    if (ctx == NULL || ctx == &default_ctx) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (password != NULL && strlen(password) >= sizeof(ctx->session_password)) {
+        strcpy(last_error_message, "Password too long");
+        return CMDSET_ERROR_INVALID;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    ctx->fixed_password = 0;
+    clear_session(ctx);
+    if (password != NULL) {
+        strcpy(ctx->session_password, password);
+        ctx->fixed_password = 1;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return CMDSET_SUCCESS;
+}
+
+int cmdset_ctx_set_allocator(cmdset_ctx_t *ctx, const cmdset_allocator_t *allocator) {
+    if (ctx == NULL || ctx == &default_ctx || (allocator != NULL && (allocator->malloc == NULL || allocator->realloc == NULL || allocator->free == NULL))) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    // Managers free their state through the allocator that created it.
+    if (__atomic_load_n(&ctx->managers, __ATOMIC_SEQ_CST) > 0) {
+        strcpy(last_error_message, "Context has live managers");
+        return CMDSET_ERROR_BUSY;
+    }
+    if (allocator != NULL) ctx->allocator = *allocator;
+    else memset(&ctx->allocator, 0, sizeof(ctx->allocator));
+    return CMDSET_SUCCESS;
+}
+
+void cmdset_ctx_clear_session(cmdset_ctx_t *ctx) {
+    if (ctx == NULL) ctx = &default_ctx;
+    pthread_mutex_lock(&ctx->lock);
+    clear_session(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Appends a validated preset; command is already encrypted when encrypt is set.
+static void preset_insert(cmdset_manager_t *manager, const char *name, const char *command, int encrypt, long created_at) {
+    cmdset_preset_t *preset = &manager->presets[manager->count];
+    strcpy(preset->name, name);
+    strcpy(preset->command, command);
+    preset->active = 1;
+    preset->encrypt = encrypt;
+    preset->created_at = created_at;
+    preset->last_used = 0;
+    preset->use_count = 0;
+    if (manager->state != NULL) manager->state->max_concurrency[manager->count] = 0;
+    if (manager->state != NULL) memset(&manager->state->profiles[manager->count], 0, sizeof(sched_profile_t));
+    if (manager->state != NULL) memset(&manager->state->usage[manager->count], 0, sizeof(cmdset_usage_t));
+    if (manager->state != NULL) manager->state->unsaved[manager->count] = UNSAVED_ADDED;
+    manager->count++;
+    rank_insert(manager, manager->count - 1);
+    index_add(manager, manager->count - 1);
+    if (get_state(manager) != NULL) trie_insert(manager->state, name, manager->count - 1);
+    bk_insert(manager, manager->count - 1);
+}
+
+static int add_preset_unlocked(cmdset_manager_t *manager, const char *name, const char *command, int encrypt) {
     if (manager == NULL || name == NULL || command == NULL) {
         strcpy(last_error_message, "Invalid parameters");
         return CMDSET_ERROR_INVALID;
     }
+    if (manager->count >= MAX_PRESETS) presets_compact(manager);
     if (manager->count >= MAX_PRESETS) {
         strcpy(last_error_message, "Maximum number of presets reached");
         return CMDSET_ERROR_MEMORY;
@@ -97,212 +662,347 @@ int cmdset_add_preset(cmdset_manager_t *manager, const char *name, const char *c
         strcpy(last_error_message, "Command too long");
         return CMDSET_ERROR_INVALID;
     }
-    cmdset_preset_t *existing = NULL;
-    for (int i = 0; i < manager->count; i++) {
-        if (manager->presets[i].active && strcmp(manager->presets[i].name, name) == 0) {
-            existing = &manager->presets[i];
-            break;
-        }
-    }
-    if (existing != NULL) {
+    if (find_slot(manager, name) >= 0) {
         strcpy(last_error_message, "Preset already exists");
         return CMDSET_ERROR_EXISTS;
     }
-    cmdset_preset_t *preset = &manager->presets[manager->count];
-    strcpy(preset->name, name);
-    preset->active = 1;
-    preset->encrypt = encrypt;
-    preset->created_at = time(NULL);
-    preset->last_used = 0;
-    preset->use_count = 0;
     if (encrypt) {
         char encrypted_command[ENCRYPTED_COMMAND_LEN];
-        if (encrypt_command_internal(command, encrypted_command, name) != 0) {
+        if (encrypt_command_internal(manager_ctx(manager), command, encrypted_command, name) != 0) {
             strcpy(last_error_message, "Failed to encrypt command");
             return CMDSET_ERROR_ENCRYPTION;
         }
-        strcpy(preset->command, encrypted_command);
-    } else strcpy(preset->command, command);
-    manager->count++;
+        preset_insert(manager, name, encrypted_command, encrypt, time(NULL));
+    } else preset_insert(manager, name, command, encrypt, time(NULL));
     return CMDSET_SUCCESS;
 }
 
-int cmdset_remove_preset(cmdset_manager_t *manager, const char *name) {
+int cmdset_add_preset(cmdset_manager_t *manager, const char *name, const char *command, int encrypt) {
+    struct cmdset_state *state = state_lock(manager, 1);
+    int result = add_preset_unlocked(manager, name, command, encrypt);
+    if (result == CMDSET_SUCCESS) dirty_mark(state);
+    state_unlock(state);
+    return result;
+}
+
+static int remove_preset_unlocked(cmdset_manager_t *manager, const char *name) {
     if (manager == NULL || name == NULL) {
         strcpy(last_error_message, "Invalid parameters");
         return CMDSET_ERROR_INVALID;
     }
-    for (int i = 0; i < manager->count; i++) {
-        if (manager->presets[i].active && strcmp(manager->presets[i].name, name) == 0) {
-            manager->presets[i].active = 0;
-            return CMDSET_SUCCESS;
-        }
+    int slot = find_slot(manager, name);
+    if (slot < 0) {
+        strcpy(last_error_message, "Preset not found");
+        return CMDSET_ERROR_NOT_FOUND;
     }
-    strcpy(last_error_message, "Preset not found");
-    return CMDSET_ERROR_NOT_FOUND;
+    rank_remove(manager, slot);
+    index_remove(manager, slot);
+    tags_detach_all(manager, slot);
+    trie_remove(manager->state, name);
+    manager->presets[slot].active = 0;
+    return CMDSET_SUCCESS;
+}
+
+int cmdset_remove_preset(cmdset_manager_t *manager, const char *name) {
+    struct cmdset_state *state = state_lock(manager, 1);
+    int slot = manager != NULL && name != NULL ? find_slot(manager, name) : -1;
+    int added = slot >= 0 && state != NULL && (state->unsaved[slot] & UNSAVED_ADDED);
+    int result = remove_preset_unlocked(manager, name);
+    // A preset the file never had needs no record of its removal.
+    if (result == CMDSET_SUCCESS && !added) removed_add(state, name);
+    if (result == CMDSET_SUCCESS) dirty_mark(state);
+    state_unlock(state);
+    return result;
 }
 
 int cmdset_execute_preset(cmdset_manager_t *manager, const char *name, const char *additional_args) {
-    if (manager == NULL || name == NULL) {
-        strcpy(last_error_message, "Invalid parameters");
-        return CMDSET_ERROR_INVALID;
-    }
-    cmdset_preset_t *preset = NULL;
-    for (int i = 0; i < manager->count; i++) {
-        if (manager->presets[i].active && strcmp(manager->presets[i].name, name) == 0) {
-            preset = &manager->presets[i];
-            break;
-        }
+    return cmdset_execute_preset_ex(manager, name, additional_args, CMDSET_EXEC_WAIT);
+}
+
+// Everything up to the fork: takes a concurrency slot, counts the run,
+// decrypts the command and spawns it. run->sync must be set by the caller.
+static int run_start(cmdset_manager_t *manager, const char *name, const char *additional_args, int flags, struct cmdset_run *run) {
+    run->manager = manager;
+    strncpy(run->name, name, MAX_NAME_LEN - 1);
+    run->name[MAX_NAME_LEN - 1] = '\0';
+    run->pid = -1;
+    run->pidfd = -1;
+    run->slot_fd = -1;
+    run->finished = 0;
+    run->status = -1;
+    // A limited preset first takes a slot, so runs turned away are not counted.
+    cmdset_snapshot_t *reader;
+    const store_version_t *version = version_pin(manager, &reader);
+    const cmdset_preset_t *found = version != NULL ? version_find(version, name) : NULL;
+    int limit = found != NULL ? version->limits[found - version->presets] : 0;
+    if (version != NULL) version_unpin(manager, version, reader);
+    int slot_fd = -1;
+    if (limit > 0) {
+        slot_fd = concurrency_acquire(manager, name, limit, !(flags & CMDSET_EXEC_NOWAIT));
+        if (slot_fd < 0) return slot_fd;
     }
-    if (preset == NULL) {
+    // The lock is dropped before running the command, so the preset is copied out.
+    struct cmdset_state *state = state_lock(manager, 0);
+    int slot = find_slot(manager, name);
+    if (slot < 0) {
+        state_unlock(state);
+        if (slot_fd >= 0) close(slot_fd);
         strcpy(last_error_message, "Preset not found");
         return CMDSET_ERROR_NOT_FOUND;
     }
-    preset->last_used = time(NULL);
-    preset->use_count++;
+    cmdset_preset_t *preset = &manager->presets[slot];
+    __atomic_store_n(&preset->last_used, (long)time(NULL), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&preset->use_count, 1, __ATOMIC_RELAXED);
+    if (state != NULL) pthread_mutex_lock(&state->rank_lock);
+    rank_promote(manager, slot);
+    if (state != NULL) snapshot_touch(state, preset, NULL);
+    if (state != NULL) pthread_mutex_unlock(&state->rank_lock);
+    dirty_mark(state);
+    cmdset_ctx_t *context = manager_ctx(manager);
+    int encrypt = preset->encrypt;
+    sched_profile_t profile;
+    if (state != NULL) profile = state->profiles[slot];
+    else memset(&profile, 0, sizeof(profile));
+    char stored_command[MAX_COMMAND_LEN];
+    memcpy(stored_command, preset->command, MAX_COMMAND_LEN);
+    state_unlock(state);
     char command_to_execute[MAX_COMMAND_LEN];
-    if (preset->encrypt) {
-        if (decrypt_command_internal(preset->command, command_to_execute, name) != 0) {
+    if (encrypt) {
+        int decrypted = decrypt_command_internal(context, stored_command, command_to_execute, name);
+        memset(stored_command, 0, MAX_COMMAND_LEN);
+        if (decrypted != 0) {
+            if (slot_fd >= 0) close(slot_fd);
             strcpy(last_error_message, "Incorrect password or decryption failed");
             return CMDSET_ERROR_ENCRYPTION;
         }
-    } else strcpy(command_to_execute, preset->command);
+    } else strcpy(command_to_execute, stored_command);
     if (additional_args != NULL && strlen(additional_args) > 0) {
         strcat(command_to_execute, " ");
         strcat(command_to_execute, additional_args);
     }
-    int result = system(command_to_execute);
-    if (preset->encrypt) memset(command_to_execute, 0, MAX_COMMAND_LEN);
-    return result;
+    if (run->sync) {
+        struct sigaction child_int, child_quit;
+        signals_hold(&run->saved_mask, &child_int, &child_quit);
+        clock_gettime(CLOCK_MONOTONIC, &run->started);
+        run->pid = command_spawn(command_to_execute, &profile, &child_int, &child_quit, &run->saved_mask);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &run->started);
+        run->pid = command_spawn(command_to_execute, &profile, NULL, NULL, NULL);
+    }
+    if (encrypt) memset(command_to_execute, 0, MAX_COMMAND_LEN);
+    run->slot_fd = slot_fd;
+    if (run->pid < 0) {
+        if (run->sync) signals_release(&run->saved_mask);
+        if (slot_fd >= 0) close(slot_fd);
+        snprintf(last_error_message, sizeof(last_error_message), "Could not start command: %s", strerror(errno));
+        return CMDSET_ERROR_MEMORY;
+    }
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    if (!run->sync) run->pidfd = (int)syscall(SYS_pidfd_open, run->pid, 0);
+#endif
+    return CMDSET_SUCCESS;
 }
 
-int cmdset_list_presets(cmdset_manager_t *manager, char *output, int max_len) {
-    if (manager == NULL || output == NULL) {
+// Reaps a started run, records what it cost and releases its slot. Returns
+// 1 once it has finished, 0 while it is still running.
+static int run_reap(struct cmdset_run *run, int blocking) {
+    if (run->finished) return 1;
+    struct rusage resources;
+    pid_t waited;
+    while ((waited = wait4(run->pid, &run->status, blocking ? 0 : WNOHANG, &resources)) < 0 && errno == EINTR) {}
+    if (waited == 0) return 0;
+    cmdset_usage_t usage;
+    memset(&usage, 0, sizeof(usage));
+    if (waited > 0) {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        usage.runs = 1;
+        usage.wall_seconds = (finished.tv_sec - run->started.tv_sec) + (finished.tv_nsec - run->started.tv_nsec) / 1e9;
+        usage.last_wall_seconds = usage.wall_seconds;
+        usage.user_seconds = resources.ru_utime.tv_sec + resources.ru_utime.tv_usec / 1e6;
+        usage.system_seconds = resources.ru_stime.tv_sec + resources.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+        usage.max_rss_kb = resources.ru_maxrss / 1024;
+#else
+        usage.max_rss_kb = resources.ru_maxrss;
+#endif
+        usage.in_blocks = resources.ru_inblock;
+        usage.out_blocks = resources.ru_oublock;
+    } else run->status = -1;
+    run->finished = 1;
+    if (run->sync) signals_release(&run->saved_mask);
+    if (run->slot_fd >= 0) close(run->slot_fd);
+    if (run->pidfd >= 0) close(run->pidfd);
+    run->slot_fd = -1;
+    run->pidfd = -1;
+    if (usage.runs > 0) {
+        cmdset_manager_t *manager = run->manager;
+        struct cmdset_state *state = state_lock(manager, 0);
+        int slot = find_slot(manager, run->name);
+        if (state != NULL && slot >= 0) {
+            pthread_mutex_lock(&state->rank_lock);
+            usage_add(&state->usage[slot], &usage);
+            snapshot_touch(state, &manager->presets[slot], &state->usage[slot]);
+            pthread_mutex_unlock(&state->rank_lock);
+            dirty_mark(state);
+        }
+        state_unlock(state);
+    }
+    return 1;
+}
+
+int cmdset_execute_preset_ex(cmdset_manager_t *manager, const char *name, const char *additional_args, int flags) {
+    if (manager == NULL || name == NULL) {
         strcpy(last_error_message, "Invalid parameters");
         return CMDSET_ERROR_INVALID;
     }
-    int active_count = 0;
+    struct cmdset_run run;
+    run.sync = 1;
+    int result = run_start(manager, name, additional_args, flags, &run);
+    if (result != CMDSET_SUCCESS) return result;
+    run_reap(&run, 1);
+    return run.status;
+}
+
+static int list_version(const store_version_t *version, char *output, int max_len) {
     int offset = 0;
-    offset += snprintf(output + offset, max_len - offset, "Presets:\n");
-    offset += snprintf(output + offset, max_len - offset, "--------\n");
-    for (int i = 0; i < manager->count; i++) {
-        if (manager->presets[i].active) {
-            if (manager->presets[i].encrypt) {
-                offset += snprintf(output + offset, max_len - offset, 
-                    "%d. %s: [ENCRYPTED] (command hidden)\n", 
-                    active_count + 1, manager->presets[i].name);
-            } else {
-                offset += snprintf(output + offset, max_len - offset, 
-                    "%d. %s: %s\n", 
-                    active_count + 1, manager->presets[i].name, 
-                    manager->presets[i].command);
-            }
-            active_count++;
+    int truncated = 0;
+    output[0] = '\0';
+    append_output(output, max_len, &offset, &truncated, "Presets:\n");
+    append_output(output, max_len, &offset, &truncated, "--------\n");
+    for (int i = 0; i < version->count; i++) {
+        const cmdset_preset_t *preset = &version->presets[i];
+        if (preset->encrypt) {
+            append_output(output, max_len, &offset, &truncated,
+                "%d. %s: [ENCRYPTED] (command hidden)\n", i + 1, preset->name);
+        } else {
+            append_output(output, max_len, &offset, &truncated,
+                "%d. %s: %s\n", i + 1, preset->name, preset->command);
         }
     }
-    if (active_count == 0) offset += snprintf(output + offset, max_len - offset, "No presets found\n");
-    else offset += snprintf(output + offset, max_len - offset, "\nTotal: %d preset(s)\n", active_count);
+    if (version->count == 0) append_output(output, max_len, &offset, &truncated, "No presets found\n");
+    else append_output(output, max_len, &offset, &truncated, "\nTotal: %d preset(s)\n", version->count);
+    if (truncated) {
+        strcpy(last_error_message, "Output buffer too small, use cmdset_write_presets");
+        return CMDSET_ERROR_TRUNCATED;
+    }
     return CMDSET_SUCCESS;
 }
 
-int cmdset_find_preset(cmdset_manager_t *manager, const char *name, cmdset_preset_t *preset) {
-    if (manager == NULL || name == NULL || preset == NULL) {
+int cmdset_list_presets(cmdset_manager_t *manager, char *output, int max_len) {
+    if (manager == NULL || output == NULL || max_len <= 0) {
         strcpy(last_error_message, "Invalid parameters");
         return CMDSET_ERROR_INVALID;
     }
-    for (int i = 0; i < manager->count; i++) {
-        if (manager->presets[i].active && strcmp(manager->presets[i].name, name) == 0) {
-            *preset = manager->presets[i];
-            return CMDSET_SUCCESS;
-        }
+    cmdset_snapshot_t *reader;
+    const store_version_t *version = version_pin(manager, &reader);
+    if (version == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
     }
-    strcpy(last_error_message, "Preset not found");
-    return CMDSET_ERROR_NOT_FOUND;
+    int result = list_version(version, output, max_len);
+    version_unpin(manager, version, reader);
+    return result;
 }
 
-int cmdset_save_presets(cmdset_manager_t *manager) {
-    if (manager == NULL) {
-        strcpy(last_error_message, "Manager is NULL");
+int cmdset_find_preset(cmdset_manager_t *manager, const char *name, cmdset_preset_t *preset) {
+    if (manager == NULL || name == NULL || preset == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
         return CMDSET_ERROR_INVALID;
     }
-    json_object *root = json_object_new_object();
-    if (root == NULL) {
-        strcpy(last_error_message, "Could not create JSON object");
-        return CMDSET_ERROR_JSON;
-    }
-    json_object *version = json_object_new_string("2.0");
-    json_object_object_add(root, "version", version);
-    json_object *presets_array = json_object_new_array();
-    if (presets_array == NULL) {
-        json_object_put(root);
-        strcpy(last_error_message, "Could not create presets array");
-        return CMDSET_ERROR_JSON;
+    cmdset_snapshot_t *reader;
+    const store_version_t *version = version_pin(manager, &reader);
+    if (version == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
     }
-    for (int i = 0; i < manager->count; i++) {
-        if (manager->presets[i].active) {
-            json_object *preset = json_object_new_object();
-            if (preset == NULL) {
-                json_object_put(root);
-                strcpy(last_error_message, "Could not create preset object");
-                return CMDSET_ERROR_JSON;
-            }
-            json_object_object_add(preset, "name", json_object_new_string(manager->presets[i].name));
-            json_object_object_add(preset, "command", json_object_new_string(manager->presets[i].command));
-            json_object_object_add(preset, "encrypt", json_object_new_boolean(manager->presets[i].encrypt));
-            json_object_object_add(preset, "created_at", json_object_new_int64(manager->presets[i].created_at));
-            json_object_object_add(preset, "last_used", json_object_new_int64(manager->presets[i].last_used));
-            json_object_object_add(preset, "use_count", json_object_new_int(manager->presets[i].use_count));
-            json_object_array_add(presets_array, preset);
-        }
+    const cmdset_preset_t *found = version_find(version, name);
+    if (found != NULL) copy_preset(preset, found);
+    version_unpin(manager, version, reader);
+    if (found == NULL) {
+        strcpy(last_error_message, "Preset not found");
+        return CMDSET_ERROR_NOT_FOUND;
     }
-    json_object_object_add(root, "presets", presets_array);
+    return CMDSET_SUCCESS;
+}
+
+static int save_version(cmdset_manager_t *manager, const store_version_t *version) {
+    json_object *root = version_to_json(version, 0);
+    if (root == NULL) return CMDSET_ERROR_JSON;
     const char *json_string = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PRETTY);
     if (json_string == NULL) {
         json_object_put(root);
         strcpy(last_error_message, "Could not generate JSON string");
         return CMDSET_ERROR_JSON;
     }
-    FILE *file = fopen(PRESET_FILE, "w");
-    if (file == NULL) {
-        json_object_put(root);
-        snprintf(last_error_message, sizeof(last_error_message), "Could not save presets to file: %s", strerror(errno));
-        return CMDSET_ERROR_FILE;
+    int result = store_write(manager, json_string);
+    if (result == CMDSET_SUCCESS) {
+        uint64_t store_hash = hash_content(json_string, strlen(json_string));
+        if (manager->state != NULL) manager->state->store_hash = store_hash;
+        unsaved_clear(manager->state);
+        index_save(manager, store_hash);
+        completion_save(manager);
     }
-    fprintf(file, "%s", json_string);
-    fclose(file);
     json_object_put(root);
-    return CMDSET_SUCCESS;
+    return result;
 }
 
-int cmdset_load_presets(cmdset_manager_t *manager) {
+int cmdset_save_presets(cmdset_manager_t *manager) {
     if (manager == NULL) {
         strcpy(last_error_message, "Manager is NULL");
         return CMDSET_ERROR_INVALID;
     }
-    FILE *file = fopen(PRESET_FILE, "r");
-    if (file == NULL) {
+    // Saving only reads the store, so readers carry on while it writes.
+    struct cmdset_state *state = state_lock(manager, 0);
+    if (state != NULL) pthread_mutex_lock(&state->save_lock);
+    int pending = dirty_count(state);
+    cmdset_snapshot_t *reader = snapshot_enter(state);
+    const store_version_t *version = reader != NULL ? reader->version : NULL;
+    if (reader == NULL) {
+        if (state != NULL) pthread_mutex_lock(&state->rank_lock);
+        version = snapshot_build(manager, NULL, NULL, 0);
+        if (state != NULL) pthread_mutex_unlock(&state->rank_lock);
+    }
+    int result = CMDSET_ERROR_MEMORY;
+    if (version == NULL) strcpy(last_error_message, "Memory allocation failed");
+    else result = save_version(manager, version);
+    if (result == CMDSET_SUCCESS) dirty_clear(state, pending);
+    if (reader != NULL) cmdset_snapshot_release(reader);
+    else mem_free((void *)version);
+    if (state != NULL) pthread_mutex_unlock(&state->save_lock);
+    state_unlock(state);
+    return result;
+}
+
+static int load_presets_unlocked(cmdset_manager_t *manager) {
+    if (manager == NULL) {
+        strcpy(last_error_message, "Manager is NULL");
+        return CMDSET_ERROR_INVALID;
+    }
+    char *content;
+    size_t content_len;
+    int result = store_read(manager, &content, &content_len);
+    if (result == CMDSET_ERROR_NOT_FOUND || result == CMDSET_ERROR_FILE) {
         manager->count = 0;
+        if (get_state(manager) != NULL) tags_clear(manager->state);
+        unsaved_clear(manager->state);
+        rank_rebuild(manager);
+        index_rebuild(manager);
+        trie_rebuild(manager);
+        bk_rebuild(manager);
         return CMDSET_SUCCESS;
     }
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    char *content = malloc(file_size + 1);
-    if (content == NULL) {
-        fclose(file);
-        strcpy(last_error_message, "Memory allocation failed");
-        return CMDSET_ERROR_MEMORY;
-    }
-    fread(content, 1, file_size, file);
-    content[file_size] = '\0';
-    fclose(file);
+    if (result != CMDSET_SUCCESS) return result;
+    uint64_t store_hash = hash_content(content, content_len);
     json_object *root = json_tokener_parse(content);
-    free(content);
+    mem_free(content);
     if (root == NULL) {
         strcpy(last_error_message, "Could not parse JSON file");
         return CMDSET_ERROR_JSON;
     }
     manager->count = 0;
+    if (get_state(manager) != NULL) tags_clear(manager->state);
+    unsaved_clear(manager->state);
     json_object *presets_array;
     if (json_object_object_get_ex(root, "presets", &presets_array) && 
         json_object_is_type(presets_array, json_type_array)) {
@@ -310,90 +1010,35 @@ int cmdset_load_presets(cmdset_manager_t *manager) {
         for (int i = 0; i < array_size && manager->count < MAX_PRESETS; i++) {
             json_object *preset = json_object_array_get_idx(presets_array, i);
             if (preset != NULL) {
-                manager->presets[manager->count].active = 1;
-                json_object *name_item;
-                if (json_object_object_get_ex(preset, "name", &name_item) && 
-                    json_object_is_type(name_item, json_type_string)) {
-                    const char *name_str = json_object_get_string(name_item);
-                    strncpy(manager->presets[manager->count].name, name_str, MAX_NAME_LEN - 1);
-                    manager->presets[manager->count].name[MAX_NAME_LEN - 1] = '\0';
-                }
-                json_object *command_item;
-                if (json_object_object_get_ex(preset, "command", &command_item) && 
-                    json_object_is_type(command_item, json_type_string)) {
-                    const char *command_str = json_object_get_string(command_item);
-                    strncpy(manager->presets[manager->count].command, command_str, MAX_COMMAND_LEN - 1);
-                    manager->presets[manager->count].command[MAX_COMMAND_LEN - 1] = '\0';
-                }
-                json_object *encrypt_item;
-                if (json_object_object_get_ex(preset, "encrypt", &encrypt_item)) {
-                    manager->presets[manager->count].encrypt = json_object_get_boolean(encrypt_item) ? 1 : 0;
-                } else manager->presets[manager->count].encrypt = 0;
-                json_object *created_item;
-                if (json_object_object_get_ex(preset, "created_at", &created_item) && 
-                    json_object_is_type(created_item, json_type_int)) {
-                    manager->presets[manager->count].created_at = (time_t)json_object_get_int64(created_item);
-                } else manager->presets[manager->count].created_at = time(NULL);
-                json_object *last_used_item;
-                if (json_object_object_get_ex(preset, "last_used", &last_used_item) && 
-                    json_object_is_type(last_used_item, json_type_int)) {
-                    manager->presets[manager->count].last_used = (time_t)json_object_get_int64(last_used_item);
-                } else manager->presets[manager->count].last_used = 0;
-                json_object *use_count_item;
-                if (json_object_object_get_ex(preset, "use_count", &use_count_item) && 
-                    json_object_is_type(use_count_item, json_type_int)) {
-                    manager->presets[manager->count].use_count = json_object_get_int(use_count_item);
-                } else manager->presets[manager->count].use_count = 0;
+                preset_from_json(preset, &manager->presets[manager->count]);
+                tags_from_json(manager, manager->count, preset);
+                limit_from_json(manager, manager->count, preset);
+                sched_from_json(manager, manager->count, preset);
+                usage_from_json(manager, manager->count, preset, 0);
                 manager->count++;
             }
         }
     }
     json_object_put(root);
+    rank_rebuild(manager);
+    trie_rebuild(manager);
+    bk_rebuild(manager);
+    if (index_load(manager, store_hash) != CMDSET_SUCCESS) index_rebuild(manager);
+    if (manager->state != NULL) manager->state->store_hash = store_hash;
     return CMDSET_SUCCESS;
 }
 
-int cmdset_export_presets(cmdset_manager_t *manager, const char *filename) {
-    if (manager == NULL || filename == NULL) {
-        strcpy(last_error_message, "Invalid parameters");
-        return CMDSET_ERROR_INVALID;
-    }
-    json_object *root = json_object_new_object();
-    if (root == NULL) {
-        strcpy(last_error_message, "Could not create JSON object");
-        return CMDSET_ERROR_JSON;
-    }
-    json_object *version = json_object_new_string("2.0");
-    json_object_object_add(root, "version", version);
-    json_object *exported_at = json_object_new_int64(time(NULL));
-    json_object_object_add(root, "exported_at", exported_at);
-    json_object *presets_array = json_object_new_array();
-    if (presets_array == NULL) {
-        json_object_put(root);
-        strcpy(last_error_message, "Could not create presets array");
-        return CMDSET_ERROR_JSON;
-    }
-    int exported_count = 0;
-    for (int i = 0; i < manager->count; i++) {
-        if (manager->presets[i].active) {
-            json_object *preset = json_object_new_object();
-            if (preset == NULL) {
-                json_object_put(root);
-                strcpy(last_error_message, "Could not create preset object");
-                return CMDSET_ERROR_JSON;
-            }
-            json_object_object_add(preset, "name", json_object_new_string(manager->presets[i].name));
-            json_object_object_add(preset, "command", json_object_new_string(manager->presets[i].command));
-            json_object_object_add(preset, "encrypt", json_object_new_boolean(manager->presets[i].encrypt));
-            json_object_object_add(preset, "created_at", json_object_new_int64(manager->presets[i].created_at));
-            json_object_object_add(preset, "last_used", json_object_new_int64(manager->presets[i].last_used));
-            json_object_object_add(preset, "use_count", json_object_new_int(manager->presets[i].use_count));
-            json_object_array_add(presets_array, preset);
-            exported_count++;
-        }
-    }
-    json_object_object_add(root, "presets", presets_array);
-    json_object *count = json_object_new_int(exported_count);
-    json_object_object_add(root, "count", count);
+int cmdset_load_presets(cmdset_manager_t *manager) {
+    struct cmdset_state *state = state_lock(manager, 1);
+    int result = load_presets_unlocked(manager);
+    if (result == CMDSET_SUCCESS) dirty_clear(state, -1);
+    state_unlock(state);
+    return result;
+}
+
+static int export_version(const store_version_t *version, const char *filename) {
+    json_object *root = version_to_json(version, 1);
+    if (root == NULL) return CMDSET_ERROR_JSON;
     const char *json_string = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PRETTY);
     if (json_string == NULL) {
         json_object_put(root);
@@ -412,7 +1057,24 @@ int cmdset_export_presets(cmdset_manager_t *manager, const char *filename) {
     return CMDSET_SUCCESS;
 }
 
-int cmdset_import_presets(cmdset_manager_t *manager, const char *filename) {
+// Exports run from a pinned snapshot, so they never hold up writers.
+int cmdset_export_presets(cmdset_manager_t *manager, const char *filename) {
+    if (manager == NULL || filename == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    cmdset_snapshot_t *reader;
+    const store_version_t *version = version_pin(manager, &reader);
+    if (version == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    int result = export_version(version, filename);
+    version_unpin(manager, version, reader);
+    return result;
+}
+
+static int import_presets_unlocked(cmdset_manager_t *manager, const char *filename) {
     if (manager == NULL || filename == NULL) {
         strcpy(last_error_message, "Invalid parameters");
         return CMDSET_ERROR_INVALID;
@@ -425,120 +1087,4057 @@ int cmdset_import_presets(cmdset_manager_t *manager, const char *filename) {
     fseek(file, 0, SEEK_END);
     long file_size = ftell(file);
     fseek(file, 0, SEEK_SET);
-    char *content = malloc(file_size + 1);
+    char *content = mem_malloc(file_size + 1);
     if (content == NULL) {
         fclose(file);
         strcpy(last_error_message, "Memory allocation failed");
         return CMDSET_ERROR_MEMORY;
     }
-    fread(content, 1, file_size, file);
-    content[file_size] = '\0';
-    fclose(file);
-    json_object *root = json_tokener_parse(content);
-    free(content);
-    if (root == NULL) {
-        strcpy(last_error_message, "Could not parse JSON file");
-        return CMDSET_ERROR_JSON;
+    fread(content, 1, file_size, file);
+    content[file_size] = '\0';
+    fclose(file);
+    json_object *root = json_tokener_parse(content);
+    mem_free(content);
+    if (root == NULL) {
+        strcpy(last_error_message, "Could not parse JSON file");
+        return CMDSET_ERROR_JSON;
+    }
+    json_object *presets_array;
+    if (!json_object_object_get_ex(root, "presets", &presets_array) || 
+        !json_object_is_type(presets_array, json_type_array)) {
+        json_object_put(root);
+        strcpy(last_error_message, "Invalid preset file format - missing presets array");
+        return CMDSET_ERROR_JSON;
+    }
+    int array_size = json_object_array_length(presets_array);
+    for (int i = 0; i < array_size; i++) {
+        if (manager->count >= MAX_PRESETS) presets_compact(manager);
+        if (manager->count >= MAX_PRESETS) break;
+        json_object *preset = json_object_array_get_idx(presets_array, i);
+        if (preset != NULL) {
+            json_object *name_item;
+            if (!json_object_object_get_ex(preset, "name", &name_item) || 
+                !json_object_is_type(name_item, json_type_string)) {
+                continue;
+            }
+            const char *name_str = json_object_get_string(name_item);
+            if (find_slot(manager, name_str) >= 0) continue;
+            manager->presets[manager->count].active = 1;
+            strncpy(manager->presets[manager->count].name, name_str, MAX_NAME_LEN - 1);
+            manager->presets[manager->count].name[MAX_NAME_LEN - 1] = '\0';
+            json_object *command_item;
+            if (json_object_object_get_ex(preset, "command", &command_item) && 
+                json_object_is_type(command_item, json_type_string)) {
+                const char *command_str = json_object_get_string(command_item);
+                strncpy(manager->presets[manager->count].command, command_str, MAX_COMMAND_LEN - 1);
+                manager->presets[manager->count].command[MAX_COMMAND_LEN - 1] = '\0';
+            } else continue;
+            json_object *encrypt_item;
+            if (json_object_object_get_ex(preset, "encrypt", &encrypt_item)) manager->presets[manager->count].encrypt = json_object_get_boolean(encrypt_item) ? 1 : 0;
+            else manager->presets[manager->count].encrypt = 0;
+            json_object *created_item;
+            if (json_object_object_get_ex(preset, "created_at", &created_item) && 
+                json_object_is_type(created_item, json_type_int)) {
+                manager->presets[manager->count].created_at = (time_t)json_object_get_int64(created_item);
+            } else manager->presets[manager->count].created_at = time(NULL);
+            json_object *last_used_item;
+            if (json_object_object_get_ex(preset, "last_used", &last_used_item) && 
+                json_object_is_type(last_used_item, json_type_int)) {
+                manager->presets[manager->count].last_used = (time_t)json_object_get_int64(last_used_item);
+            } else manager->presets[manager->count].last_used = 0;
+            json_object *use_count_item;
+            if (json_object_object_get_ex(preset, "use_count", &use_count_item) && 
+                json_object_is_type(use_count_item, json_type_int)) {
+                manager->presets[manager->count].use_count = json_object_get_int(use_count_item);
+            } else manager->presets[manager->count].use_count = 0;
+            tags_from_json(manager, manager->count, preset);
+            limit_from_json(manager, manager->count, preset);
+            sched_from_json(manager, manager->count, preset);
+            usage_from_json(manager, manager->count, preset, 0);
+            if (manager->state != NULL) manager->state->unsaved[manager->count] = UNSAVED_ADDED;
+            index_add(manager, manager->count);
+            if (get_state(manager) != NULL) trie_insert(manager->state, manager->presets[manager->count].name, manager->count);
+            bk_insert(manager, manager->count);
+            manager->count++;
+        }
+    }
+    json_object_put(root);
+    rank_rebuild(manager);
+    return CMDSET_SUCCESS;
+}
+
+int cmdset_import_presets(cmdset_manager_t *manager, const char *filename) {
+    struct cmdset_state *state = state_lock(manager, 1);
+    int result = import_presets_unlocked(manager, filename);
+    if (result == CMDSET_SUCCESS) dirty_mark(state);
+    state_unlock(state);
+    return result;
+}
+
+int cmdset_encrypt_command(const char *plaintext, char *encrypted) {
+    return encrypt_command_internal(&default_ctx, plaintext, encrypted, NULL);
+}
+
+int cmdset_decrypt_command(const char *encrypted, char *plaintext) {
+    return decrypt_command_internal(&default_ctx, encrypted, plaintext, NULL);
+}
+
+void cmdset_cleanup(cmdset_manager_t *manager) {
+    cmdset_ctx_t *context = &default_ctx;
+    if (manager != NULL) {
+        context = manager_ctx(manager);
+        watcher_stop(manager);
+        flusher_stop(manager);
+        if (manager->state != NULL && manager->state->ctx != NULL) __atomic_sub_fetch(&context->managers, 1, __ATOMIC_SEQ_CST);
+        active_allocator = &context->allocator;
+        state_free(manager->state);
+        active_allocator = NULL;
+        memset(manager, 0, sizeof(cmdset_manager_t));
+    }
+    cmdset_ctx_clear_session(context);
+}
+
+static int get_preset_count_unlocked(cmdset_manager_t *manager) {
+    if (manager == NULL) return 0;
+    int count = 0;
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active) count++;
+    }
+    return count;
+}
+
+int cmdset_get_preset_count(cmdset_manager_t *manager) {
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = get_preset_count_unlocked(manager);
+    state_unlock(state);
+    return result;
+}
+
+static int get_preset_by_index_unlocked(cmdset_manager_t *manager, int index, cmdset_preset_t *preset) {
+    if (manager == NULL || preset == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    int current_index = 0;
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active) {
+            if (current_index == index) {
+                copy_preset(preset, &manager->presets[i]);
+                return CMDSET_SUCCESS;
+            }
+            current_index++;
+        }
+    }
+    strcpy(last_error_message, "Index out of range");
+    return CMDSET_ERROR_NOT_FOUND;
+}
+
+int cmdset_get_preset_by_index(cmdset_manager_t *manager, int index, cmdset_preset_t *preset) {
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = get_preset_by_index_unlocked(manager, index, preset);
+    state_unlock(state);
+    return result;
+}
+
+void cmdset_cursor_init(cmdset_manager_t *manager, cmdset_cursor_t *cursor) {
+    if (cursor == NULL) return;
+    cursor->manager = manager;
+    cursor->position = 0;
+    cursor->snapshot = NULL;
+    cursor->version = manager != NULL ? version_pin(manager, &cursor->snapshot) : NULL;
+}
+
+// Calls that find presets copy each one out before the lock is released, so
+// their results stay valid whatever other threads do.
+static void presets_from_slots(cmdset_manager_t *manager, const int *slots, int count, cmdset_preset_t *presets) {
+    for (int i = 0; i < count; i++) copy_preset(&presets[i], &manager->presets[slots[i]]);
+}
+
+// The pinned version never changes, so no lock is needed. A cursor whose
+// version could not be pinned fails on its first call; one that has been
+// released (position -1) just reports the end.
+int cmdset_cursor_next(cmdset_cursor_t *cursor, cmdset_preset_t *preset) {
+    if (cursor == NULL || cursor->manager == NULL || preset == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (cursor->version == NULL) {
+        if (cursor->position < 0) return 0;
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    if (cursor->position >= cursor->version->count) {
+        cmdset_cursor_release(cursor);
+        return 0;
+    }
+    copy_preset(preset, &cursor->version->presets[cursor->position++]);
+    return 1;
+}
+
+void cmdset_cursor_release(cmdset_cursor_t *cursor) {
+    if (cursor == NULL || cursor->version == NULL) return;
+    version_unpin(cursor->manager, cursor->version, cursor->snapshot);
+    cursor->snapshot = NULL;
+    cursor->version = NULL;
+    cursor->position = -1;
+}
+
+static int foreach_unlocked(cmdset_manager_t *manager, cmdset_foreach_fn callback, void *user_data) {
+    if (manager == NULL || callback == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active) {
+            int result = callback(&manager->presets[i], user_data);
+            if (result != 0) return result;
+        }
+    }
+    return CMDSET_SUCCESS;
+}
+
+int cmdset_foreach(cmdset_manager_t *manager, cmdset_foreach_fn callback, void *user_data) {
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = foreach_unlocked(manager, callback, user_data);
+    state_unlock(state);
+    return result;
+}
+
+static int set_frecency_params_unlocked(cmdset_manager_t *manager, double half_life, double count_weight) {
+    if (manager == NULL || !(half_life > 0) || !(count_weight >= 0)) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    state->half_life = half_life;
+    state->count_weight = count_weight;
+    rank_rebuild(manager);
+    return CMDSET_SUCCESS;
+}
+
+int cmdset_set_frecency_params(cmdset_manager_t *manager, double half_life, double count_weight) {
+    struct cmdset_state *state = state_lock(manager, 1);
+    int result = set_frecency_params_unlocked(manager, half_life, count_weight);
+    state_unlock(state);
+    return result;
+}
+
+static double get_frecency_unlocked(cmdset_manager_t *manager, const cmdset_preset_t *preset) {
+    if (manager == NULL || preset == NULL) return 0.0;
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return 0.0;
+    return exp2(frecency_key(state, preset) - (double)time(NULL) / state->half_life);
+}
+
+double cmdset_get_frecency(cmdset_manager_t *manager, const cmdset_preset_t *preset) {
+    struct cmdset_state *state = state_lock(manager, 0);
+    double result = get_frecency_unlocked(manager, preset);
+    state_unlock(state);
+    return result;
+}
+
+static int get_top_presets_unlocked(cmdset_manager_t *manager, int k, int *slots) {
+    if (manager == NULL || slots == NULL || k < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    pthread_mutex_lock(&state->rank_lock);
+    if (k > state->rank_count) k = state->rank_count;
+    memcpy(slots, state->rank, sizeof(int) * k);
+    pthread_mutex_unlock(&state->rank_lock);
+    return k;
+}
+
+int cmdset_get_top_presets(cmdset_manager_t *manager, int k, cmdset_preset_t *presets) {
+    int slots[MAX_PRESETS];
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = get_top_presets_unlocked(manager, k, presets != NULL ? slots : NULL);
+    if (result > 0) presets_from_slots(manager, slots, result, presets);
+    state_unlock(state);
+    return result;
+}
+
+static int search_unlocked(cmdset_manager_t *manager, const char *query, rank_entry_t *matches, int max_results) {
+    if (manager == NULL || query == NULL || matches == NULL || max_results < 0 || query[0] == '\0') {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    size_t query_len = strlen(query);
+    // Every match is scored and ranked, best score then name first, before
+    // truncating to max_results.
+    int found = 0;
+    for (int i = 0; i < manager->count; i++) {
+        const cmdset_preset_t *preset = &manager->presets[i];
+        if (!preset->active) continue;
+        int score = fuzzy_score(preset->name, query, query_len);
+        if (!preset->encrypt && find_substring(preset->command, strlen(preset->command), query, query_len) != NULL) score += SEARCH_COMMAND_SCORE;
+        if (score <= 0) continue;
+        rank_entry_t entry = {score, i};
+        int j = found++ - 1;
+        while (j >= 0 && (matches[j].key < entry.key || (matches[j].key == entry.key && strcmp(manager->presets[matches[j].slot].name, preset->name) > 0))) {
+            matches[j + 1] = matches[j];
+            j--;
+        }
+        matches[j + 1] = entry;
+    }
+    return found < max_results ? found : max_results;
+}
+
+int cmdset_search(cmdset_manager_t *manager, const char *query, cmdset_search_result_t *results, int max_results) {
+    rank_entry_t matches[MAX_PRESETS];
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = search_unlocked(manager, query, results != NULL ? matches : NULL, max_results);
+    for (int i = 0; i < result; i++) {
+        copy_preset(&results[i].preset, &manager->presets[matches[i].slot]);
+        results[i].score = (int)matches[i].key;
+    }
+    state_unlock(state);
+    return result;
+}
+
+static int is_token_char(char c) {
+    return isalnum((unsigned char)c) || c == '.' || c == '_' || c == '-';
+}
+
+// Reads the next lowercased token from *cursor into token, which must hold
+// MAX_COMMAND_LEN bytes. Returns the token length, or 0 at the end of input.
+static size_t next_token(const char **cursor, char *token) {
+    const char *p = *cursor;
+    while (*p != '\0' && !is_token_char(*p)) p++;
+    size_t length = 0;
+    while (*p != '\0' && is_token_char(*p)) {
+        if (length < MAX_COMMAND_LEN - 1) token[length++] = (char)tolower((unsigned char)*p);
+        p++;
+    }
+    token[length] = '\0';
+    *cursor = p;
+    return length;
+}
+
+static int intersect_postings(int *result, int result_count, const int *other, int other_count) {
+    int i = 0, j = 0, count = 0;
+    while (i < result_count && j < other_count) {
+        if (result[i] < other[j]) i++;
+        else if (result[i] > other[j]) j++;
+        else {
+            result[count++] = result[i];
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+// Expressions are whitespace-separated tokens where juxtaposition or AND
+// intersects and OR unions, with AND binding tighter than OR.
+static int lookup_tokens_unlocked(cmdset_manager_t *manager, const char *expression, int *slots, int max_presets) {
+    if (manager == NULL || expression == NULL || slots == NULL || max_presets < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = get_state(manager);
+    unsigned char *matched = mem_calloc(manager->count + 1, 1);
+    int *group = mem_malloc(sizeof(int) * (manager->count + 1));
+    int *ids = mem_malloc(sizeof(int) * (manager->count + 1));
+    char *word = mem_malloc(strlen(expression) + 1);
+    char token[MAX_COMMAND_LEN];
+    if (state == NULL || matched == NULL || group == NULL || ids == NULL || word == NULL) {
+        mem_free(matched);
+        mem_free(group);
+        mem_free(ids);
+        mem_free(word);
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    const char *p = expression;
+    int group_count = -1;
+    int terms = 0;
+    for (;;) {
+        while (*p == ' ' || *p == '\t') p++;
+        size_t word_len = strcspn(p, " \t");
+        memcpy(word, p, word_len);
+        word[word_len] = '\0';
+        p += word_len;
+        if (word_len == 0 || strcmp(word, "OR") == 0) {
+            for (int i = 0; i < group_count; i++) matched[group[i]] = 1;
+            group_count = -1;
+            if (word_len == 0) break;
+            continue;
+        }
+        if (strcmp(word, "AND") == 0) continue;
+        const char *cursor = word;
+        while (next_token(&cursor, token) > 0) {
+            terms++;
+            const token_entry_t *entry = index_entry(&state->index, token, 0);
+            int count = entry != NULL ? posting_decode(entry, ids) : 0;
+            if (group_count < 0) {
+                memcpy(group, ids, sizeof(int) * count);
+                group_count = count;
+            } else group_count = intersect_postings(group, group_count, ids, count);
+        }
+    }
+    mem_free(group);
+    mem_free(ids);
+    mem_free(word);
+    if (terms == 0) {
+        mem_free(matched);
+        strcpy(last_error_message, "No tokens in lookup expression");
+        return CMDSET_ERROR_INVALID;
+    }
+    int found = 0;
+    for (int i = 0; i < manager->count && found < max_presets; i++) {
+        if (matched[i] && manager->presets[i].active) slots[found++] = i;
+    }
+    mem_free(matched);
+    return found;
+}
+
+int cmdset_lookup_tokens(cmdset_manager_t *manager, const char *expression, cmdset_preset_t *presets, int max_presets) {
+    int slots[MAX_PRESETS];
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = lookup_tokens_unlocked(manager, expression, presets != NULL ? slots : NULL, max_presets);
+    if (result > 0) presets_from_slots(manager, slots, result, presets);
+    state_unlock(state);
+    return result;
+}
+
+static int tag_preset_unlocked(cmdset_manager_t *manager, const char *name, const char *tag) {
+    if (manager == NULL || name == NULL || tag == NULL || !is_valid_tag(tag)) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    int slot = find_slot(manager, name);
+    if (slot < 0) {
+        strcpy(last_error_message, "Preset not found");
+        return CMDSET_ERROR_NOT_FOUND;
+    }
+    int result = tag_attach(manager, slot, tag);
+    if (result != CMDSET_SUCCESS) strcpy(last_error_message, "Could not add tag");
+    else if (manager->state != NULL) manager->state->unsaved[slot] |= UNSAVED_TAGS;
+    return result;
+}
+
+int cmdset_tag_preset(cmdset_manager_t *manager, const char *name, const char *tag) {
+    struct cmdset_state *state = state_lock(manager, 1);
+    int result = tag_preset_unlocked(manager, name, tag);
+    if (result == CMDSET_SUCCESS) dirty_mark(state);
+    state_unlock(state);
+    return result;
+}
+
+static int untag_preset_unlocked(cmdset_manager_t *manager, const char *name, const char *tag) {
+    if (manager == NULL || name == NULL || tag == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    int slot = find_slot(manager, name);
+    if (slot < 0) {
+        strcpy(last_error_message, "Preset not found");
+        return CMDSET_ERROR_NOT_FOUND;
+    }
+    int result = tag_detach(manager, slot, tag);
+    if (result != CMDSET_SUCCESS) strcpy(last_error_message, "Preset does not have that tag");
+    else if (manager->state != NULL) manager->state->unsaved[slot] |= UNSAVED_TAGS;
+    return result;
+}
+
+int cmdset_untag_preset(cmdset_manager_t *manager, const char *name, const char *tag) {
+    struct cmdset_state *state = state_lock(manager, 1);
+    int result = untag_preset_unlocked(manager, name, tag);
+    if (result == CMDSET_SUCCESS) dirty_mark(state);
+    state_unlock(state);
+    return result;
+}
+
+// The preset is found by name, so copies handed out by other calls work too.
+static int get_preset_tags_unlocked(cmdset_manager_t *manager, const cmdset_preset_t *preset, const char **tags, int max_tags) {
+    if (manager == NULL || preset == NULL || tags == NULL || max_tags < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    int slot = find_slot(manager, preset->name);
+    if (slot < 0) {
+        strcpy(last_error_message, "Preset not found");
+        return CMDSET_ERROR_NOT_FOUND;
+    }
+    const preset_tags_t *slot_tags = &state->slot_tags[slot];
+    int count = 0;
+    for (int i = 0; i < slot_tags->count && count < max_tags; i++) tags[count++] = state->tag_names[slot_tags->ids[i]];
+    return count;
+}
+
+// Tag names are freed when the store is loaded or merged, so this copies
+// them out before the lock is released.
+int cmdset_get_preset_tags(cmdset_manager_t *manager, const cmdset_preset_t *preset, char (*tags)[MAX_TAG_LEN], int max_tags) {
+    if (tags == NULL || max_tags < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = state_lock(manager, 0);
+    const char **names = mem_malloc(sizeof(char *) * (max_tags + 1));
+    int result = CMDSET_ERROR_MEMORY;
+    if (names == NULL) strcpy(last_error_message, "Memory allocation failed");
+    else result = get_preset_tags_unlocked(manager, preset, names, max_tags);
+    for (int i = 0; i < result; i++) strcpy(tags[i], names[i]);
+    mem_free(names);
+    state_unlock(state);
+    return result;
+}
+
+static int compare_bitmap_cardinality(const void *a, const void *b) {
+    return roaring_cardinality(*(const roaring_t * const *)a) - roaring_cardinality(*(const roaring_t * const *)b);
+}
+
+// Resolves presets carrying every given tag by intersecting the two smallest
+// tag bitmaps container by container, then probing the rest with the result.
+static int filter_by_tags_unlocked(cmdset_manager_t *manager, const char **tags, int tag_count, int *found_slots, int max_presets) {
+    if (manager == NULL || tags == NULL || tag_count <= 0 || found_slots == NULL || max_presets < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = get_state(manager);
+    const roaring_t **bitmaps = mem_malloc(sizeof(roaring_t *) * tag_count);
+    if (state == NULL || bitmaps == NULL) {
+        mem_free(bitmaps);
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    for (int i = 0; i < tag_count; i++) {
+        int id = tag_id(state, tags[i], 0);
+        if (id < 0) {
+            mem_free(bitmaps);
+            return 0;
+        }
+        bitmaps[i] = &state->tag_bitmaps[id];
+    }
+    qsort(bitmaps, tag_count, sizeof(roaring_t *), compare_bitmap_cardinality);
+    uint32_t *slots = mem_malloc(sizeof(uint32_t) * (roaring_cardinality(bitmaps[0]) + 1));
+    if (slots == NULL) {
+        mem_free(bitmaps);
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    int count = tag_count == 1 ? roaring_values(bitmaps[0], slots) : roaring_and_values(bitmaps[0], bitmaps[1], slots);
+    for (int i = 2; i < tag_count && count > 0; i++) {
+        int kept = 0;
+        for (int j = 0; j < count; j++) {
+            if (roaring_contains(bitmaps[i], slots[j])) slots[kept++] = slots[j];
+        }
+        count = kept;
+    }
+    int found = 0;
+    for (int i = 0; i < count && found < max_presets; i++) found_slots[found++] = (int)slots[i];
+    mem_free(slots);
+    mem_free(bitmaps);
+    return found;
+}
+
+int cmdset_filter_by_tags(cmdset_manager_t *manager, const char **tags, int tag_count, cmdset_preset_t *presets, int max_presets) {
+    int slots[MAX_PRESETS];
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = filter_by_tags_unlocked(manager, tags, tag_count, presets != NULL ? slots : NULL, max_presets < MAX_PRESETS ? max_presets : MAX_PRESETS);
+    if (result > 0) presets_from_slots(manager, slots, result, presets);
+    state_unlock(state);
+    return result;
+}
+
+// Streams presets to fd through a large buffer so that arbitrarily many
+// presets can be written without building them up in memory first. When
+// presets is NULL every preset is written, in store order.
+static int write_presets_unlocked(cmdset_manager_t *manager, const cmdset_preset_t *presets, int count, int fd, cmdset_format_t format) {
+    if (manager == NULL || fd < 0 || (presets != NULL && count < 0) ||
+        (format != CMDSET_FORMAT_JSON && format != CMDSET_FORMAT_NDJSON && format != CMDSET_FORMAT_TSV)) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    writer_t writer = {0};
+    writer.fd = fd;
+    writer.buffer = mem_malloc(WRITER_BUFFER_SIZE);
+    if (writer.buffer == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    if (format == CMDSET_FORMAT_JSON) writer_puts(&writer, "[");
+    else if (format == CMDSET_FORMAT_TSV) writer_puts(&writer, "name\tcommand\tencrypt\tcreated_at\tlast_used\tuse_count\ttags\n");
+    int written = 0;
+    if (presets != NULL) {
+        for (int i = 0; i < count; i++) write_preset_record(manager, &writer, &presets[i], format, written++ == 0);
+    } else {
+        for (int i = 0; i < manager->count; i++) {
+            if (manager->presets[i].active) write_preset_record(manager, &writer, &manager->presets[i], format, written++ == 0);
+        }
+    }
+    if (format == CMDSET_FORMAT_JSON) writer_puts(&writer, written > 0 ? "\n]\n" : "]\n");
+    writer_flush(&writer);
+    mem_free(writer.buffer);
+    if (writer.failed) {
+        snprintf(last_error_message, sizeof(last_error_message), "Could not write presets: %s", strerror(errno));
+        return CMDSET_ERROR_FILE;
+    }
+    return written;
+}
+
+int cmdset_write_presets(cmdset_manager_t *manager, const cmdset_preset_t *presets, int count, int fd, cmdset_format_t format) {
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = write_presets_unlocked(manager, presets, count, fd, format);
+    state_unlock(state);
+    return result;
+}
+
+// Maps the completion cache and checks that every record points inside the
+// names, which must end in a NUL. Returns NULL for a missing or damaged cache.
+static const unsigned char* completion_map(const char *path, size_t *size) {
+    int cache = open(path, O_RDONLY);
+    if (cache < 0) return NULL;
+    struct stat cache_stat;
+    if (fstat(cache, &cache_stat) != 0 || (size_t)cache_stat.st_size < COMPLETION_HEADER_SIZE) {
+        close(cache);
+        return NULL;
+    }
+    *size = (size_t)cache_stat.st_size;
+    const unsigned char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, cache, 0);
+    close(cache);
+    if (map == MAP_FAILED) return NULL;
+    uint32_t header[4];
+    memcpy(header, map, sizeof(header));
+    int valid = header[0] == COMPLETION_MAGIC && header[1] == COMPLETION_VERSION &&
+        COMPLETION_HEADER_SIZE + (size_t)header[2] * sizeof(completion_record_t) + header[3] <= *size &&
+        (header[2] == 0 || header[3] > 0);
+    if (valid && header[3] > 0) {
+        const completion_record_t *records = (const completion_record_t *)(map + COMPLETION_HEADER_SIZE);
+        const char *names = (const char *)(records + header[2]);
+        if (names[header[3] - 1] != '\0') valid = 0;
+        for (uint32_t i = 0; i < header[2] && valid; i++) {
+            if (records[i].name_offset >= header[3]) valid = 0;
+        }
+    }
+    if (!valid) {
+        munmap((void *)map, *size);
+        return NULL;
+    }
+    return map;
+}
+
+static int completion_rebuild(cmdset_ctx_t *ctx) {
+    cmdset_manager_t *manager = cmdset_manager_new(ctx);
+    if (manager == NULL) return CMDSET_ERROR_FILE;
+    int result = completion_save(manager);
+    cmdset_manager_free(manager);
+    if (result != CMDSET_SUCCESS) strcpy(last_error_message, "Could not rebuild completion cache");
+    return result;
+}
+
+// Answers shell completion from the mmap'd completion cache without loading
+// the preset store. Matches are found by binary search over the sorted names
+// and written to fd one per line, most frecent first. A stale or damaged
+// cache is rebuilt first.
+int cmdset_complete(const char *prefix, int fd) {
+    return cmdset_complete_with_ctx(NULL, prefix, fd);
+}
+
+int cmdset_complete_with_ctx(cmdset_ctx_t *ctx, const char *prefix, int fd) {
+    if (prefix == NULL || fd < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (ctx == NULL) ctx = &default_ctx;
+    char path[sizeof(default_ctx.store_path) + sizeof(COMPLETION_SUFFIX)];
+    snprintf(path, sizeof(path), "%s" COMPLETION_SUFFIX, ctx->store_path);
+    size_t size = 0;
+    const unsigned char *map = completion_map(path, &size);
+    int stale = completion_is_stale(ctx, map);
+    if (stale != 0 && map != NULL) {
+        munmap((void *)map, size);
+        map = NULL;
+    }
+    if (stale < 0) return 0;
+    if (map == NULL) {
+        int result = completion_rebuild(ctx);
+        if (result != CMDSET_SUCCESS) return result;
+        map = completion_map(path, &size);
+    }
+    if (map == NULL) {
+        strcpy(last_error_message, "Invalid completion cache");
+        return CMDSET_ERROR_FILE;
+    }
+    uint32_t header[4];
+    memcpy(header, map, sizeof(header));
+    const completion_record_t *records = (const completion_record_t *)(map + COMPLETION_HEADER_SIZE);
+    const char *names = (const char *)(records + header[2]);
+    size_t prefix_len = strlen(prefix);
+    uint32_t low = 0;
+    uint32_t high = header[2];
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (strcmp(names + records[mid].name_offset, prefix) < 0) low = mid + 1;
+        else high = mid;
+    }
+    uint32_t end = low;
+    while (end < header[2] && strncmp(names + records[end].name_offset, prefix, prefix_len) == 0) end++;
+    active_allocator = &ctx->allocator;
+    completion_entry_t *matches = mem_malloc(sizeof(completion_entry_t) * (end - low + 1));
+    char *buffer = mem_malloc(WRITER_BUFFER_SIZE);
+    if (matches == NULL || buffer == NULL) {
+        mem_free(matches);
+        mem_free(buffer);
+        active_allocator = NULL;
+        munmap((void *)map, size);
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    int count = 0;
+    for (uint32_t i = low; i < end; i++) {
+        matches[count].name = names + records[i].name_offset;
+        matches[count].key = records[i].key;
+        count++;
+    }
+    qsort(matches, count, sizeof(completion_entry_t), compare_completion_keys);
+    writer_t writer = {0};
+    writer.fd = fd;
+    writer.buffer = buffer;
+    for (int i = 0; i < count; i++) {
+        writer_puts(&writer, matches[i].name);
+        writer_puts(&writer, "\n");
+    }
+    writer_flush(&writer);
+    mem_free(buffer);
+    mem_free(matches);
+    active_allocator = NULL;
+    munmap((void *)map, size);
+    if (writer.failed) {
+        strcpy(last_error_message, "Could not write completions");
+        return CMDSET_ERROR_FILE;
+    }
+    return count;
+}
+
+static int resolve_prefix_unlocked(cmdset_manager_t *manager, const char *prefix, int *slots, int max_presets) {
+    if (manager == NULL || prefix == NULL || (slots == NULL && max_presets > 0) || max_presets < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    int exact = trie_find(state, prefix);
+    if (exact >= 0) {
+        if (max_presets > 0) slots[0] = exact;
+        return 1;
+    }
+    const trie_node_t *node = trie_locate(state, prefix);
+    if (node == NULL) return 0;
+    trie_collect(node, slots, 0, max_presets < MAX_PRESETS ? max_presets : MAX_PRESETS);
+    return node->count;
+}
+
+// Returns every match's count but hands out at most max_presets of them.
+int cmdset_resolve_prefix(cmdset_manager_t *manager, const char *prefix, cmdset_preset_t *presets, int max_presets) {
+    int slots[MAX_PRESETS];
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = resolve_prefix_unlocked(manager, prefix, presets != NULL ? slots : NULL, max_presets);
+    if (result > 0) presets_from_slots(manager, slots, result < max_presets ? result : max_presets, presets);
+    state_unlock(state);
+    return result;
+}
+
+static int suggest_unlocked(cmdset_manager_t *manager, const char *name, int *slots, int max_presets) {
+    if (manager == NULL || name == NULL || (slots == NULL && max_presets > 0) || max_presets < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    int tolerance = (int)strlen(name) / 3 + 1;
+    if (tolerance > SUGGEST_MAX_DISTANCE) tolerance = SUGGEST_MAX_DISTANCE;
+    // BK-tree walk: by the triangle inequality only children whose edge
+    // distance lies within tolerance of this node's distance can match.
+    int stack[MAX_PRESETS];
+    int depth = 0;
+    rank_entry_t matches[MAX_PRESETS];
+    int match_count = 0;
+    if (state->bk_root >= 0) stack[depth++] = state->bk_root;
+    while (depth > 0) {
+        int slot = stack[--depth];
+        int distance = edit_distance(name, manager->presets[slot].name);
+        if (distance <= tolerance && manager->presets[slot].active) {
+            matches[match_count].slot = slot;
+            matches[match_count].key = distance;
+            match_count++;
+        }
+        for (int child = state->bk_child[slot]; child >= 0; child = state->bk_sibling[child]) {
+            if (abs(state->bk_distance[child] - distance) <= tolerance) stack[depth++] = child;
+        }
+    }
+    for (int i = 1; i < match_count; i++) {
+        rank_entry_t entry = matches[i];
+        int j = i - 1;
+        while (j >= 0 && (matches[j].key > entry.key || (matches[j].key == entry.key && strcmp(manager->presets[matches[j].slot].name, manager->presets[entry.slot].name) > 0))) {
+            matches[j + 1] = matches[j];
+            j--;
+        }
+        matches[j + 1] = entry;
+    }
+    int found = match_count < max_presets ? match_count : max_presets;
+    for (int i = 0; i < found; i++) slots[i] = matches[i].slot;
+    return found;
+}
+
+int cmdset_suggest(cmdset_manager_t *manager, const char *name, cmdset_preset_t *presets, int max_presets) {
+    int slots[MAX_PRESETS];
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = suggest_unlocked(manager, name, presets != NULL ? slots : NULL, max_presets);
+    if (result > 0) presets_from_slots(manager, slots, result, presets);
+    state_unlock(state);
+    return result;
+}
+
+int cmdset_query_compile(const char *expression, cmdset_query_t **query) {
+    if (expression == NULL || query == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    *query = NULL;
+    query_parser_t parser = {expression, expression, calloc(1, sizeof(cmdset_query_t)), 0, 0, 0};
+    if (parser.query == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    query_parse_or(&parser);
+    while (isspace((unsigned char)*parser.cursor)) parser.cursor++;
+    if (!parser.failed && *parser.cursor != '\0') {
+        snprintf(last_error_message, sizeof(last_error_message), "Unexpected input at offset %d", (int)(parser.cursor - expression));
+        parser.failed = CMDSET_ERROR_INVALID;
+    }
+    if (parser.failed) {
+        cmdset_query_free(parser.query);
+        return parser.failed;
+    }
+    *query = parser.query;
+    return CMDSET_SUCCESS;
+}
+
+int cmdset_query_match(const cmdset_query_t *query, const cmdset_preset_t *preset) {
+    if (query == NULL || preset == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    return query_eval(query, preset, (int64_t)time(NULL));
+}
+
+void cmdset_query_free(cmdset_query_t *query) {
+    if (query == NULL) return;
+    free(query->code);
+    free(query);
+}
+
+static int filter_where_unlocked(cmdset_manager_t *manager, const char *expression, int *slots, int max_presets) {
+    if (manager == NULL || expression == NULL || (slots == NULL && max_presets > 0) || max_presets < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    cmdset_query_t *query;
+    int result = cmdset_query_compile(expression, &query);
+    if (result != CMDSET_SUCCESS) return result;
+    int64_t now = (int64_t)time(NULL);
+    int found = 0;
+    for (int i = 0; i < manager->count && found < max_presets; i++) {
+        if (manager->presets[i].active && query_eval(query, &manager->presets[i], now)) slots[found++] = i;
+    }
+    cmdset_query_free(query);
+    return found;
+}
+
+int cmdset_filter_where(cmdset_manager_t *manager, const char *expression, cmdset_preset_t *presets, int max_presets) {
+    int slots[MAX_PRESETS];
+    struct cmdset_state *state = state_lock(manager, 0);
+    int result = filter_where_unlocked(manager, expression, presets != NULL ? slots : NULL, max_presets);
+    if (result > 0) presets_from_slots(manager, slots, result, presets);
+    state_unlock(state);
+    return result;
+}
+
+cmdset_snapshot_t* cmdset_snapshot_acquire(cmdset_manager_t *manager) {
+    if (manager == NULL || manager->state == NULL) {
+        strcpy(last_error_message, "Manager is not initialized");
+        return NULL;
+    }
+    cmdset_snapshot_t *snapshot = snapshot_enter(manager->state);
+    if (snapshot == NULL) strcpy(last_error_message, "No snapshot available");
+    return snapshot;
+}
+
+void cmdset_snapshot_release(cmdset_snapshot_t *snapshot) {
+    if (snapshot == NULL) return;
+    __atomic_store_n(&snapshot->epoch, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&snapshot->busy, 0, __ATOMIC_RELEASE);
+}
+
+unsigned long cmdset_snapshot_version(const cmdset_snapshot_t *snapshot) {
+    return snapshot != NULL ? snapshot->version->version : 0;
+}
+
+int cmdset_snapshot_count(const cmdset_snapshot_t *snapshot) {
+    return snapshot != NULL ? snapshot->version->count : 0;
+}
+
+const cmdset_preset_t* cmdset_snapshot_presets(const cmdset_snapshot_t *snapshot) {
+    return snapshot != NULL ? snapshot->version->presets : NULL;
+}
+
+const cmdset_preset_t* cmdset_snapshot_find(const cmdset_snapshot_t *snapshot, const char *name) {
+    if (snapshot == NULL || name == NULL) return NULL;
+    return version_find(snapshot->version, name);
+}
+
+int cmdset_snapshot_get_tags(const cmdset_snapshot_t *snapshot, const cmdset_preset_t *preset, const char **tags, int max_tags) {
+    if (snapshot == NULL || preset == NULL || tags == NULL || max_tags < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    const store_version_t *version = snapshot->version;
+    if (preset < version->presets || preset >= version->presets + version->count) {
+        strcpy(last_error_message, "Preset is not part of this snapshot");
+        return CMDSET_ERROR_INVALID;
+    }
+    int index = (int)(preset - version->presets);
+    int count = 0;
+    for (int t = version->tag_offsets[index]; t < version->tag_offsets[index + 1] && count < max_tags; t++) tags[count++] = version->tags[t];
+    return count;
+}
+
+cmdset_manager_t* cmdset_manager_new(cmdset_ctx_t *ctx) {
+    if (ctx == NULL) ctx = &default_ctx;
+    active_allocator = &ctx->allocator;
+    cmdset_manager_t *manager = mem_malloc(sizeof(cmdset_manager_t));
+    active_allocator = NULL;
+    if (manager == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return NULL;
+    }
+    // Without state the manager cannot name its context, so free it here.
+    if (cmdset_init_with_ctx(manager, ctx) != CMDSET_SUCCESS) {
+        cmdset_cleanup(manager);
+        active_allocator = &ctx->allocator;
+        mem_free(manager);
+        active_allocator = NULL;
+        return NULL;
+    }
+    return manager;
+}
+
+void cmdset_manager_free(cmdset_manager_t *manager) {
+    if (manager == NULL) return;
+    cmdset_ctx_t *context = manager_ctx(manager);
+    cmdset_cleanup(manager);
+    active_allocator = &context->allocator;
+    mem_free(manager);
+    active_allocator = NULL;
+}
+
+const cmdset_preset_t* cmdset_snapshot_preset(const cmdset_snapshot_t *snapshot, int index) {
+    if (snapshot == NULL || index < 0 || index >= snapshot->version->count) return NULL;
+    return &snapshot->version->presets[index];
+}
+
+const char* cmdset_preset_name(const cmdset_preset_t *preset, size_t *length) {
+    if (preset == NULL) return NULL;
+    if (length != NULL) *length = strlen(preset->name);
+    return preset->name;
+}
+
+const char* cmdset_preset_command(const cmdset_preset_t *preset, size_t *length) {
+    if (preset == NULL) return NULL;
+    if (length != NULL) *length = strlen(preset->command);
+    return preset->command;
+}
+
+int cmdset_preset_is_encrypted(const cmdset_preset_t *preset) {
+    return preset != NULL && preset->encrypt;
+}
+
+long cmdset_preset_created_at(const cmdset_preset_t *preset) {
+    return preset != NULL ? preset->created_at : 0;
+}
+
+long cmdset_preset_last_used(const cmdset_preset_t *preset) {
+    return preset != NULL ? __atomic_load_n(&preset->last_used, __ATOMIC_RELAXED) : 0;
+}
+
+int cmdset_preset_use_count(const cmdset_preset_t *preset) {
+    return preset != NULL ? __atomic_load_n(&preset->use_count, __ATOMIC_RELAXED) : 0;
+}
+
+// Arrays for the calls that copy presets out, so callers that cannot see the
+// layout of presets or search results can still receive them.
+cmdset_preset_t* cmdset_preset_array_new(int count) {
+    cmdset_preset_t *array = count > 0 ? calloc((size_t)count, sizeof(cmdset_preset_t)) : NULL;
+    if (array == NULL) strcpy(last_error_message, count > 0 ? "Memory allocation failed" : "Invalid parameters");
+    return array;
+}
+
+cmdset_preset_t* cmdset_preset_array_at(cmdset_preset_t *array, int index) {
+    return array != NULL && index >= 0 ? &array[index] : NULL;
+}
+
+void cmdset_preset_array_free(cmdset_preset_t *array) {
+    free(array);
+}
+
+cmdset_search_result_t* cmdset_search_result_array_new(int count) {
+    cmdset_search_result_t *array = count > 0 ? calloc((size_t)count, sizeof(cmdset_search_result_t)) : NULL;
+    if (array == NULL) strcpy(last_error_message, count > 0 ? "Memory allocation failed" : "Invalid parameters");
+    return array;
+}
+
+const cmdset_preset_t* cmdset_search_result_preset(const cmdset_search_result_t *array, int index) {
+    return array != NULL && index >= 0 ? &array[index].preset : NULL;
+}
+
+int cmdset_search_result_score(const cmdset_search_result_t *array, int index) {
+    return array != NULL && index >= 0 ? array[index].score : 0;
+}
+
+void cmdset_search_result_array_free(cmdset_search_result_t *array) {
+    free(array);
+}
+
+cmdset_txn_t* cmdset_txn_begin(cmdset_manager_t *manager) {
+    if (manager == NULL) {
+        strcpy(last_error_message, "Manager is NULL");
+        return NULL;
+    }
+    active_allocator = &manager_ctx(manager)->allocator;
+    cmdset_txn_t *txn = mem_calloc(1, sizeof(cmdset_txn_t));
+    active_allocator = NULL;
+    if (txn == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return NULL;
+    }
+    txn->manager = manager;
+    return txn;
+}
+
+int cmdset_txn_add(cmdset_txn_t *txn, const char *name, const char *command, int encrypt) {
+    if (txn == NULL || name == NULL || command == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (txn->error != CMDSET_SUCCESS) {
+        strcpy(last_error_message, txn->message);
+        return txn->error;
+    }
+    if (strlen(name) >= MAX_NAME_LEN) {
+        strcpy(last_error_message, "Preset name too long");
+        return txn_fail(txn, CMDSET_ERROR_INVALID);
+    }
+    if (strlen(command) >= MAX_COMMAND_LEN) {
+        strcpy(last_error_message, "Command too long");
+        return txn_fail(txn, CMDSET_ERROR_INVALID);
+    }
+    char stored_command[ENCRYPTED_COMMAND_LEN];
+    if (!encrypt) strcpy(stored_command, command);
+    else if (encrypt_command_internal(manager_ctx(txn->manager), command, stored_command, name) != 0) {
+        strcpy(last_error_message, "Failed to encrypt command");
+        return txn_fail(txn, CMDSET_ERROR_ENCRYPTION);
+    } else if (strlen(stored_command) >= MAX_COMMAND_LEN) {
+        strcpy(last_error_message, "Command too long");
+        return txn_fail(txn, CMDSET_ERROR_INVALID);
+    }
+    txn_op_t *op = txn_push(txn);
+    if (op == NULL) return txn->error;
+    op->remove = 0;
+    op->encrypt = encrypt;
+    strcpy(op->name, name);
+    strcpy(op->command, stored_command);
+    return CMDSET_SUCCESS;
+}
+
+int cmdset_txn_remove(cmdset_txn_t *txn, const char *name) {
+    if (txn == NULL || name == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (txn->error != CMDSET_SUCCESS) {
+        strcpy(last_error_message, txn->message);
+        return txn->error;
+    }
+    if (strlen(name) >= MAX_NAME_LEN) {
+        strcpy(last_error_message, "Preset not found");
+        return txn_fail(txn, CMDSET_ERROR_NOT_FOUND);
+    }
+    txn_op_t *op = txn_push(txn);
+    if (op == NULL) return txn->error;
+    op->remove = 1;
+    op->encrypt = 0;
+    strcpy(op->name, name);
+    op->command[0] = '\0';
+    return CMDSET_SUCCESS;
+}
+
+// Replays the staged operations against the store without changing it, then
+// writes the result once. Only after the write succeeds are the operations
+// applied in memory, so any failure leaves both the file and the manager as
+// they were.
+static int txn_commit_unlocked(cmdset_txn_t *txn) {
+    cmdset_manager_t *manager = txn->manager;
+    char removed[MAX_PRESETS] = {0};
+    char *live = mem_calloc(txn->count + 1, 1);
+    if (live == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    int slots = 0;
+    for (int i = 0; i < manager->count; i++) slots += manager->presets[i].active;
+    int added_count = 0;
+    int result = CMDSET_SUCCESS;
+    for (int i = 0; i < txn->count && result == CMDSET_SUCCESS; i++) {
+        const txn_op_t *op = &txn->ops[i];
+        int slot = find_slot(manager, op->name);
+        if (slot >= 0 && removed[slot]) slot = -1;
+        int staged = -1;
+        for (int j = 0; j < i && staged < 0; j++) {
+            if (live[j] && strcmp(txn->ops[j].name, op->name) == 0) staged = j;
+        }
+        if (!op->remove) {
+            if (slot >= 0 || staged >= 0) {
+                snprintf(last_error_message, sizeof(last_error_message), "Preset '%s' already exists", op->name);
+                result = CMDSET_ERROR_EXISTS;
+            } else if (slots >= MAX_PRESETS) {
+                strcpy(last_error_message, "Maximum number of presets reached");
+                result = CMDSET_ERROR_MEMORY;
+            } else {
+                live[i] = 1;
+                slots++;
+                added_count++;
+            }
+        } else if (slot >= 0) {
+            removed[slot] = 1;
+            slots--;
+        } else if (staged >= 0) {
+            live[staged] = 0;
+            slots--;
+            added_count--;
+        } else {
+            snprintf(last_error_message, sizeof(last_error_message), "Preset '%s' not found", op->name);
+            result = CMDSET_ERROR_NOT_FOUND;
+        }
+    }
+    long now = (long)time(NULL);
+    cmdset_preset_t *added = NULL;
+    store_version_t *preview = NULL;
+    json_object *root = NULL;
+    const char *json_string = NULL;
+    if (result == CMDSET_SUCCESS) {
+        added = mem_calloc(added_count + 1, sizeof(cmdset_preset_t));
+        int index = 0;
+        for (int i = 0; added != NULL && i < txn->count; i++) {
+            if (!live[i]) continue;
+            strcpy(added[index].name, txn->ops[i].name);
+            strcpy(added[index].command, txn->ops[i].command);
+            added[index].active = 1;
+            added[index].encrypt = txn->ops[i].encrypt;
+            added[index].created_at = now;
+            index++;
+        }
+        if (added != NULL) preview = snapshot_build(manager, removed, added, added_count);
+        if (preview == NULL) {
+            strcpy(last_error_message, "Memory allocation failed");
+            result = CMDSET_ERROR_MEMORY;
+        }
+    }
+    if (result == CMDSET_SUCCESS) {
+        root = version_to_json(preview, 0);
+        if (root != NULL) json_string = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PRETTY);
+        if (root != NULL && json_string == NULL) strcpy(last_error_message, "Could not generate JSON string");
+        if (json_string == NULL) result = CMDSET_ERROR_JSON;
+    }
+    if (result == CMDSET_SUCCESS) result = store_write(manager, json_string);
+    if (result == CMDSET_SUCCESS) {
+        for (int i = 0; i < txn->count; i++) {
+            if (txn->ops[i].remove) remove_preset_unlocked(manager, txn->ops[i].name);
+            else {
+                if (manager->count >= MAX_PRESETS) presets_compact(manager);
+                preset_insert(manager, txn->ops[i].name, txn->ops[i].command, txn->ops[i].encrypt, now);
+            }
+        }
+        uint64_t store_hash = hash_content(json_string, strlen(json_string));
+        if (manager->state != NULL) manager->state->store_hash = store_hash;
+        unsaved_clear(manager->state);
+        index_save(manager, store_hash);
+        completion_save(manager);
+    }
+    json_object_put(root);
+    mem_free(preview);
+    mem_free(added);
+    mem_free(live);
+    return result;
+}
+
+int cmdset_txn_commit(cmdset_txn_t *txn) {
+    if (txn == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    int result = txn->error;
+    if (result != CMDSET_SUCCESS) strcpy(last_error_message, txn->message);
+    else {
+        struct cmdset_state *state = state_lock(txn->manager, 1);
+        result = txn_commit_unlocked(txn);
+        if (result == CMDSET_SUCCESS) dirty_clear(state, -1);
+        state_unlock(state);
+    }
+    cmdset_txn_rollback(txn);
+    return result;
+}
+
+void cmdset_txn_rollback(cmdset_txn_t *txn) {
+    if (txn == NULL) return;
+    active_allocator = &manager_ctx(txn->manager)->allocator;
+    mem_free(txn->ops);
+    mem_free(txn);
+    active_allocator = NULL;
+}
+
+// Starts (or reconfigures) a background thread that saves the store once
+// changes have been pending for delay_ms, or as soon as max_pending of them
+// have piled up. A delay of 0 stops the thread after a final flush.
+int cmdset_set_write_behind(cmdset_manager_t *manager, int delay_ms, int max_pending) {
+    if (manager == NULL || manager->state == NULL || delay_ms < 0 || max_pending < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = manager->state;
+    flusher_stop(manager);
+    if (delay_ms == 0) return CMDSET_SUCCESS;
+    pthread_mutex_lock(&state->flush_lock);
+    state->flush_delay_ms = delay_ms;
+    state->flush_threshold = max_pending > 0 ? max_pending : INT_MAX;
+    state->flusher_stop = 0;
+    state->flusher_running = pthread_create(&state->flusher, NULL, flusher_main, manager) == 0;
+    pthread_mutex_unlock(&state->flush_lock);
+    if (!state->flusher_running) {
+        strcpy(last_error_message, "Could not start the write-behind thread");
+        return CMDSET_ERROR_MEMORY;
+    }
+    return CMDSET_SUCCESS;
+}
+
+int cmdset_flush(cmdset_manager_t *manager) {
+    if (manager == NULL) {
+        strcpy(last_error_message, "Manager is NULL");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (manager->state != NULL && dirty_count(manager->state) == 0) return CMDSET_SUCCESS;
+    return cmdset_save_presets(manager);
+}
+
+// Watches the store's directory and merges every completed write of the
+// store file, by this or any other process, into the manager.
+int cmdset_watch(cmdset_manager_t *manager, int enable) {
+    if (manager == NULL || manager->state == NULL) {
+        strcpy(last_error_message, "Manager is not initialized");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = manager->state;
+    watcher_stop(manager);
+    if (!enable) return CMDSET_SUCCESS;
+#ifdef __linux__
+    char directory[sizeof(default_ctx.store_path)];
+    store_path(manager, "", directory, sizeof(directory));
+    char *slash = strrchr(directory, '/');
+    if (slash == NULL) strcpy(directory, ".");
+    else if (slash == directory) slash[1] = '\0';
+    else *slash = '\0';
+    state->watch_fd = inotify_init1(IN_CLOEXEC);
+    if (state->watch_fd < 0 || inotify_add_watch(state->watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        snprintf(last_error_message, sizeof(last_error_message), "Could not watch '%s': %s", directory, strerror(errno));
+        if (state->watch_fd >= 0) close(state->watch_fd);
+        return CMDSET_ERROR_FILE;
+    }
+    if (pipe(state->watch_pipe) != 0) {
+        snprintf(last_error_message, sizeof(last_error_message), "Could not create pipe: %s", strerror(errno));
+        close(state->watch_fd);
+        return CMDSET_ERROR_FILE;
+    }
+    fcntl(state->watch_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(state->watch_pipe[1], F_SETFD, FD_CLOEXEC);
+    if (pthread_create(&state->watcher, NULL, watcher_main, manager) != 0) {
+        strcpy(last_error_message, "Could not start the watcher thread");
+        close(state->watch_fd);
+        close(state->watch_pipe[0]);
+        close(state->watch_pipe[1]);
+        return CMDSET_ERROR_MEMORY;
+    }
+    state->watcher_running = 1;
+    return CMDSET_SUCCESS;
+#else
+    strcpy(last_error_message, "Watching the store requires inotify");
+    return CMDSET_ERROR_INVALID;
+#endif
+}
+
+int cmdset_refresh(cmdset_manager_t *manager) {
+    struct cmdset_state *state = state_lock(manager, 1);
+    int result = manager != NULL ? store_merge_unlocked(manager) : CMDSET_ERROR_INVALID;
+    if (manager == NULL) strcpy(last_error_message, "Manager is NULL");
+    state_unlock(state);
+    return result;
+}
+
+int cmdset_set_max_concurrency(cmdset_manager_t *manager, const char *name, int limit) {
+    if (manager == NULL || name == NULL || limit < 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    struct cmdset_state *state = state_lock(manager, 1);
+    int slot = find_slot(manager, name);
+    int result = CMDSET_SUCCESS;
+    if (slot < 0) {
+        strcpy(last_error_message, "Preset not found");
+        result = CMDSET_ERROR_NOT_FOUND;
+    } else if (state == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        result = CMDSET_ERROR_MEMORY;
+    } else {
+        state->max_concurrency[slot] = limit;
+        state->unsaved[slot] |= UNSAVED_LIMIT;
+        dirty_mark(state);
+    }
+    state_unlock(state);
+    return result;
+}
+
+int cmdset_get_max_concurrency(cmdset_manager_t *manager, const char *name) {
+    if (manager == NULL || name == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    cmdset_snapshot_t *reader;
+    const store_version_t *version = version_pin(manager, &reader);
+    if (version == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    const cmdset_preset_t *preset = version_find(version, name);
+    int result = preset != NULL ? version->limits[preset - version->presets] : CMDSET_ERROR_NOT_FOUND;
+    if (preset == NULL) strcpy(last_error_message, "Preset not found");
+    version_unpin(manager, version, reader);
+    return result;
+}
+
+int cmdset_set_sched_profile(cmdset_manager_t *manager, const char *name, const char *spec) {
+    if (manager == NULL || name == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    sched_profile_t profile;
+    int result = sched_parse(spec, &profile);
+    if (result != CMDSET_SUCCESS) return result;
+    struct cmdset_state *state = state_lock(manager, 1);
+    int slot = find_slot(manager, name);
+    if (slot < 0) {
+        strcpy(last_error_message, "Preset not found");
+        result = CMDSET_ERROR_NOT_FOUND;
+    } else if (state == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        result = CMDSET_ERROR_MEMORY;
+    } else {
+        state->profiles[slot] = profile;
+        state->unsaved[slot] |= UNSAVED_SCHED;
+        dirty_mark(state);
+    }
+    state_unlock(state);
+    return result;
+}
+
+int cmdset_get_sched_profile(cmdset_manager_t *manager, const char *name, char *spec, int max_len) {
+    if (manager == NULL || name == NULL || spec == NULL || max_len <= 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    cmdset_snapshot_t *reader;
+    const store_version_t *version = version_pin(manager, &reader);
+    if (version == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    const cmdset_preset_t *preset = version_find(version, name);
+    int result = CMDSET_ERROR_NOT_FOUND;
+    if (preset == NULL) strcpy(last_error_message, "Preset not found");
+    else result = sched_format(&version->profiles[preset - version->presets], spec, max_len);
+    version_unpin(manager, version, reader);
+    return result;
+}
+
+int cmdset_get_usage(cmdset_manager_t *manager, const char *name, cmdset_usage_t *usage) {
+    if (manager == NULL || name == NULL || usage == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    cmdset_snapshot_t *reader;
+    const store_version_t *version = version_pin(manager, &reader);
+    if (version == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    const cmdset_preset_t *preset = version_find(version, name);
+    int result = CMDSET_SUCCESS;
+    if (preset == NULL) {
+        strcpy(last_error_message, "Preset not found");
+        result = CMDSET_ERROR_NOT_FOUND;
+    } else version_usage(version, (int)(preset - version->presets), usage);
+    version_unpin(manager, version, reader);
+    return result;
+}
+
+int cmdset_execute_start(cmdset_manager_t *manager, const char *name, const char *additional_args, int flags, cmdset_run_t **run) {
+    if (manager == NULL || name == NULL || run == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    active_allocator = &manager_ctx(manager)->allocator;
+    *run = mem_calloc(1, sizeof(cmdset_run_t));
+    active_allocator = NULL;
+    if (*run == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    int result = run_start(manager, name, additional_args, flags, *run);
+    if (result != CMDSET_SUCCESS) {
+        cmdset_run_free(*run);
+        *run = NULL;
+    }
+    return result;
+}
+
+int cmdset_run_pid(const cmdset_run_t *run) {
+    return run != NULL ? (int)run->pid : -1;
+}
+
+int cmdset_run_fd(const cmdset_run_t *run) {
+    return run != NULL ? run->pidfd : -1;
+}
+
+int cmdset_run_poll(cmdset_run_t *run, int *status) {
+    if (run == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (!run_reap(run, 0)) return 0;
+    if (status != NULL) *status = run->status;
+    return 1;
+}
+
+int cmdset_run_wait(cmdset_run_t *run, int *status) {
+    if (run == NULL) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    run_reap(run, 1);
+    if (status != NULL) *status = run->status;
+    return CMDSET_SUCCESS;
+}
+
+// Signals a run through its pidfd where there is one. A finished run is
+// left alone, so a reused pid is never signalled.
+int cmdset_run_kill(cmdset_run_t *run, int sig) {
+    if (run == NULL || run->pid <= 0) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (run->finished) return CMDSET_SUCCESS;
+    int result;
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+    if (run->pidfd >= 0) result = (int)syscall(SYS_pidfd_send_signal, run->pidfd, sig, NULL, 0);
+    else result = kill(run->pid, sig);
+#else
+    result = kill(run->pid, sig);
+#endif
+    if (result != 0) {
+        snprintf(last_error_message, sizeof(last_error_message), "Could not signal command: %s", strerror(errno));
+        return CMDSET_ERROR_INVALID;
+    }
+    return CMDSET_SUCCESS;
+}
+
+// Never waits on a command that is still running: it is killed and reaped,
+// so no zombie is left behind.
+void cmdset_run_free(cmdset_run_t *run) {
+    if (run == NULL) return;
+    if (run->pid > 0 && !run_reap(run, 0)) {
+        cmdset_run_kill(run, SIGKILL);
+        run_reap(run, 1);
+    }
+    active_allocator = &manager_ctx(run->manager)->allocator;
+    mem_free(run);
+    active_allocator = NULL;
+}
+
+int cmdset_dump_packed(cmdset_manager_t *manager, void *buffer, size_t size, size_t *needed) {
+    if (manager == NULL || (buffer == NULL && size > 0)) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    cmdset_snapshot_t *reader;
+    const store_version_t *version = version_pin(manager, &reader);
+    if (version == NULL) {
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    size_t total = (size_t)version->count * sizeof(cmdset_packed_preset_t);
+    for (int i = 0; i < version->count; i++) {
+        total += strlen(version->presets[i].name) + strlen(version->presets[i].command) + 2;
+    }
+    if (needed != NULL) *needed = total;
+    if (total > size) {
+        version_unpin(manager, version, reader);
+        strcpy(last_error_message, "Buffer too small for packed presets");
+        return CMDSET_ERROR_TRUNCATED;
+    }
+    // Records first, then the text they point into.
+    cmdset_packed_preset_t *records = buffer;
+    char *text = (char *)buffer + (size_t)version->count * sizeof(cmdset_packed_preset_t);
+    for (int i = 0; i < version->count; i++) {
+        const cmdset_preset_t *preset = &version->presets[i];
+        cmdset_packed_preset_t *record = &records[i];
+        record->name_length = (unsigned int)strlen(preset->name);
+        record->name_offset = (unsigned int)(text - (char *)buffer);
+        memcpy(text, preset->name, record->name_length + 1);
+        text += record->name_length + 1;
+        record->command_length = (unsigned int)strlen(preset->command);
+        record->command_offset = (unsigned int)(text - (char *)buffer);
+        memcpy(text, preset->command, record->command_length + 1);
+        text += record->command_length + 1;
+        record->created_at = preset->created_at;
+        record->last_used = cmdset_preset_last_used(preset);
+        record->use_count = cmdset_preset_use_count(preset);
+        record->encrypt = preset->encrypt;
+    }
+    int count = version->count;
+    version_unpin(manager, version, reader);
+    return count;
+}
+
+int cmdset_add_many(cmdset_manager_t *manager, const char *entries, size_t size, int encrypt) {
+    if (manager == NULL || (entries == NULL && size > 0)) {
+        strcpy(last_error_message, "Invalid parameters");
+        return CMDSET_ERROR_INVALID;
+    }
+    if (size == 0) return 0;
+    cmdset_txn_t *txn = cmdset_txn_begin(manager);
+    if (txn == NULL) return CMDSET_ERROR_MEMORY;
+    int added = 0;
+    size_t position = 0;
+    while (position < size) {
+        const char *name = entries + position;
+        size_t name_length = strnlen(name, size - position);
+        const char *command = name + name_length + 1;
+        size_t rest = size - position - name_length;
+        size_t command_length = rest > 1 ? strnlen(command, rest - 1) : 0;
+        if (rest <= 1 || command_length == rest - 1) {
+            cmdset_txn_rollback(txn);
+            strcpy(last_error_message, "Entries must be NUL-terminated name and command pairs");
+            return CMDSET_ERROR_INVALID;
+        }
+        int result = cmdset_txn_add(txn, name, command, encrypt);
+        if (result != CMDSET_SUCCESS) {
+            cmdset_txn_rollback(txn);
+            return result;
+        }
+        added++;
+        position += name_length + command_length + 2;
+    }
+    int result = cmdset_txn_commit(txn);
+    return result != CMDSET_SUCCESS ? result : added;
+}
+
+static struct cmdset_state* get_state(cmdset_manager_t *manager) {
+    if (manager->state == NULL) {
+        manager->state = mem_calloc(1, sizeof(struct cmdset_state));
+        if (manager->state == NULL) return NULL;
+        pthread_rwlock_init(&manager->state->lock, NULL);
+        pthread_mutex_init(&manager->state->rank_lock, NULL);
+        manager->state->half_life = FRECENCY_HALF_LIFE;
+        manager->state->count_weight = FRECENCY_COUNT_WEIGHT;
+        manager->state->bk_root = -1;
+        pthread_mutex_init(&manager->state->save_lock, NULL);
+        manager->state->epoch = 1;
+        pthread_mutex_init(&manager->state->flush_lock, NULL);
+        pthread_condattr_t attributes;
+        pthread_condattr_init(&attributes);
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        pthread_cond_init(&manager->state->flush_cond, &attributes);
+        pthread_condattr_destroy(&attributes);
+    }
+    return manager->state;
+}
+
+static struct cmdset_state* state_lock(cmdset_manager_t *manager, int exclusive) {
+    if (manager == NULL || manager->state == NULL) return NULL;
+    if (exclusive) pthread_rwlock_wrlock(&manager->state->lock);
+    else pthread_rwlock_rdlock(&manager->state->lock);
+    if (exclusive) manager->state->writer = manager;
+    if (manager->state->ctx != NULL) active_allocator = &manager->state->ctx->allocator;
+    return manager->state;
+}
+
+static void state_unlock(struct cmdset_state *state) {
+    if (state == NULL) return;
+    if (state->writer != NULL) {
+        pthread_mutex_lock(&state->rank_lock);
+        snapshot_publish(state->writer);
+        pthread_mutex_unlock(&state->rank_lock);
+        state->writer = NULL;
+    }
+    active_allocator = NULL;
+    pthread_rwlock_unlock(&state->lock);
+}
+
+static cmdset_ctx_t* manager_ctx(cmdset_manager_t *manager) {
+    if (manager != NULL && manager->state != NULL && manager->state->ctx != NULL) return manager->state->ctx;
+    return &default_ctx;
+}
+
+static void store_path(cmdset_manager_t *manager, const char *suffix, char *path, size_t size) {
+    const char *base = manager_ctx(manager)->store_path;
+    size_t base_len = strlen(base);
+    size_t suffix_len = strlen(suffix);
+    if (base_len + suffix_len >= size) {
+        path[0] = '\0';
+        return;
+    }
+    memcpy(path, base, base_len);
+    memcpy(path + base_len, suffix, suffix_len + 1);
+}
+
+// Manager state is allocated through the allocator of the context whose lock
+// is held by this thread, or libc outside of any manager call.
+static void* mem_malloc(size_t size) {
+    if (active_allocator != NULL && active_allocator->malloc != NULL) return active_allocator->malloc(size, active_allocator->user_data);
+    return malloc(size);
+}
+
+static void* mem_calloc(size_t count, size_t size) {
+    if (active_allocator == NULL || active_allocator->malloc == NULL) return calloc(count, size);
+    if (size != 0 && count > SIZE_MAX / size) return NULL;
+    void *pointer = active_allocator->malloc(count * size, active_allocator->user_data);
+    if (pointer != NULL) memset(pointer, 0, count * size);
+    return pointer;
+}
+
+static void* mem_realloc(void *pointer, size_t size) {
+    if (active_allocator != NULL && active_allocator->realloc != NULL) return active_allocator->realloc(pointer, size, active_allocator->user_data);
+    return realloc(pointer, size);
+}
+
+static void mem_free(void *pointer) {
+    if (active_allocator != NULL && active_allocator->free != NULL) active_allocator->free(pointer, active_allocator->user_data);
+    else free(pointer);
+}
+
+// Frecency is (1 + use_count)^weight * 2^(-(now - last_used) / half_life). Its
+// log2 splits into a per-preset key minus now / half_life, so ordering presets
+// by the key alone gives the same ranking at any point in time.
+static double frecency_key(const struct cmdset_state *state, const cmdset_preset_t *preset) {
+    long last_used = __atomic_load_n(&preset->last_used, __ATOMIC_RELAXED);
+    long reference = last_used > 0 ? last_used : preset->created_at;
+    return state->count_weight * log2(1.0 + __atomic_load_n(&preset->use_count, __ATOMIC_RELAXED)) + (double)reference / state->half_life;
+}
+
+static void rank_insert(cmdset_manager_t *manager, int slot) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    double key = frecency_key(state, &manager->presets[slot]);
+    int low = 0;
+    int high = state->rank_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (state->keys[state->rank[mid]] >= key) low = mid + 1;
+        else high = mid;
+    }
+    for (int i = state->rank_count; i > low; i--) {
+        state->rank[i] = state->rank[i - 1];
+        state->rank_pos[state->rank[i]] = i;
+    }
+    state->keys[slot] = key;
+    state->rank[low] = slot;
+    state->rank_pos[slot] = low;
+    state->rank_count++;
+}
+
+static void rank_remove(cmdset_manager_t *manager, int slot) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    for (int i = state->rank_pos[slot]; i < state->rank_count - 1; i++) {
+        state->rank[i] = state->rank[i + 1];
+        state->rank_pos[state->rank[i]] = i;
+    }
+    state->rank_count--;
+}
+
+// A use only ever raises a preset's key, so it just moves towards the front.
+static void rank_promote(cmdset_manager_t *manager, int slot) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    double key = frecency_key(state, &manager->presets[slot]);
+    int pos = state->rank_pos[slot];
+    state->keys[slot] = key;
+    while (pos > 0 && state->keys[state->rank[pos - 1]] < key) {
+        state->rank[pos] = state->rank[pos - 1];
+        state->rank_pos[state->rank[pos]] = pos;
+        pos--;
+    }
+    state->rank[pos] = slot;
+    state->rank_pos[slot] = pos;
+}
+
+static int compare_rank_entries(const void *a, const void *b) {
+    const rank_entry_t *entry_a = a;
+    const rank_entry_t *entry_b = b;
+    if (entry_a->key > entry_b->key) return -1;
+    if (entry_a->key < entry_b->key) return 1;
+    return entry_a->slot - entry_b->slot;
+}
+
+static void rank_rebuild(cmdset_manager_t *manager) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    rank_entry_t entries[MAX_PRESETS];
+    int count = 0;
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active) {
+            state->keys[i] = frecency_key(state, &manager->presets[i]);
+            entries[count].key = state->keys[i];
+            entries[count].slot = i;
+            count++;
+        }
+    }
+    qsort(entries, count, sizeof(rank_entry_t), compare_rank_entries);
+    for (int i = 0; i < count; i++) {
+        state->rank[i] = entries[i].slot;
+        state->rank_pos[entries[i].slot] = i;
+    }
+    state->rank_count = count;
+}
+
+// Compares the first and last needle bytes against 16 candidate positions at a
+// time and only runs memcmp on positions where both match.
+static const char* find_substring(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len) {
+    if (needle_len == 0) return haystack;
+    if (needle_len > haystack_len) return NULL;
+    size_t i = 0;
+    size_t last = needle_len - 1;
+#ifdef __SSE2__
+    const __m128i first_byte = _mm_set1_epi8(needle[0]);
+    const __m128i last_byte = _mm_set1_epi8(needle[last]);
+    for (; i + last + 16 <= haystack_len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + last));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first_byte), _mm_cmpeq_epi8(block_last, last_byte)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needle_len > 1 ? needle_len - 2 : 0) == 0) return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + needle_len <= haystack_len; i++) {
+        const char *candidate = memchr(haystack + i, needle[0], haystack_len - last - i);
+        if (candidate == NULL) return NULL;
+        i = candidate - haystack;
+        if (memcmp(candidate + 1, needle + 1, last) == 0) return candidate;
+    }
+    return NULL;
+}
+
+static int is_name_boundary(char c) {
+    return c == '-' || c == '_' || c == '.' || c == '/' || c == ' ' || c == ':';
+}
+
+// Case-insensitive subsequence match of the query against a preset name.
+// Returns 0 when the query is not a subsequence of the name.
+static int fuzzy_score(const char *name, const char *query, size_t query_len) {
+    size_t name_len = strlen(name);
+    if (name_len == query_len && strncasecmp(name, query, name_len) == 0) return SEARCH_EXACT_SCORE;
+    int score = 0;
+    size_t q = 0;
+    long previous = -2;
+    for (size_t n = 0; n < name_len && q < query_len; n++) {
+        if (tolower((unsigned char)name[n]) != tolower((unsigned char)query[q])) continue;
+        score += SEARCH_MATCH_SCORE;
+        if (n == 0 || is_name_boundary(name[n - 1])) score += SEARCH_BOUNDARY_BONUS;
+        if ((long)n == previous + 1) score += SEARCH_CONSECUTIVE_BONUS;
+        else if (previous >= 0) score -= (int)(n - previous - 1);
+        previous = (long)n;
+        q++;
+    }
+    if (q < query_len) return 0;
+    return score > 0 ? score : 1;
+}
+
+static uint64_t hash_content(const char *content, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)content[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static token_entry_t* index_entry(token_index_t *index, const char *token, int create) {
+    if (create && (index->used + 1) * 10 >= index->capacity * 7) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 64;
+        token_entry_t *entries = mem_calloc(capacity, sizeof(token_entry_t));
+        if (entries == NULL) return NULL;
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->entries[i].token == NULL) continue;
+            size_t pos = hash_content(index->entries[i].token, strlen(index->entries[i].token)) & (capacity - 1);
+            while (entries[pos].token != NULL) pos = (pos + 1) & (capacity - 1);
+            entries[pos] = index->entries[i];
+        }
+        mem_free(index->entries);
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    if (index->capacity == 0) return NULL;
+    size_t pos = hash_content(token, strlen(token)) & (index->capacity - 1);
+    while (index->entries[pos].token != NULL) {
+        if (strcmp(index->entries[pos].token, token) == 0) return &index->entries[pos];
+        pos = (pos + 1) & (index->capacity - 1);
+    }
+    if (!create) return NULL;
+    token_entry_t *entry = &index->entries[pos];
+    size_t token_len = strlen(token);
+    entry->token = mem_malloc(token_len + 1);
+    if (entry->token == NULL) return NULL;
+    memcpy(entry->token, token, token_len + 1);
+    entry->last = -1;
+    index->used++;
+    return entry;
+}
+
+static int posting_reserve(token_entry_t *entry, size_t extra) {
+    if (entry->length + extra <= entry->capacity) return 0;
+    size_t capacity = entry->capacity ? entry->capacity * 2 : 16;
+    while (capacity < entry->length + extra) capacity *= 2;
+    unsigned char *postings = mem_realloc(entry->postings, capacity);
+    if (postings == NULL) return 1;
+    entry->postings = postings;
+    entry->capacity = capacity;
+    return 0;
+}
+
+static size_t varint_encode(unsigned char *out, uint32_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (unsigned char)value;
+    return length;
+}
+
+// Posting lists are sorted preset slots stored as varint-encoded gaps.
+static int posting_decode(const token_entry_t *entry, int *ids) {
+    size_t pos = 0;
+    int previous = -1;
+    int count = 0;
+    while (pos < entry->length) {
+        uint32_t delta = 0;
+        int shift = 0;
+        while (entry->postings[pos] & 0x80) {
+            delta |= (uint32_t)(entry->postings[pos++] & 0x7F) << shift;
+            shift += 7;
+        }
+        delta |= (uint32_t)entry->postings[pos++] << shift;
+        previous += (int)delta + 1;
+        ids[count++] = previous;
+    }
+    return count;
+}
+
+// Checks a posting list read from disk before it is decoded: every varint
+// must fit in a uint32_t (five bytes) and end inside the list, and the slots
+// must stay below limit. Stores the last slot.
+static int posting_check(const unsigned char *postings, size_t length, uint32_t count, int limit, int *last) {
+    size_t pos = 0;
+    int64_t previous = -1;
+    uint32_t seen = 0;
+    while (pos < length) {
+        uint32_t delta = 0;
+        int bytes = 0;
+        unsigned char byte;
+        do {
+            if (pos >= length) return 0;
+            byte = postings[pos++];
+            if (bytes == 4 && (byte & 0xF0)) return 0;
+            delta |= (uint32_t)(byte & 0x7F) << (7 * bytes++);
+        } while (byte & 0x80);
+        previous += (int64_t)delta + 1;
+        if (previous >= limit) return 0;
+        seen++;
+    }
+    if (seen == 0 || seen != count) return 0;
+    *last = (int)previous;
+    return 1;
+}
+
+static int posting_append(token_entry_t *entry, int id) {
+    if (posting_reserve(entry, 5) != 0) return 1;
+    entry->length += varint_encode(entry->postings + entry->length, (uint32_t)(id - entry->last - 1));
+    entry->last = id;
+    entry->count++;
+    return 0;
+}
+
+static int posting_encode(token_entry_t *entry, const int *ids, int count) {
+    entry->length = 0;
+    entry->count = 0;
+    entry->last = -1;
+    for (int i = 0; i < count; i++) {
+        if (posting_append(entry, ids[i]) != 0) return 1;
+    }
+    return 0;
+}
+
+static void index_add(cmdset_manager_t *manager, int slot) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL || manager->presets[slot].encrypt) return;
+    char token[MAX_COMMAND_LEN];
+    const char *cursor = manager->presets[slot].command;
+    while (next_token(&cursor, token) > 0) {
+        token_entry_t *entry = index_entry(&state->index, token, 1);
+        if (entry == NULL || entry->last == slot) continue;
+        if (slot > entry->last) {
+            posting_append(entry, slot);
+            continue;
+        }
+        int *ids = mem_malloc(sizeof(int) * (entry->count + 1));
+        if (ids == NULL) continue;
+        int count = posting_decode(entry, ids);
+        int pos = 0;
+        while (pos < count && ids[pos] < slot) pos++;
+        if (pos == count || ids[pos] != slot) {
+            memmove(ids + pos + 1, ids + pos, sizeof(int) * (count - pos));
+            ids[pos] = slot;
+            posting_encode(entry, ids, count + 1);
+        }
+        mem_free(ids);
+    }
+}
+
+static void index_remove(cmdset_manager_t *manager, int slot) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL || manager->presets[slot].encrypt) return;
+    char token[MAX_COMMAND_LEN];
+    const char *cursor = manager->presets[slot].command;
+    while (next_token(&cursor, token) > 0) {
+        token_entry_t *entry = index_entry(&state->index, token, 0);
+        if (entry == NULL || entry->count == 0) continue;
+        int *ids = mem_malloc(sizeof(int) * entry->count);
+        if (ids == NULL) continue;
+        int count = posting_decode(entry, ids);
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            if (ids[i] != slot) ids[kept++] = ids[i];
+        }
+        if (kept != count) posting_encode(entry, ids, kept);
+        mem_free(ids);
+    }
+}
+
+static void index_clear(token_index_t *index) {
+    for (size_t i = 0; i < index->capacity; i++) {
+        mem_free(index->entries[i].token);
+        mem_free(index->entries[i].postings);
+    }
+    mem_free(index->entries);
+    memset(index, 0, sizeof(token_index_t));
+}
+
+static void index_rebuild(cmdset_manager_t *manager) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    index_clear(&state->index);
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active) index_add(manager, i);
+    }
+}
+
+// The index file records the hash of the preset file it was built from and is
+// only trusted by index_load while the store on disk still matches it. Slots
+// are renumbered to the order cmdset_save_presets writes presets in. It is
+// replaced the way the store is, so a reader never loads a half-written file.
+static int index_save(cmdset_manager_t *manager, uint64_t store_hash) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return CMDSET_ERROR_MEMORY;
+    int *remap = mem_malloc(sizeof(int) * (manager->count + 1));
+    int *ids = mem_malloc(sizeof(int) * (manager->count + 1));
+    if (remap == NULL || ids == NULL) {
+        mem_free(remap);
+        mem_free(ids);
+        return CMDSET_ERROR_MEMORY;
+    }
+    uint32_t preset_count = 0;
+    for (int i = 0; i < manager->count; i++) remap[i] = manager->presets[i].active ? (int)preset_count++ : -1;
+    uint32_t token_count = 0;
+    for (size_t i = 0; i < state->index.capacity; i++) {
+        if (state->index.entries[i].token != NULL && state->index.entries[i].count > 0) token_count++;
+    }
+    char temporary[sizeof(default_ctx.store_path)];
+    FILE *file = replace_open(manager, INDEX_SUFFIX, temporary, sizeof(temporary));
+    if (file == NULL) {
+        mem_free(remap);
+        mem_free(ids);
+        return CMDSET_ERROR_FILE;
+    }
+    uint32_t header[2] = {INDEX_MAGIC, INDEX_VERSION};
+    int failed = fwrite(header, sizeof(header), 1, file) != 1 ||
+        fwrite(&store_hash, sizeof(store_hash), 1, file) != 1 ||
+        fwrite(&preset_count, sizeof(preset_count), 1, file) != 1 ||
+        fwrite(&token_count, sizeof(token_count), 1, file) != 1;
+    token_entry_t remapped = {0};
+    for (size_t i = 0; i < state->index.capacity; i++) {
+        const token_entry_t *entry = &state->index.entries[i];
+        if (entry->token == NULL || entry->count == 0) continue;
+        int count = posting_decode(entry, ids);
+        int kept = 0;
+        for (int j = 0; j < count; j++) {
+            if (remap[ids[j]] >= 0) ids[kept++] = remap[ids[j]];
+        }
+        posting_encode(&remapped, ids, kept);
+        uint32_t token_len = (uint32_t)strlen(entry->token);
+        uint32_t posting_count = (uint32_t)remapped.count;
+        uint32_t posting_len = (uint32_t)remapped.length;
+        if (fwrite(&token_len, sizeof(token_len), 1, file) != 1 ||
+            fwrite(entry->token, 1, token_len, file) != token_len ||
+            fwrite(&posting_count, sizeof(posting_count), 1, file) != 1 ||
+            fwrite(&posting_len, sizeof(posting_len), 1, file) != 1 ||
+            fwrite(remapped.postings, 1, posting_len, file) != posting_len) failed = 1;
+    }
+    mem_free(remapped.postings);
+    mem_free(remap);
+    mem_free(ids);
+    return replace_close(manager, INDEX_SUFFIX, file, temporary, failed);
+}
+
+static int index_load(cmdset_manager_t *manager, uint64_t store_hash) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return CMDSET_ERROR_MEMORY;
+    char path[sizeof(default_ctx.store_path)];
+    store_path(manager, INDEX_SUFFIX, path, sizeof(path));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return CMDSET_ERROR_FILE;
+    struct stat file_stat;
+    if (fstat(fileno(file), &file_stat) != 0) {
+        fclose(file);
+        return CMDSET_ERROR_FILE;
+    }
+    uint32_t header[2];
+    uint64_t file_hash;
+    uint32_t preset_count;
+    uint32_t token_count;
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != INDEX_MAGIC || header[1] != INDEX_VERSION ||
+        fread(&file_hash, sizeof(file_hash), 1, file) != 1 || file_hash != store_hash ||
+        fread(&preset_count, sizeof(preset_count), 1, file) != 1 || preset_count != (uint32_t)manager->count ||
+        fread(&token_count, sizeof(token_count), 1, file) != 1) {
+        fclose(file);
+        return CMDSET_ERROR_INVALID;
+    }
+    index_clear(&state->index);
+    // Lengths are checked against what is left of the file before anything is
+    // allocated or read for them.
+    uint64_t remaining = (uint64_t)file_stat.st_size - (uint64_t)ftell(file);
+    char token[MAX_COMMAND_LEN];
+    uint32_t loaded = 0;
+    while (loaded < token_count) {
+        uint32_t token_len, posting_count, posting_len;
+        if (remaining < sizeof(token_len) || fread(&token_len, sizeof(token_len), 1, file) != 1) break;
+        remaining -= sizeof(token_len);
+        if (token_len == 0 || token_len >= MAX_COMMAND_LEN || token_len > remaining ||
+            fread(token, 1, token_len, file) != token_len) break;
+        remaining -= token_len;
+        token[token_len] = '\0';
+        token_entry_t *entry = index_entry(&state->index, token, 1);
+        if (entry == NULL || entry->count != 0 || remaining < sizeof(posting_count) + sizeof(posting_len) ||
+            fread(&posting_count, sizeof(posting_count), 1, file) != 1 || posting_count == 0 || posting_count > preset_count ||
+            fread(&posting_len, sizeof(posting_len), 1, file) != 1) break;
+        remaining -= sizeof(posting_count) + sizeof(posting_len);
+        if (posting_len == 0 || posting_len > remaining || posting_len > (uint64_t)posting_count * 5 ||
+            posting_reserve(entry, posting_len) != 0 ||
+            fread(entry->postings, 1, posting_len, file) != posting_len) break;
+        remaining -= posting_len;
+        int last;
+        if (!posting_check(entry->postings, posting_len, posting_count, manager->count, &last)) break;
+        entry->length = posting_len;
+        entry->count = (int)posting_count;
+        entry->last = last;
+        loaded++;
+    }
+    fclose(file);
+    if (loaded != token_count) {
+        index_clear(&state->index);
+        return CMDSET_ERROR_JSON;
+    }
+    return CMDSET_SUCCESS;
+}
+
+static int roaring_find(const roaring_t *bitmap, uint16_t key) {
+    int low = 0;
+    int high = bitmap->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (bitmap->containers[mid].key < key) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static int container_contains(const roaring_container_t *container, uint16_t value) {
+    if (container->bits != NULL) return (container->bits[value >> 6] >> (value & 63)) & 1;
+    int low = 0;
+    int high = container->cardinality;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (container->array[mid] < value) low = mid + 1;
+        else high = mid;
+    }
+    return low < container->cardinality && container->array[low] == value;
+}
+
+static int container_to_bitset(roaring_container_t *container) {
+    uint64_t *bits = mem_calloc(ROARING_BITSET_WORDS, sizeof(uint64_t));
+    if (bits == NULL) return 1;
+    for (int i = 0; i < container->cardinality; i++) bits[container->array[i] >> 6] |= 1ULL << (container->array[i] & 63);
+    mem_free(container->array);
+    container->array = NULL;
+    container->capacity = 0;
+    container->bits = bits;
+    return 0;
+}
+
+static int roaring_add(roaring_t *bitmap, uint32_t value) {
+    uint16_t key = (uint16_t)(value >> 16);
+    uint16_t low_bits = (uint16_t)(value & 0xFFFF);
+    int pos = roaring_find(bitmap, key);
+    if (pos == bitmap->count || bitmap->containers[pos].key != key) {
+        if (bitmap->count == bitmap->capacity) {
+            int capacity = bitmap->capacity ? bitmap->capacity * 2 : 4;
+            roaring_container_t *containers = mem_realloc(bitmap->containers, sizeof(roaring_container_t) * capacity);
+            if (containers == NULL) return 1;
+            bitmap->containers = containers;
+            bitmap->capacity = capacity;
+        }
+        memmove(&bitmap->containers[pos + 1], &bitmap->containers[pos], sizeof(roaring_container_t) * (bitmap->count - pos));
+        memset(&bitmap->containers[pos], 0, sizeof(roaring_container_t));
+        bitmap->containers[pos].key = key;
+        bitmap->count++;
+    }
+    roaring_container_t *container = &bitmap->containers[pos];
+    if (container_contains(container, low_bits)) return 0;
+    if (container->bits == NULL && container->cardinality >= ROARING_ARRAY_MAX && container_to_bitset(container) != 0) return 1;
+    if (container->bits != NULL) {
+        container->bits[low_bits >> 6] |= 1ULL << (low_bits & 63);
+        container->cardinality++;
+        return 0;
+    }
+    if (container->cardinality == container->capacity) {
+        int capacity = container->capacity ? container->capacity * 2 : 8;
+        uint16_t *array = mem_realloc(container->array, sizeof(uint16_t) * capacity);
+        if (array == NULL) return 1;
+        container->array = array;
+        container->capacity = capacity;
+    }
+    int at = container->cardinality;
+    while (at > 0 && container->array[at - 1] > low_bits) {
+        container->array[at] = container->array[at - 1];
+        at--;
+    }
+    container->array[at] = low_bits;
+    container->cardinality++;
+    return 0;
+}
+
+static void roaring_remove(roaring_t *bitmap, uint32_t value) {
+    uint16_t key = (uint16_t)(value >> 16);
+    uint16_t low_bits = (uint16_t)(value & 0xFFFF);
+    int pos = roaring_find(bitmap, key);
+    if (pos == bitmap->count || bitmap->containers[pos].key != key) return;
+    roaring_container_t *container = &bitmap->containers[pos];
+    if (!container_contains(container, low_bits)) return;
+    if (container->bits != NULL) container->bits[low_bits >> 6] &= ~(1ULL << (low_bits & 63));
+    else {
+        int at = 0;
+        while (container->array[at] != low_bits) at++;
+        memmove(&container->array[at], &container->array[at + 1], sizeof(uint16_t) * (container->cardinality - at - 1));
+    }
+    container->cardinality--;
+    if (container->cardinality == 0) {
+        mem_free(container->array);
+        mem_free(container->bits);
+        memmove(&bitmap->containers[pos], &bitmap->containers[pos + 1], sizeof(roaring_container_t) * (bitmap->count - pos - 1));
+        bitmap->count--;
+    }
+}
+
+static void roaring_free(roaring_t *bitmap) {
+    for (int i = 0; i < bitmap->count; i++) {
+        mem_free(bitmap->containers[i].array);
+        mem_free(bitmap->containers[i].bits);
+    }
+    mem_free(bitmap->containers);
+    memset(bitmap, 0, sizeof(roaring_t));
+}
+
+// Intersects the containers of two bitmaps and appends the matching values to
+// out in ascending order. Only keys present in both bitmaps are visited, and
+// each pair of containers is merged, probed or ANDed depending on its kinds.
+static int roaring_and_values(const roaring_t *a, const roaring_t *b, uint32_t *out) {
+    int count = 0;
+    int i = 0, j = 0;
+    while (i < a->count && j < b->count) {
+        const roaring_container_t *left = &a->containers[i];
+        const roaring_container_t *right = &b->containers[j];
+        if (left->key < right->key) {
+            i++;
+            continue;
+        }
+        if (left->key > right->key) {
+            j++;
+            continue;
+        }
+        uint32_t high = (uint32_t)left->key << 16;
+        if (left->bits != NULL && right->bits != NULL) {
+            for (int w = 0; w < ROARING_BITSET_WORDS; w++) {
+                uint64_t word = left->bits[w] & right->bits[w];
+                while (word != 0) {
+                    out[count++] = high | (uint32_t)(w * 64 + __builtin_ctzll(word));
+                    word &= word - 1;
+                }
+            }
+        } else if (left->bits != NULL || right->bits != NULL) {
+            const roaring_container_t *array = left->bits != NULL ? right : left;
+            const roaring_container_t *bitset = left->bits != NULL ? left : right;
+            for (int k = 0; k < array->cardinality; k++) {
+                if (container_contains(bitset, array->array[k])) out[count++] = high | array->array[k];
+            }
+        } else {
+            int x = 0, y = 0;
+            while (x < left->cardinality && y < right->cardinality) {
+                if (left->array[x] < right->array[y]) x++;
+                else if (left->array[x] > right->array[y]) y++;
+                else {
+                    out[count++] = high | left->array[x];
+                    x++;
+                    y++;
+                }
+            }
+        }
+        i++;
+        j++;
+    }
+    return count;
+}
+
+static int roaring_values(const roaring_t *bitmap, uint32_t *out) {
+    int count = 0;
+    for (int i = 0; i < bitmap->count; i++) {
+        const roaring_container_t *container = &bitmap->containers[i];
+        uint32_t high = (uint32_t)container->key << 16;
+        if (container->bits == NULL) {
+            for (int k = 0; k < container->cardinality; k++) out[count++] = high | container->array[k];
+            continue;
+        }
+        for (int w = 0; w < ROARING_BITSET_WORDS; w++) {
+            uint64_t word = container->bits[w];
+            while (word != 0) {
+                out[count++] = high | (uint32_t)(w * 64 + __builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    }
+    return count;
+}
+
+static int roaring_cardinality(const roaring_t *bitmap) {
+    int cardinality = 0;
+    for (int i = 0; i < bitmap->count; i++) cardinality += bitmap->containers[i].cardinality;
+    return cardinality;
+}
+
+static int roaring_contains(const roaring_t *bitmap, uint32_t value) {
+    int pos = roaring_find(bitmap, (uint16_t)(value >> 16));
+    if (pos == bitmap->count || bitmap->containers[pos].key != (uint16_t)(value >> 16)) return 0;
+    return container_contains(&bitmap->containers[pos], (uint16_t)(value & 0xFFFF));
+}
+
+static int is_valid_tag(const char *tag) {
+    size_t length = strlen(tag);
+    if (length == 0 || length >= MAX_TAG_LEN) return 0;
+    for (size_t i = 0; i < length; i++) {
+        if (!isgraph((unsigned char)tag[i]) || tag[i] == ',') return 0;
+    }
+    return 1;
+}
+
+static int tag_id(struct cmdset_state *state, const char *tag, int create) {
+    for (int i = 0; i < state->tag_count; i++) {
+        if (strcmp(state->tag_names[i], tag) == 0) return i;
+    }
+    if (!create || state->tag_count >= MAX_TAGS) return -1;
+    if (state->tag_count == state->tag_capacity) {
+        int capacity = state->tag_capacity ? state->tag_capacity * 2 : 8;
+        char **names = mem_realloc(state->tag_names, sizeof(char *) * capacity);
+        if (names == NULL) return -1;
+        state->tag_names = names;
+        roaring_t *bitmaps = mem_realloc(state->tag_bitmaps, sizeof(roaring_t) * capacity);
+        if (bitmaps == NULL) return -1;
+        state->tag_bitmaps = bitmaps;
+        state->tag_capacity = capacity;
+    }
+    size_t length = strlen(tag);
+    char *name = mem_malloc(length + 1);
+    if (name == NULL) return -1;
+    memcpy(name, tag, length + 1);
+    state->tag_names[state->tag_count] = name;
+    memset(&state->tag_bitmaps[state->tag_count], 0, sizeof(roaring_t));
+    return state->tag_count++;
+}
+
+static int tag_attach(cmdset_manager_t *manager, int slot, const char *tag) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return CMDSET_ERROR_MEMORY;
+    if (!is_valid_tag(tag)) return CMDSET_ERROR_INVALID;
+    int id = tag_id(state, tag, 1);
+    if (id < 0) return CMDSET_ERROR_MEMORY;
+    preset_tags_t *tags = &state->slot_tags[slot];
+    for (int i = 0; i < tags->count; i++) {
+        if (tags->ids[i] == id) return CMDSET_SUCCESS;
+    }
+    uint16_t *ids = mem_realloc(tags->ids, sizeof(uint16_t) * (tags->count + 1));
+    if (ids == NULL) return CMDSET_ERROR_MEMORY;
+    tags->ids = ids;
+    if (roaring_add(&state->tag_bitmaps[id], (uint32_t)slot) != 0) return CMDSET_ERROR_MEMORY;
+    tags->ids[tags->count++] = (uint16_t)id;
+    return CMDSET_SUCCESS;
+}
+
+static int tag_detach(cmdset_manager_t *manager, int slot, const char *tag) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return CMDSET_ERROR_MEMORY;
+    int id = tag_id(state, tag, 0);
+    preset_tags_t *tags = &state->slot_tags[slot];
+    for (int i = 0; id >= 0 && i < tags->count; i++) {
+        if (tags->ids[i] == id) {
+            tags->ids[i] = tags->ids[--tags->count];
+            roaring_remove(&state->tag_bitmaps[id], (uint32_t)slot);
+            return CMDSET_SUCCESS;
+        }
+    }
+    return CMDSET_ERROR_NOT_FOUND;
+}
+
+static void tags_detach_all(cmdset_manager_t *manager, int slot) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    preset_tags_t *tags = &state->slot_tags[slot];
+    for (int i = 0; i < tags->count; i++) roaring_remove(&state->tag_bitmaps[tags->ids[i]], (uint32_t)slot);
+    mem_free(tags->ids);
+    tags->ids = NULL;
+    tags->count = 0;
+}
+
+static void tags_clear(struct cmdset_state *state) {
+    for (int i = 0; i < state->tag_count; i++) {
+        mem_free(state->tag_names[i]);
+        roaring_free(&state->tag_bitmaps[i]);
+    }
+    mem_free(state->tag_names);
+    mem_free(state->tag_bitmaps);
+    state->tag_names = NULL;
+    state->tag_bitmaps = NULL;
+    state->tag_count = 0;
+    state->tag_capacity = 0;
+    for (int i = 0; i < MAX_PRESETS; i++) {
+        mem_free(state->slot_tags[i].ids);
+        state->slot_tags[i].ids = NULL;
+        state->slot_tags[i].count = 0;
+    }
+}
+
+// Removed presets only clear their active flag, so their slots are reclaimed
+// here once the array fills: live presets move down and everything keyed by
+// slot is rebuilt.
+static void presets_compact(cmdset_manager_t *manager) {
+    struct cmdset_state *state = get_state(manager);
+    int count = 0;
+    for (int i = 0; i < manager->count; i++) {
+        if (!manager->presets[i].active) continue;
+        if (i != count) {
+            manager->presets[count] = manager->presets[i];
+            if (state != NULL) {
+                state->slot_tags[count] = state->slot_tags[i];
+                state->slot_tags[i].ids = NULL;
+                state->slot_tags[i].count = 0;
+                state->max_concurrency[count] = state->max_concurrency[i];
+                state->profiles[count] = state->profiles[i];
+                state->usage[count] = state->usage[i];
+                state->unsaved[count] = state->unsaved[i];
+            }
+        }
+        count++;
+    }
+    if (count == manager->count) return;
+    memset(&manager->presets[count], 0, sizeof(cmdset_preset_t) * (manager->count - count));
+    manager->count = count;
+    if (state != NULL) {
+        for (int id = 0; id < state->tag_count; id++) roaring_free(&state->tag_bitmaps[id]);
+        for (int slot = 0; slot < count; slot++) {
+            for (int i = 0; i < state->slot_tags[slot].count; i++) roaring_add(&state->tag_bitmaps[state->slot_tags[slot].ids[i]], (uint32_t)slot);
+        }
+    }
+    rank_rebuild(manager);
+    index_rebuild(manager);
+    trie_rebuild(manager);
+    bk_rebuild(manager);
+}
+
+static void tags_from_json(cmdset_manager_t *manager, int slot, json_object *preset) {
+    json_object *tags;
+    if (!json_object_object_get_ex(preset, "tags", &tags) || !json_object_is_type(tags, json_type_array)) return;
+    int tag_count = json_object_array_length(tags);
+    for (int i = 0; i < tag_count; i++) {
+        json_object *tag = json_object_array_get_idx(tags, i);
+        if (tag != NULL && json_object_is_type(tag, json_type_string)) tag_attach(manager, slot, json_object_get_string(tag));
+    }
+}
+
+static void limit_from_json(cmdset_manager_t *manager, int slot, json_object *preset) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    json_object *limit;
+    if (json_object_object_get_ex(preset, "max_concurrency", &limit) && json_object_is_type(limit, json_type_int) && json_object_get_int(limit) > 0) {
+        state->max_concurrency[slot] = json_object_get_int(limit);
+    } else state->max_concurrency[slot] = 0;
+}
+
+static void sched_from_json(cmdset_manager_t *manager, int slot, json_object *preset) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    json_object *sched;
+    if (!json_object_object_get_ex(preset, "sched", &sched) || !json_object_is_type(sched, json_type_string) ||
+        sched_parse(json_object_get_string(sched), &state->profiles[slot]) != CMDSET_SUCCESS) {
+        memset(&state->profiles[slot], 0, sizeof(sched_profile_t));
+    }
+}
+
+static double usage_number(json_object *usage, const char *key) {
+    json_object *item;
+    if (!json_object_object_get_ex(usage, key, &item)) return 0;
+    if (!json_object_is_type(item, json_type_double) && !json_object_is_type(item, json_type_int)) return 0;
+    return json_object_get_double(item);
+}
+
+// keep_max keeps whichever side has recorded more runs, as merges do for use_count.
+static void usage_from_json(cmdset_manager_t *manager, int slot, json_object *preset, int keep_max) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    cmdset_usage_t incoming;
+    memset(&incoming, 0, sizeof(incoming));
+    json_object *usage;
+    if (json_object_object_get_ex(preset, "usage", &usage) && json_object_is_type(usage, json_type_object)) {
+        incoming.runs = (long)usage_number(usage, "runs");
+        incoming.wall_seconds = usage_number(usage, "wall");
+        incoming.user_seconds = usage_number(usage, "user");
+        incoming.system_seconds = usage_number(usage, "system");
+        incoming.last_wall_seconds = usage_number(usage, "last_wall");
+        incoming.max_rss_kb = (long)usage_number(usage, "max_rss_kb");
+        incoming.in_blocks = (long)usage_number(usage, "in_blocks");
+        incoming.out_blocks = (long)usage_number(usage, "out_blocks");
+    }
+    if (!keep_max || incoming.runs > state->usage[slot].runs) state->usage[slot] = incoming;
+}
+
+static void state_free(struct cmdset_state *state) {
+    if (state == NULL) return;
+    index_clear(&state->index);
+    tags_clear(state);
+    mem_free(state->removed);
+    trie_clear(state->trie);
+    snapshot_reclaim(state, 1);
+    mem_free(state->current);
+    pthread_rwlock_destroy(&state->lock);
+    pthread_mutex_destroy(&state->rank_lock);
+    pthread_mutex_destroy(&state->save_lock);
+    pthread_mutex_destroy(&state->flush_lock);
+    pthread_cond_destroy(&state->flush_cond);
+    mem_free(state);
+}
+
+static void append_output(char *output, int max_len, int *offset, int *truncated, const char *format, ...) {
+    if (*truncated) return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(output + *offset, max_len - *offset, format, args);
+    va_end(args);
+    if (written < 0 || written >= max_len - *offset) {
+        *offset = max_len - 1;
+        *truncated = 1;
+    } else *offset += written;
+}
+
+static void write_all(writer_t *writer, const char *data, size_t length) {
+    size_t done = 0;
+    while (!writer->failed && done < length) {
+        ssize_t written = write(writer->fd, data + done, length - done);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            writer->failed = 1;
+        } else done += (size_t)written;
+    }
+}
+
+static void writer_flush(writer_t *writer) {
+    write_all(writer, writer->buffer, writer->length);
+    writer->length = 0;
+}
+
+static void writer_put(writer_t *writer, const char *data, size_t length) {
+    if (writer->length + length > WRITER_BUFFER_SIZE) writer_flush(writer);
+    if (length > WRITER_BUFFER_SIZE) write_all(writer, data, length);
+    else {
+        memcpy(writer->buffer + writer->length, data, length);
+        writer->length += length;
+    }
+}
+
+static void writer_puts(writer_t *writer, const char *text) {
+    writer_put(writer, text, strlen(text));
+}
+
+static void writer_long(writer_t *writer, long value) {
+    char digits[24];
+    int pos = sizeof(digits);
+    unsigned long magnitude = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+    do {
+        digits[--pos] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) digits[--pos] = '-';
+    writer_put(writer, digits + pos, sizeof(digits) - pos);
+}
+
+// Copies runs of bytes that need no escaping in one go rather than per byte.
+static void writer_escaped(writer_t *writer, const char *text, int format) {
+    const char *run = text;
+    for (const char *p = text; *p != '\0'; p++) {
+        unsigned char c = (unsigned char)*p;
+        char escape[8];
+        const char *replacement = NULL;
+        if (format == CMDSET_FORMAT_TSV) {
+            if (c == '\t') replacement = "\\t";
+            else if (c == '\n') replacement = "\\n";
+            else if (c == '\r') replacement = "\\r";
+            else if (c == '\\') replacement = "\\\\";
+        } else {
+            if (c == '"') replacement = "\\\"";
+            else if (c == '\\') replacement = "\\\\";
+            else if (c == '\n') replacement = "\\n";
+            else if (c == '\t') replacement = "\\t";
+            else if (c == '\r') replacement = "\\r";
+            else if (c < 0x20) {
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                replacement = escape;
+            }
+        }
+        if (replacement == NULL) continue;
+        writer_put(writer, run, p - run);
+        writer_puts(writer, replacement);
+        run = p + 1;
+    }
+    writer_puts(writer, run);
+}
+
+static void write_preset_record(cmdset_manager_t *manager, writer_t *writer, const cmdset_preset_t *preset, int format, int first) {
+    const char *tags[MAX_PRESETS];
+    int tag_count = get_preset_tags_unlocked(manager, preset, tags, MAX_PRESETS);
+    if (format == CMDSET_FORMAT_TSV) {
+        writer_escaped(writer, preset->name, format);
+        writer_puts(writer, "\t");
+        if (!preset->encrypt) writer_escaped(writer, preset->command, format);
+        writer_puts(writer, preset->encrypt ? "\ttrue\t" : "\tfalse\t");
+        writer_long(writer, preset->created_at);
+        writer_puts(writer, "\t");
+        writer_long(writer, cmdset_preset_last_used(preset));
+        writer_puts(writer, "\t");
+        writer_long(writer, cmdset_preset_use_count(preset));
+        writer_puts(writer, "\t");
+        for (int i = 0; i < tag_count; i++) {
+            if (i > 0) writer_puts(writer, ",");
+            writer_escaped(writer, tags[i], format);
+        }
+        writer_puts(writer, "\n");
+        return;
+    }
+    if (format == CMDSET_FORMAT_JSON) writer_puts(writer, first ? "\n  " : ",\n  ");
+    writer_puts(writer, "{\"name\":\"");
+    writer_escaped(writer, preset->name, format);
+    if (preset->encrypt) writer_puts(writer, "\",\"command\":null,\"encrypt\":true,\"created_at\":");
+    else {
+        writer_puts(writer, "\",\"command\":\"");
+        writer_escaped(writer, preset->command, format);
+        writer_puts(writer, "\",\"encrypt\":false,\"created_at\":");
+    }
+    writer_long(writer, preset->created_at);
+    writer_puts(writer, ",\"last_used\":");
+    writer_long(writer, cmdset_preset_last_used(preset));
+    writer_puts(writer, ",\"use_count\":");
+    writer_long(writer, cmdset_preset_use_count(preset));
+    writer_puts(writer, ",\"tags\":[");
+    for (int i = 0; i < tag_count; i++) {
+        writer_puts(writer, i > 0 ? ",\"" : "\"");
+        writer_escaped(writer, tags[i], format);
+        writer_puts(writer, "\"");
+    }
+    writer_puts(writer, format == CMDSET_FORMAT_NDJSON ? "]}\n" : "]}");
+}
+
+static int compare_completion_names(const void *a, const void *b) {
+    return strcmp(((const completion_entry_t *)a)->name, ((const completion_entry_t *)b)->name);
+}
+
+static int compare_completion_keys(const void *a, const void *b) {
+    double key_a = ((const completion_entry_t *)a)->key;
+    double key_b = ((const completion_entry_t *)b)->key;
+    if (key_a != key_b) return key_a > key_b ? -1 : 1;
+    return strcmp(((const completion_entry_t *)a)->name, ((const completion_entry_t *)b)->name);
+}
+
+// The completion cache is a header, a table of records sorted by name and the
+// NUL-terminated names they point at. It is written to a temporary file and
+// renamed into place so a concurrent mmap never sees a partial file.
+static int completion_save(cmdset_manager_t *manager) {
+    struct cmdset_state *state = get_state(manager);
+    completion_entry_t *entries = mem_malloc(sizeof(completion_entry_t) * (manager->count + 1));
+    if (state == NULL || entries == NULL) {
+        mem_free(entries);
+        return CMDSET_ERROR_MEMORY;
+    }
+    uint32_t count = 0;
+    uint32_t names_len = 0;
+    for (int i = 0; i < manager->count; i++) {
+        if (!manager->presets[i].active) continue;
+        entries[count].name = manager->presets[i].name;
+        entries[count].key = frecency_key(state, &manager->presets[i]);
+        names_len += (uint32_t)strlen(manager->presets[i].name) + 1;
+        count++;
+    }
+    qsort(entries, count, sizeof(completion_entry_t), compare_completion_names);
+    char temporary[sizeof(default_ctx.store_path)];
+    FILE *file = replace_open(manager, COMPLETION_SUFFIX, temporary, sizeof(temporary));
+    if (file == NULL) {
+        mem_free(entries);
+        return CMDSET_ERROR_FILE;
+    }
+    uint32_t header[4] = {COMPLETION_MAGIC, COMPLETION_VERSION, count, names_len};
+    completion_stamp_t stamp;
+    completion_stamp(&stamp, state->store_hash, &state->store_stat);
+    int failed = fwrite(header, sizeof(header), 1, file) != 1 || fwrite(&stamp, sizeof(stamp), 1, file) != 1;
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        completion_record_t record;
+        record.name_offset = offset;
+        record.name_len = (uint32_t)strlen(entries[i].name);
+        record.key = entries[i].key;
+        if (fwrite(&record, sizeof(record), 1, file) != 1) failed = 1;
+        offset += record.name_len + 1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        size_t length = strlen(entries[i].name) + 1;
+        if (fwrite(entries[i].name, 1, length, file) != length) failed = 1;
+    }
+    mem_free(entries);
+    return replace_close(manager, COMPLETION_SUFFIX, file, temporary, failed);
+}
+
+static void completion_stamp(completion_stamp_t *stamp, uint64_t hash, const struct stat *info) {
+    stamp->hash = hash;
+    stamp->inode = (uint64_t)info->st_ino;
+    stamp->size = (int64_t)info->st_size;
+    stamp->mtime_sec = (int64_t)info->st_mtime;
+#ifdef __APPLE__
+    stamp->mtime_nsec = (int64_t)info->st_mtimespec.tv_nsec;
+#else
+    stamp->mtime_nsec = (int64_t)info->st_mtim.tv_nsec;
+#endif
+}
+
+// One stat settles the common case: a store with the inode, size and mtime
+// the cache recorded is the one it was built from. Every save renames a new
+// file into place, so a store rewritten within the same second still has a
+// new inode. Only then is the store read and hashed, so that a store replaced
+// by an identical copy is not rebuilt. Returns -1 if there is no store.
+static int completion_is_stale(cmdset_ctx_t *ctx, const unsigned char *map) {
+    struct stat info;
+    if (stat(ctx->store_path, &info) != 0) return -1;
+    if (map == NULL) return 1;
+    completion_stamp_t recorded;
+    completion_stamp_t current;
+    memcpy(&recorded, map + sizeof(uint32_t) * 4, sizeof(recorded));
+    completion_stamp(&current, recorded.hash, &info);
+    if (memcmp(&recorded, &current, sizeof(current)) == 0) return 0;
+    FILE *file = fopen(ctx->store_path, "rb");
+    if (file == NULL) return 1;
+    active_allocator = &ctx->allocator;
+    char *content = mem_malloc((size_t)info.st_size + 1);
+    int stale = 1;
+    if (content != NULL) stale = hash_content(content, fread(content, 1, (size_t)info.st_size, file)) != recorded.hash;
+    mem_free(content);
+    active_allocator = NULL;
+    fclose(file);
+    return stale;
+}
+
+// Executions update use_count and last_used under the shared lock, so those
+// two fields are read atomically.
+static void copy_preset(cmdset_preset_t *destination, const cmdset_preset_t *source) {
+    memcpy(destination->name, source->name, sizeof(destination->name));
+    memcpy(destination->command, source->command, sizeof(destination->command));
+    destination->active = source->active;
+    destination->encrypt = source->encrypt;
+    destination->created_at = source->created_at;
+    destination->last_used = __atomic_load_n(&source->last_used, __ATOMIC_RELAXED);
+    destination->use_count = __atomic_load_n(&source->use_count, __ATOMIC_RELAXED);
+}
+
+static int find_slot(cmdset_manager_t *manager, const char *name) {
+    struct cmdset_state *state = get_state(manager);
+    if (state != NULL) return trie_find(state, name);
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active && strcmp(manager->presets[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static trie_node_t* trie_node_new(const char *label, int label_len, int slot) {
+    trie_node_t *node = mem_calloc(1, sizeof(trie_node_t));
+    if (node == NULL) return NULL;
+    node->label = mem_malloc(label_len + 1);
+    if (node->label == NULL) {
+        mem_free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, label_len);
+    node->label[label_len] = '\0';
+    node->label_len = label_len;
+    node->slot = slot;
+    return node;
+}
+
+// Index of the child whose label starts with c, or where it would be inserted.
+static int trie_child_position(const trie_node_t *node, unsigned char c) {
+    int low = 0, high = node->child_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if ((unsigned char)node->children[mid]->label[0] < c) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static int trie_add_child(trie_node_t *node, int position, trie_node_t *child) {
+    trie_node_t **children = mem_realloc(node->children, (node->child_count + 1) * sizeof(trie_node_t*));
+    if (children == NULL) return -1;
+    memmove(children + position + 1, children + position, (node->child_count - position) * sizeof(trie_node_t*));
+    children[position] = child;
+    node->children = children;
+    node->child_count++;
+    return 0;
+}
+
+static void trie_insert(struct cmdset_state *state, const char *name, int slot) {
+    if (trie_find(state, name) >= 0) return;
+    if (state->trie == NULL && (state->trie = trie_node_new("", 0, -1)) == NULL) return;
+    trie_node_t *path[MAX_NAME_LEN + 1];
+    int depth = 0;
+    trie_node_t *node = state->trie;
+    path[depth++] = node;
+    while (*name != '\0') {
+        int position = trie_child_position(node, (unsigned char)*name);
+        if (position == node->child_count || node->children[position]->label[0] != *name) {
+            trie_node_t *leaf = trie_node_new(name, (int)strlen(name), slot);
+            if (leaf == NULL) return;
+            if (trie_add_child(node, position, leaf) != 0) {
+                trie_clear(leaf);
+                return;
+            }
+            leaf->count = 1;
+            for (int i = 0; i < depth; i++) path[i]->count++;
+            return;
+        }
+        trie_node_t *child = node->children[position];
+        int common = 0;
+        while (common < child->label_len && name[common] == child->label[common]) common++;
+        if (common < child->label_len) {
+            trie_node_t *split = trie_node_new(child->label, common, -1);
+            if (split == NULL) return;
+            split->children = mem_malloc(sizeof(trie_node_t*));
+            if (split->children == NULL) {
+                trie_clear(split);
+                return;
+            }
+            split->children[0] = child;
+            split->child_count = 1;
+            split->count = child->count;
+            memmove(child->label, child->label + common, child->label_len - common + 1);
+            child->label_len -= common;
+            node->children[position] = split;
+            child = split;
+        }
+        node = child;
+        path[depth++] = node;
+        name += common;
+    }
+    node->slot = slot;
+    for (int i = 0; i < depth; i++) path[i]->count++;
+}
+
+static void trie_remove(struct cmdset_state *state, const char *name) {
+    if (state == NULL || state->trie == NULL) return;
+    trie_node_t *path[MAX_NAME_LEN + 1];
+    int positions[MAX_NAME_LEN + 1];
+    int depth = 0;
+    trie_node_t *node = state->trie;
+    path[depth++] = node;
+    while (*name != '\0') {
+        int position = trie_child_position(node, (unsigned char)*name);
+        if (position == node->child_count) return;
+        trie_node_t *child = node->children[position];
+        if (strncmp(name, child->label, child->label_len) != 0) return;
+        positions[depth] = position;
+        node = child;
+        path[depth++] = node;
+        name += child->label_len;
+    }
+    if (node->slot < 0) return;
+    node->slot = -1;
+    for (int i = 0; i < depth; i++) path[i]->count--;
+    // Drop emptied nodes and merge pass-through nodes into their only child.
+    for (int i = depth - 1; i > 0; i--) {
+        trie_node_t *current = path[i];
+        trie_node_t *parent = path[i - 1];
+        if (current->count == 0) {
+            memmove(parent->children + positions[i], parent->children + positions[i] + 1, (parent->child_count - positions[i] - 1) * sizeof(trie_node_t*));
+            parent->child_count--;
+            trie_clear(current);
+        } else if (current->slot < 0 && current->child_count == 1) {
+            trie_node_t *child = current->children[0];
+            char *label = mem_malloc(current->label_len + child->label_len + 1);
+            if (label == NULL) continue;
+            memcpy(label, current->label, current->label_len);
+            memcpy(label + current->label_len, child->label, child->label_len + 1);
+            mem_free(child->label);
+            child->label = label;
+            child->label_len += current->label_len;
+            parent->children[positions[i]] = child;
+            current->child_count = 0;
+            trie_clear(current);
+        }
+    }
+}
+
+static int trie_find(const struct cmdset_state *state, const char *name) {
+    const trie_node_t *node = state->trie;
+    if (node == NULL) return -1;
+    while (*name != '\0') {
+        int position = trie_child_position(node, (unsigned char)*name);
+        if (position == node->child_count) return -1;
+        node = node->children[position];
+        if (strncmp(name, node->label, node->label_len) != 0) return -1;
+        name += node->label_len;
+    }
+    return node->slot;
+}
+
+// Returns the shallowest node whose subtree holds every name starting with
+// prefix. The prefix may end in the middle of that node's label.
+static const trie_node_t* trie_locate(const struct cmdset_state *state, const char *prefix) {
+    const trie_node_t *node = state->trie;
+    if (node == NULL) return NULL;
+    size_t remaining = strlen(prefix);
+    while (remaining > 0) {
+        int position = trie_child_position(node, (unsigned char)*prefix);
+        if (position == node->child_count) return NULL;
+        node = node->children[position];
+        size_t compare = remaining < (size_t)node->label_len ? remaining : (size_t)node->label_len;
+        if (memcmp(prefix, node->label, compare) != 0) return NULL;
+        prefix += compare;
+        remaining -= compare;
+    }
+    return node->count > 0 ? node : NULL;
+}
+
+// Depth-first walk; a node's own name sorts before its children's names.
+static int trie_collect(const trie_node_t *node, int *slots, int found, int max_slots) {
+    if (found < max_slots && node->slot >= 0) slots[found++] = node->slot;
+    for (int i = 0; i < node->child_count && found < max_slots; i++) found = trie_collect(node->children[i], slots, found, max_slots);
+    return found;
+}
+
+static void trie_clear(trie_node_t *node) {
+    if (node == NULL) return;
+    for (int i = 0; i < node->child_count; i++) trie_clear(node->children[i]);
+    mem_free(node->children);
+    mem_free(node->label);
+    mem_free(node);
+}
+
+static void trie_rebuild(cmdset_manager_t *manager) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    trie_clear(state->trie);
+    state->trie = NULL;
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active) trie_insert(state, manager->presets[i].name, i);
+    }
+}
+
+// Case-insensitive Levenshtein distance. Preset names are shorter than
+// MAX_NAME_LEN, so a single row over b is enough.
+static int edit_distance(const char *a, const char *b) {
+    int row[MAX_NAME_LEN + 1];
+    int b_len = (int)strlen(b);
+    if (b_len > MAX_NAME_LEN) b_len = MAX_NAME_LEN;
+    for (int j = 0; j <= b_len; j++) row[j] = j;
+    for (int i = 1; a[i - 1] != '\0'; i++) {
+        int diagonal = row[0];
+        row[0] = i;
+        for (int j = 1; j <= b_len; j++) {
+            int above = row[j];
+            int cost = tolower((unsigned char)a[i - 1]) == tolower((unsigned char)b[j - 1]) ? 0 : 1;
+            int best = diagonal + cost;
+            if (above + 1 < best) best = above + 1;
+            if (row[j - 1] + 1 < best) best = row[j - 1] + 1;
+            row[j] = best;
+            diagonal = above;
+        }
+    }
+    return row[b_len];
+}
+
+// Slots are only reused after presets_compact() rebuilds the tree, so it is
+// keyed by slot and removed presets simply stay in the tree as routing nodes.
+static void bk_insert(cmdset_manager_t *manager, int slot) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    state->bk_child[slot] = -1;
+    state->bk_sibling[slot] = -1;
+    state->bk_distance[slot] = 0;
+    if (state->bk_root < 0) {
+        state->bk_root = slot;
+        return;
+    }
+    int node = state->bk_root;
+    for (;;) {
+        int distance = edit_distance(manager->presets[slot].name, manager->presets[node].name);
+        int child = state->bk_child[node];
+        while (child >= 0 && state->bk_distance[child] != distance) child = state->bk_sibling[child];
+        if (child < 0) {
+            state->bk_distance[slot] = distance;
+            state->bk_sibling[slot] = state->bk_child[node];
+            state->bk_child[node] = slot;
+            return;
+        }
+        node = child;
+    }
+}
+
+static void bk_rebuild(cmdset_manager_t *manager) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    state->bk_root = -1;
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active) bk_insert(manager, i);
+    }
+}
+
+static void query_emit(query_parser_t *parser, int op, int64_t value) {
+    cmdset_query_t *query = parser->query;
+    if (parser->failed) return;
+    int effect = (op == QUERY_FIELD || op == QUERY_CONST || op == QUERY_NOW) ? 1 : (op == QUERY_NOT ? 0 : -1);
+    parser->depth += effect;
+    if (parser->depth > QUERY_MAX_STACK) {
+        strcpy(last_error_message, "Expression too deeply nested");
+        parser->failed = CMDSET_ERROR_INVALID;
+        return;
+    }
+    if (query->length == query->capacity) {
+        int capacity = query->capacity ? query->capacity * 2 : 16;
+        query_insn_t *code = realloc(query->code, capacity * sizeof(query_insn_t));
+        if (code == NULL) {
+            strcpy(last_error_message, "Memory allocation failed");
+            parser->failed = CMDSET_ERROR_MEMORY;
+            return;
+        }
+        query->code = code;
+        query->capacity = capacity;
+    }
+    query->code[query->length].op = op;
+    query->code[query->length].value = value;
+    query->length++;
+}
+
+static void query_fail(query_parser_t *parser, const char *message) {
+    if (parser->failed) return;
+    snprintf(last_error_message, sizeof(last_error_message), "%s at offset %d", message, (int)(parser->cursor - parser->input));
+    parser->failed = CMDSET_ERROR_INVALID;
+}
+
+static int query_accept(query_parser_t *parser, const char *token) {
+    while (isspace((unsigned char)*parser->cursor)) parser->cursor++;
+    size_t length = strlen(token);
+    if (strncmp(parser->cursor, token, length) != 0) return 0;
+    parser->cursor += length;
+    return 1;
+}
+
+// Numbers take an optional s/m/h/d/w suffix and are stored in seconds.
+static void query_parse_primary(query_parser_t *parser) {
+    if (parser->failed) return;
+    if (query_accept(parser, "(")) {
+        query_parse_or(parser);
+        if (!query_accept(parser, ")")) query_fail(parser, "Expected ')'");
+        return;
+    }
+    const char *start = parser->cursor;
+    if (isdigit((unsigned char)*start)) {
+        char *end;
+        errno = 0;
+        long long value = strtoll(start, &end, 10);
+        long long factor = 1;
+        switch (*end) {
+            case 's': end++; break;
+            case 'm': factor = 60; end++; break;
+            case 'h': factor = 3600; end++; break;
+            case 'd': factor = 86400; end++; break;
+            case 'w': factor = 7 * 86400; end++; break;
+        }
+        if (isalnum((unsigned char)*end) || *end == '_') {
+            query_fail(parser, "Invalid number");
+            return;
+        }
+        if (errno == ERANGE || value > INT64_MAX / factor) {
+            query_fail(parser, "Number out of range");
+            return;
+        }
+        value *= factor;
+        parser->cursor = end;
+        query_emit(parser, QUERY_CONST, value);
+        return;
+    }
+    const char *end = start;
+    while (isalnum((unsigned char)*end) || *end == '_') end++;
+    size_t length = end - start;
+    static const struct { const char *name; int field; } fields[] = {
+        {"use_count", QUERY_FIELD_USE_COUNT},
+        {"last_used", QUERY_FIELD_LAST_USED},
+        {"created_at", QUERY_FIELD_CREATED_AT},
+        {"encrypt", QUERY_FIELD_ENCRYPT}
+    };
+    if (length == 3 && strncmp(start, "now", 3) == 0) {
+        parser->cursor = end;
+        query_emit(parser, QUERY_NOW, 0);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (strlen(fields[i].name) == length && strncmp(start, fields[i].name, length) == 0) {
+            parser->cursor = end;
+            query_emit(parser, QUERY_FIELD, fields[i].field);
+            return;
+        }
+    }
+    query_fail(parser, length > 0 ? "Unknown field" : "Expected a field, number or '('");
+}
+
+static void query_parse_additive(query_parser_t *parser) {
+    query_parse_primary(parser);
+    while (!parser->failed) {
+        if (query_accept(parser, "+")) {
+            query_parse_primary(parser);
+            query_emit(parser, QUERY_ADD, 0);
+        } else if (query_accept(parser, "-")) {
+            query_parse_primary(parser);
+            query_emit(parser, QUERY_SUB, 0);
+        } else break;
+    }
+}
+
+static void query_parse_comparison(query_parser_t *parser) {
+    static const struct { const char *token; int op; } operators[] = {
+        {"<=", QUERY_LE}, {">=", QUERY_GE}, {"==", QUERY_EQ}, {"!=", QUERY_NE}, {"<", QUERY_LT}, {">", QUERY_GT}
+    };
+    query_parse_additive(parser);
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]) && !parser->failed; i++) {
+        if (query_accept(parser, operators[i].token)) {
+            query_parse_additive(parser);
+            query_emit(parser, operators[i].op, 0);
+            return;
+        }
+    }
+}
+
+static void query_parse_unary(query_parser_t *parser) {
+    if (parser->failed) return;
+    if (++parser->nesting > QUERY_MAX_STACK) query_fail(parser, "Expression too deeply nested");
+    else if (query_accept(parser, "!")) {
+        query_parse_unary(parser);
+        query_emit(parser, QUERY_NOT, 0);
+    } else query_parse_comparison(parser);
+    parser->nesting--;
+}
+
+static void query_parse_and(query_parser_t *parser) {
+    query_parse_unary(parser);
+    while (!parser->failed && query_accept(parser, "&&")) {
+        query_parse_unary(parser);
+        query_emit(parser, QUERY_AND, 0);
+    }
+}
+
+static void query_parse_or(query_parser_t *parser) {
+    query_parse_and(parser);
+    while (!parser->failed && query_accept(parser, "||")) {
+        query_parse_and(parser);
+        query_emit(parser, QUERY_OR, 0);
+    }
+}
+
+static int query_eval(const cmdset_query_t *query, const cmdset_preset_t *preset, int64_t now) {
+    int64_t stack[QUERY_MAX_STACK];
+    int top = -1;
+    for (const query_insn_t *insn = query->code, *end = query->code + query->length; insn < end; insn++) {
+        switch (insn->op) {
+            case QUERY_FIELD:
+                switch (insn->value) {
+                    case QUERY_FIELD_USE_COUNT: stack[++top] = __atomic_load_n(&preset->use_count, __ATOMIC_RELAXED); break;
+                    case QUERY_FIELD_LAST_USED: stack[++top] = __atomic_load_n(&preset->last_used, __ATOMIC_RELAXED); break;
+                    case QUERY_FIELD_CREATED_AT: stack[++top] = preset->created_at; break;
+                    default: stack[++top] = preset->encrypt; break;
+                }
+                break;
+            case QUERY_CONST: stack[++top] = insn->value; break;
+            case QUERY_NOW: stack[++top] = now; break;
+            case QUERY_ADD: top--; stack[top] += stack[top + 1]; break;
+            case QUERY_SUB: top--; stack[top] -= stack[top + 1]; break;
+            case QUERY_LT: top--; stack[top] = stack[top] < stack[top + 1]; break;
+            case QUERY_LE: top--; stack[top] = stack[top] <= stack[top + 1]; break;
+            case QUERY_GT: top--; stack[top] = stack[top] > stack[top + 1]; break;
+            case QUERY_GE: top--; stack[top] = stack[top] >= stack[top + 1]; break;
+            case QUERY_EQ: top--; stack[top] = stack[top] == stack[top + 1]; break;
+            case QUERY_NE: top--; stack[top] = stack[top] != stack[top + 1]; break;
+            case QUERY_NOT: stack[top] = !stack[top]; break;
+            case QUERY_AND: top--; stack[top] = stack[top] && stack[top + 1]; break;
+            case QUERY_OR: top--; stack[top] = stack[top] || stack[top + 1]; break;
+        }
+    }
+    return top == 0 && stack[0] != 0;
+}
+
+// Copies the active presets into a single allocation. The caller holds the
+// state lock, or the manager has no state and nobody else can see it. A
+// transaction previews its result by skipping the slots it removes and
+// appending the presets it adds, which carry no tags.
+static store_version_t* snapshot_build(cmdset_manager_t *manager, const char *skip, const cmdset_preset_t *extra, int extra_count) {
+    struct cmdset_state *state = manager->state;
+    int count = extra_count;
+    int tag_total = 0;
+    size_t text_len = 0;
+    for (int i = 0; i < manager->count; i++) {
+        if (!manager->presets[i].active || (skip != NULL && skip[i])) continue;
+        count++;
+        if (state == NULL) continue;
+        tag_total += state->slot_tags[i].count;
+        for (int t = 0; t < state->slot_tags[i].count; t++) text_len += strlen(state->tag_names[state->slot_tags[i].ids[t]]) + 1;
+    }
+    size_t size = sizeof(store_version_t) + (sizeof(cmdset_preset_t) + sizeof(sched_profile_t) + sizeof(cmdset_usage_t)) * count + sizeof(char *) * tag_total + sizeof(int) * (3 * count + 1) + text_len;
+    store_version_t *version = mem_malloc(size);
+    if (version == NULL) return NULL;
+    version->version = 0;
+    version->count = count;
+    version->presets = (cmdset_preset_t *)(version + 1);
+    version->profiles = (sched_profile_t *)(version->presets + count);
+    version->usage = (cmdset_usage_t *)(version->profiles + count);
+    version->usage_lock = NULL;
+    version->tags = (const char **)(version->usage + count);
+    version->by_name = (int *)(version->tags + tag_total);
+    version->tag_offsets = version->by_name + count;
+    version->limits = version->tag_offsets + count + 1;
+    version->retire_epoch = 0;
+    version->next_retired = NULL;
+    char *text = (char *)(version->limits + count);
+    int index = 0;
+    int tag = 0;
+    for (int i = 0; i < manager->count + extra_count; i++) {
+        if (i >= manager->count) copy_preset(&version->presets[index], &extra[i - manager->count]);
+        else if (!manager->presets[i].active || (skip != NULL && skip[i])) continue;
+        else copy_preset(&version->presets[index], &manager->presets[i]);
+        version->tag_offsets[index] = tag;
+        version->limits[index] = state != NULL && i < manager->count ? state->max_concurrency[i] : 0;
+        if (state != NULL && i < manager->count) version->profiles[index] = state->profiles[i];
+        else memset(&version->profiles[index], 0, sizeof(sched_profile_t));
+        if (state != NULL && i < manager->count) version->usage[index] = state->usage[i];
+        else memset(&version->usage[index], 0, sizeof(cmdset_usage_t));
+        for (int t = 0; state != NULL && i < manager->count && t < state->slot_tags[i].count; t++) {
+            const char *name = state->tag_names[state->slot_tags[i].ids[t]];
+            size_t length = strlen(name) + 1;
+            memcpy(text, name, length);
+            version->tags[tag++] = text;
+            text += length;
+        }
+        int position = index;
+        while (position > 0 && strcmp(version->presets[version->by_name[position - 1]].name, version->presets[index].name) > 0) {
+            version->by_name[position] = version->by_name[position - 1];
+            position--;
+        }
+        version->by_name[position] = index;
+        index++;
+    }
+    version->tag_offsets[count] = tag;
+    return version;
+}
+
+// Called with rank_lock held. The replaced version is retired at the current
+// epoch and freed once no reader that could have pinned it is left.
+static void snapshot_publish(cmdset_manager_t *manager) {
+    struct cmdset_state *state = manager->state;
+    store_version_t *version = snapshot_build(manager, NULL, NULL, 0);
+    if (version == NULL) return;
+    version->version = ++state->next_version;
+    version->usage_lock = &state->rank_lock;
+    store_version_t *old = __atomic_exchange_n(&state->current, version, __ATOMIC_SEQ_CST);
+    if (old != NULL) {
+        old->retire_epoch = __atomic_fetch_add(&state->epoch, 1, __ATOMIC_SEQ_CST);
+        old->next_retired = state->retired;
+        state->retired = old;
+    }
+    snapshot_reclaim(state, 0);
+}
+
+// Called with rank_lock held after an execution changed a preset's counters,
+// or its usage when usage is not NULL. The published version is updated in
+// place instead of being rebuilt.
+static void snapshot_touch(struct cmdset_state *state, const cmdset_preset_t *preset, const cmdset_usage_t *usage) {
+    store_version_t *version = state->current;
+    if (version == NULL) return;
+    cmdset_preset_t *copy = (cmdset_preset_t *)version_find(version, preset->name);
+    if (copy == NULL) return;
+    __atomic_store_n(&copy->last_used, __atomic_load_n(&preset->last_used, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&copy->use_count, __atomic_load_n(&preset->use_count, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    if (usage != NULL) version->usage[copy - version->presets] = *usage;
+}
+
+static void version_usage(const store_version_t *version, int index, cmdset_usage_t *usage) {
+    if (version->usage_lock != NULL) pthread_mutex_lock(version->usage_lock);
+    *usage = version->usage[index];
+    if (version->usage_lock != NULL) pthread_mutex_unlock(version->usage_lock);
+}
+
+static void snapshot_reclaim(struct cmdset_state *state, int all) {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; !all && i < SNAPSHOT_READERS; i++) {
+        uint64_t epoch = __atomic_load_n(&state->readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+    store_version_t **link = &state->retired;
+    while (*link != NULL) {
+        store_version_t *version = *link;
+        if (version->retire_epoch < oldest) {
+            *link = version->next_retired;
+            mem_free(version);
+        } else link = &version->next_retired;
+    }
+}
+
+// Claims a reader slot, announces the epoch and only then loads the current
+// version, so a writer scanning the slots either sees the announcement or has
+// already published something newer. Never blocks and sets no error.
+static cmdset_snapshot_t* snapshot_enter(struct cmdset_state *state) {
+    if (state == NULL) return NULL;
+    for (int i = 0; i < SNAPSHOT_READERS; i++) {
+        cmdset_snapshot_t *reader = &state->readers[i];
+        int idle = 0;
+        if (!__atomic_compare_exchange_n(&reader->busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+        __atomic_store_n(&reader->epoch, __atomic_load_n(&state->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        reader->version = __atomic_load_n(&state->current, __ATOMIC_SEQ_CST);
+        if (reader->version != NULL) return reader;
+        cmdset_snapshot_release(reader);
+        return NULL;
+    }
+    return NULL;
+}
+
+// Pins the published version. Without one (no state yet, or every reader
+// slot in use) a private copy is built under the shared lock instead.
+static const store_version_t* version_pin(cmdset_manager_t *manager, cmdset_snapshot_t **reader) {
+    *reader = snapshot_enter(manager->state);
+    if (*reader != NULL) return (*reader)->version;
+    // Executions update usage under rank_lock while the shared lock is held.
+    struct cmdset_state *state = state_lock(manager, 0);
+    if (state != NULL) pthread_mutex_lock(&state->rank_lock);
+    store_version_t *version = snapshot_build(manager, NULL, NULL, 0);
+    if (state != NULL) pthread_mutex_unlock(&state->rank_lock);
+    state_unlock(state);
+    return version;
+}
+
+static void version_unpin(cmdset_manager_t *manager, const store_version_t *version, cmdset_snapshot_t *reader) {
+    if (reader != NULL) {
+        cmdset_snapshot_release(reader);
+        return;
+    }
+    if (manager->state != NULL) active_allocator = &manager_ctx(manager)->allocator;
+    mem_free((void *)version);
+    active_allocator = NULL;
+}
+
+static const cmdset_preset_t* version_find(const store_version_t *version, const char *name) {
+    int low = 0;
+    int high = version->count - 1;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        const cmdset_preset_t *preset = &version->presets[version->by_name[middle]];
+        int order = strcmp(preset->name, name);
+        if (order == 0) return preset;
+        if (order < 0) low = middle + 1;
+        else high = middle - 1;
+    }
+    return NULL;
+}
+
+static json_object* version_to_json(const store_version_t *version, int exported) {
+    json_object *root = json_object_new_object();
+    json_object *presets_array = json_object_new_array();
+    if (root == NULL || presets_array == NULL) {
+        json_object_put(root);
+        json_object_put(presets_array);
+        strcpy(last_error_message, "Could not create JSON object");
+        return NULL;
+    }
+    json_object_object_add(root, "version", json_object_new_string("2.0"));
+    if (exported) json_object_object_add(root, "exported_at", json_object_new_int64(time(NULL)));
+    json_object_object_add(root, "presets", presets_array);
+    for (int i = 0; i < version->count; i++) {
+        const cmdset_preset_t *source = &version->presets[i];
+        json_object *preset = json_object_new_object();
+        if (preset == NULL) {
+            json_object_put(root);
+            strcpy(last_error_message, "Could not create preset object");
+            return NULL;
+        }
+        json_object_object_add(preset, "name", json_object_new_string(source->name));
+        json_object_object_add(preset, "command", json_object_new_string(source->command));
+        json_object_object_add(preset, "encrypt", json_object_new_boolean(source->encrypt));
+        json_object_object_add(preset, "created_at", json_object_new_int64(source->created_at));
+        json_object_object_add(preset, "last_used", json_object_new_int64(cmdset_preset_last_used(source)));
+        json_object_object_add(preset, "use_count", json_object_new_int(cmdset_preset_use_count(source)));
+        if (version->limits[i] > 0) json_object_object_add(preset, "max_concurrency", json_object_new_int(version->limits[i]));
+        if (version->profiles[i].flags != 0) {
+            char spec[SCHED_MAX_CPUS * 4];
+            sched_format(&version->profiles[i], spec, sizeof(spec));
+            json_object_object_add(preset, "sched", json_object_new_string(spec));
+        }
+        cmdset_usage_t usage_copy;
+        version_usage(version, i, &usage_copy);
+        const cmdset_usage_t *usage = &usage_copy;
+        json_object *usage_object = usage->runs > 0 ? json_object_new_object() : NULL;
+        if (usage_object != NULL) {
+            json_object_object_add(usage_object, "runs", json_object_new_int64(usage->runs));
+            json_object_object_add(usage_object, "wall", json_object_new_double(usage->wall_seconds));
+            json_object_object_add(usage_object, "user", json_object_new_double(usage->user_seconds));
+            json_object_object_add(usage_object, "system", json_object_new_double(usage->system_seconds));
+            json_object_object_add(usage_object, "last_wall", json_object_new_double(usage->last_wall_seconds));
+            json_object_object_add(usage_object, "max_rss_kb", json_object_new_int64(usage->max_rss_kb));
+            json_object_object_add(usage_object, "in_blocks", json_object_new_int64(usage->in_blocks));
+            json_object_object_add(usage_object, "out_blocks", json_object_new_int64(usage->out_blocks));
+            json_object_object_add(preset, "usage", usage_object);
+        }
+        if (version->tag_offsets[i + 1] > version->tag_offsets[i]) {
+            json_object *tags = json_object_new_array();
+            for (int t = version->tag_offsets[i]; tags != NULL && t < version->tag_offsets[i + 1]; t++) json_object_array_add(tags, json_object_new_string(version->tags[t]));
+            if (tags != NULL) json_object_object_add(preset, "tags", tags);
+        }
+        json_object_array_add(presets_array, preset);
+    }
+    if (exported) json_object_object_add(root, "count", json_object_new_int(version->count));
+    return root;
+}
+
+// Opens a fresh temporary file next to the store file with the given suffix.
+// Whatever is written to it replaces that file only in replace_close, so a
+// failed write, a crash or a concurrent writer never leaves a torn file.
+static FILE* replace_open(cmdset_manager_t *manager, const char *suffix, char *temporary, size_t size) {
+    char pattern[sizeof(default_ctx.store_path)];
+    snprintf(pattern, sizeof(pattern), "%s.XXXXXX", suffix);
+    store_path(manager, pattern, temporary, size);
+    int fd = temporary[0] == '\0' ? -1 : mkstemp(temporary);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (file == NULL) {
+        snprintf(last_error_message, sizeof(last_error_message), "Could not save presets to file: %s", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(temporary);
+        }
+    }
+    return file;
+}
+
+// Syncs the temporary file and renames it over its final path, which keeps
+// its mode; a new file is private. A failed write is discarded.
+static int replace_close(cmdset_manager_t *manager, const char *suffix, FILE *file, const char *temporary, int failed) {
+    char path[sizeof(default_ctx.store_path)];
+    store_path(manager, suffix, path, sizeof(path));
+    int fd = fileno(file);
+    struct stat original;
+    if (!failed && fflush(file) != 0) failed = 1;
+    if (!failed && stat(path, &original) == 0 && fchmod(fd, original.st_mode & 07777) != 0) failed = 1;
+    if (!failed && fsync(fd) != 0) failed = 1;
+    if (fclose(file) != 0) failed = 1;
+    if (failed || rename(temporary, path) != 0) {
+        snprintf(last_error_message, sizeof(last_error_message), "Could not save presets to file: %s", strerror(errno));
+        unlink(temporary);
+        return CMDSET_ERROR_FILE;
+    }
+    char directory[sizeof(default_ctx.store_path)];
+    strcpy(directory, path);
+    char *slash = strrchr(directory, '/');
+    if (slash == NULL) strcpy(directory, ".");
+    else slash[slash == directory] = '\0';
+    int directory_fd = open(directory, O_RDONLY);
+    if (directory_fd >= 0) {
+        fsync(directory_fd);
+        close(directory_fd);
+    }
+    return CMDSET_SUCCESS;
+}
+
+// Like store_read, records the file it wrote in state->store_stat. Renaming
+// keeps the inode, size and mtime, so this is what a stat of the store sees.
+static int store_write(cmdset_manager_t *manager, const char *json_string) {
+    char temporary[sizeof(default_ctx.store_path)];
+    FILE *file = replace_open(manager, "", temporary, sizeof(temporary));
+    if (file == NULL) return CMDSET_ERROR_FILE;
+    struct stat written;
+    int failed = fputs(json_string, file) == EOF || fflush(file) != 0 || fstat(fileno(file), &written) != 0;
+    int result = replace_close(manager, "", file, temporary, failed);
+    if (result == CMDSET_SUCCESS && manager->state != NULL) manager->state->store_stat = written;
+    return result;
+}
+
+static txn_op_t* txn_push(cmdset_txn_t *txn) {
+    if (txn->count == txn->capacity) {
+        int capacity = txn->capacity == 0 ? 16 : txn->capacity * 2;
+        active_allocator = &manager_ctx(txn->manager)->allocator;
+        txn_op_t *ops = mem_realloc(txn->ops, sizeof(txn_op_t) * capacity);
+        active_allocator = NULL;
+        if (ops == NULL) {
+            strcpy(last_error_message, "Memory allocation failed");
+            txn_fail(txn, CMDSET_ERROR_MEMORY);
+            return NULL;
+        }
+        txn->ops = ops;
+        txn->capacity = capacity;
+    }
+    return &txn->ops[txn->count++];
+}
+
+static int txn_fail(cmdset_txn_t *txn, int error) {
+    if (txn->error == CMDSET_SUCCESS) {
+        txn->error = error;
+        strcpy(txn->message, last_error_message);
+    }
+    return error;
+}
+
+static void dirty_mark(struct cmdset_state *state) {
+    if (state == NULL) return;
+    pthread_mutex_lock(&state->flush_lock);
+    if (state->pending == 0) clock_gettime(CLOCK_MONOTONIC, &state->dirty_since);
+    if (state->pending < INT_MAX) state->pending++;
+    if (state->flusher_running && (state->pending == 1 || state->pending >= state->flush_threshold)) pthread_cond_signal(&state->flush_cond);
+    pthread_mutex_unlock(&state->flush_lock);
+}
+
+// Called once the store file matches the manager again.
+static void unsaved_clear(struct cmdset_state *state) {
+    if (state == NULL) return;
+    memset(state->unsaved, 0, sizeof(state->unsaved));
+    state->removed_count = 0;
+}
+
+static int removed_contains(const struct cmdset_state *state, const char *name) {
+    if (state == NULL) return 0;
+    for (int i = 0; i < state->removed_count; i++) {
+        if (strcmp(state->removed[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+static void removed_add(struct cmdset_state *state, const char *name) {
+    if (state == NULL || removed_contains(state, name)) return;
+    if (state->removed_count == state->removed_capacity) {
+        int capacity = state->removed_capacity > 0 ? state->removed_capacity * 2 : 16;
+        char (*removed)[MAX_NAME_LEN] = mem_realloc(state->removed, sizeof(*removed) * capacity);
+        if (removed == NULL) return;
+        state->removed = removed;
+        state->removed_capacity = capacity;
+    }
+    strcpy(state->removed[state->removed_count++], name);
+}
+
+// Forgets count changes, or all of them when count is negative. A save
+// clears only what was pending when it started; later changes stay dirty.
+static void dirty_clear(struct cmdset_state *state, int count) {
+    if (state == NULL) return;
+    pthread_mutex_lock(&state->flush_lock);
+    if (count < 0 || count > state->pending) count = state->pending;
+    state->pending -= count;
+    state->flush_failures = 0;
+    if (state->pending > 0) clock_gettime(CLOCK_MONOTONIC, &state->dirty_since);
+    pthread_mutex_unlock(&state->flush_lock);
+}
+
+static int dirty_count(struct cmdset_state *state) {
+    if (state == NULL) return 0;
+    pthread_mutex_lock(&state->flush_lock);
+    int pending = state->pending;
+    pthread_mutex_unlock(&state->flush_lock);
+    return pending;
+}
+
+static void timespec_add_ms(struct timespec *time, long ms) {
+    time->tv_sec += ms / 1000;
+    time->tv_nsec += (ms % 1000) * 1000000L;
+    if (time->tv_nsec >= 1000000000L) {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000L;
+    }
+}
+
+static void* flusher_main(void *argument) {
+    cmdset_manager_t *manager = argument;
+    struct cmdset_state *state = manager->state;
+    pthread_mutex_lock(&state->flush_lock);
+    while (!state->flusher_stop) {
+        if (state->pending == 0) {
+            pthread_cond_wait(&state->flush_cond, &state->flush_lock);
+            continue;
+        }
+        // After a failed save only the backoff decides, whatever is pending.
+        struct timespec deadline = state->dirty_since;
+        if (state->flush_failures > 0) deadline = state->flush_retry;
+        else timespec_add_ms(&deadline, state->flush_delay_ms);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int due = now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+        if (!due && (state->flush_failures > 0 || state->pending < state->flush_threshold)) {
+            pthread_cond_timedwait(&state->flush_cond, &state->flush_lock, &deadline);
+            continue;
+        }
+        pthread_mutex_unlock(&state->flush_lock);
+        int result = cmdset_flush(manager);
+        pthread_mutex_lock(&state->flush_lock);
+        if (result == CMDSET_SUCCESS) state->flush_failures = 0;
+        else {
+            // Back off from the flush delay, doubling up to a minute.
+            long backoff = state->flush_delay_ms > FLUSH_MIN_BACKOFF_MS ? state->flush_delay_ms : FLUSH_MIN_BACKOFF_MS;
+            for (int i = 0; i < state->flush_failures && backoff < FLUSH_MAX_BACKOFF_MS; i++) backoff *= 2;
+            if (backoff > FLUSH_MAX_BACKOFF_MS) backoff = FLUSH_MAX_BACKOFF_MS;
+            if (state->flush_failures < INT_MAX) state->flush_failures++;
+            clock_gettime(CLOCK_MONOTONIC, &state->flush_retry);
+            timespec_add_ms(&state->flush_retry, backoff);
+        }
+    }
+    pthread_mutex_unlock(&state->flush_lock);
+    return NULL;
+}
+
+// Stops the write-behind thread, if any, and saves what it left pending.
+static void flusher_stop(cmdset_manager_t *manager) {
+    struct cmdset_state *state = manager->state;
+    if (state == NULL || !state->flusher_running) return;
+    pthread_mutex_lock(&state->flush_lock);
+    state->flusher_stop = 1;
+    pthread_cond_signal(&state->flush_cond);
+    pthread_mutex_unlock(&state->flush_lock);
+    pthread_join(state->flusher, NULL);
+    pthread_mutex_lock(&state->flush_lock);
+    state->flusher_running = 0;
+    pthread_mutex_unlock(&state->flush_lock);
+    cmdset_flush(manager);
+}
+
+// Reads the whole store file and records which file it was in
+// state->store_stat. Returns CMDSET_ERROR_NOT_FOUND when there is no store
+// yet.
+static int store_read(cmdset_manager_t *manager, char **content, size_t *length) {
+    char path[sizeof(default_ctx.store_path)];
+    store_path(manager, "", path, sizeof(path));
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        snprintf(last_error_message, sizeof(last_error_message), "Could not open presets file: %s", strerror(errno));
+        return errno == ENOENT ? CMDSET_ERROR_NOT_FOUND : CMDSET_ERROR_FILE;
+    }
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    *content = file_size >= 0 ? mem_malloc(file_size + 1) : NULL;
+    if (*content == NULL) {
+        fclose(file);
+        strcpy(last_error_message, "Memory allocation failed");
+        return CMDSET_ERROR_MEMORY;
+    }
+    *length = fread(*content, 1, file_size, file);
+    (*content)[*length] = '\0';
+    if (manager->state != NULL) fstat(fileno(file), &manager->state->store_stat);
+    fclose(file);
+    return CMDSET_SUCCESS;
+}
+
+static void preset_from_json(json_object *object, cmdset_preset_t *preset) {
+    preset->active = 1;
+    json_object *name_item;
+    if (json_object_object_get_ex(object, "name", &name_item) && 
+        json_object_is_type(name_item, json_type_string)) {
+        const char *name_str = json_object_get_string(name_item);
+        strncpy(preset->name, name_str, MAX_NAME_LEN - 1);
+        preset->name[MAX_NAME_LEN - 1] = '\0';
+    }
+    json_object *command_item;
+    if (json_object_object_get_ex(object, "command", &command_item) && 
+        json_object_is_type(command_item, json_type_string)) {
+        const char *command_str = json_object_get_string(command_item);
+        strncpy(preset->command, command_str, MAX_COMMAND_LEN - 1);
+        preset->command[MAX_COMMAND_LEN - 1] = '\0';
+    }
+    json_object *encrypt_item;
+    if (json_object_object_get_ex(object, "encrypt", &encrypt_item)) {
+        preset->encrypt = json_object_get_boolean(encrypt_item) ? 1 : 0;
+    } else preset->encrypt = 0;
+    json_object *created_item;
+    if (json_object_object_get_ex(object, "created_at", &created_item) && 
+        json_object_is_type(created_item, json_type_int)) {
+        preset->created_at = (time_t)json_object_get_int64(created_item);
+    } else preset->created_at = time(NULL);
+    json_object *last_used_item;
+    if (json_object_object_get_ex(object, "last_used", &last_used_item) && 
+        json_object_is_type(last_used_item, json_type_int)) {
+        preset->last_used = (time_t)json_object_get_int64(last_used_item);
+    } else preset->last_used = 0;
+    json_object *use_count_item;
+    if (json_object_object_get_ex(object, "use_count", &use_count_item) && 
+        json_object_is_type(use_count_item, json_type_int)) {
+        preset->use_count = json_object_get_int(use_count_item);
+    } else preset->use_count = 0;
+}
+
+// Makes the tags of slot match the "tags" array of a stored preset.
+static void tags_sync(cmdset_manager_t *manager, int slot, json_object *preset) {
+    struct cmdset_state *state = get_state(manager);
+    if (state == NULL) return;
+    json_object *tags = NULL;
+    if (!json_object_object_get_ex(preset, "tags", &tags) || !json_object_is_type(tags, json_type_array)) tags = NULL;
+    int tag_count = tags != NULL ? (int)json_object_array_length(tags) : 0;
+    for (int i = state->slot_tags[slot].count - 1; i >= 0; i--) {
+        const char *name = state->tag_names[state->slot_tags[slot].ids[i]];
+        int keep = 0;
+        for (int j = 0; j < tag_count && !keep; j++) {
+            json_object *tag = json_object_array_get_idx(tags, j);
+            keep = tag != NULL && json_object_is_type(tag, json_type_string) && strcmp(json_object_get_string(tag), name) == 0;
+        }
+        if (!keep) tag_detach(manager, slot, name);
+    }
+    tags_from_json(manager, slot, preset);
+}
+
+// Brings the manager in line with the store file by touching only what
+// differs: new presets are inserted, changed commands re-indexed, missing
+// presets removed and tags synced. Changes made here but not saved yet win
+// over the file: presets added here are kept, presets removed here are not
+// brought back, and tags, limits and scheduling profiles changed here keep
+// their local values. Usage statistics keep whichever side is ahead. A file identical to the last one loaded or saved
+// is skipped.
+static int store_merge_unlocked(cmdset_manager_t *manager) {
+    struct cmdset_state *state = get_state(manager);
+    char *content;
+    size_t content_len;
+    int result = store_read(manager, &content, &content_len);
+    if (result == CMDSET_ERROR_NOT_FOUND) return CMDSET_SUCCESS;
+    if (result != CMDSET_SUCCESS) return result;
+    uint64_t store_hash = hash_content(content, content_len);
+    if (state != NULL && state->store_hash == store_hash) {
+        mem_free(content);
+        return CMDSET_SUCCESS;
+    }
+    json_object *root = json_tokener_parse(content);
+    mem_free(content);
+    if (root == NULL) {
+        strcpy(last_error_message, "Could not parse JSON file");
+        return CMDSET_ERROR_JSON;
+    }
+    json_object *presets_array;
+    if (!json_object_object_get_ex(root, "presets", &presets_array) || !json_object_is_type(presets_array, json_type_array)) presets_array = NULL;
+    int array_size = presets_array != NULL ? (int)json_object_array_length(presets_array) : 0;
+    // Work out what survives first, so a file that cannot fit is rejected
+    // before anything changes and is merged again on the next refresh.
+    char seen[MAX_PRESETS] = {0};
+    int incoming = 0;
+    for (int i = 0; i < array_size; i++) {
+        json_object *name_item;
+        json_object *object = json_object_array_get_idx(presets_array, i);
+        if (object == NULL || !json_object_object_get_ex(object, "name", &name_item) || !json_object_is_type(name_item, json_type_string)) continue;
+        const char *name = json_object_get_string(name_item);
+        if (name[0] == '\0') continue;
+        int slot = find_slot(manager, name);
+        if (slot >= 0) seen[slot] = 1;
+        else if (!removed_contains(state, name)) incoming++;
+    }
+    int kept = 0;
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active && (seen[i] || (state != NULL && (state->unsaved[i] & UNSAVED_ADDED)))) kept++;
+    }
+    if (kept + incoming > MAX_PRESETS) {
+        json_object_put(root);
+        strcpy(last_error_message, "Store file has more presets than fit");
+        return CMDSET_ERROR_MEMORY;
+    }
+    for (int i = 0; i < manager->count; i++) {
+        if (manager->presets[i].active && !seen[i] && (state == NULL || !(state->unsaved[i] & UNSAVED_ADDED))) remove_preset_unlocked(manager, manager->presets[i].name);
+    }
+    if (manager->count + incoming > MAX_PRESETS) presets_compact(manager);
+    for (int i = 0; i < array_size; i++) {
+        json_object *object = json_object_array_get_idx(presets_array, i);
+        if (object == NULL) continue;
+        cmdset_preset_t incoming_preset;
+        memset(&incoming_preset, 0, sizeof(incoming_preset));
+        preset_from_json(object, &incoming_preset);
+        if (incoming_preset.name[0] == '\0') continue;
+        int slot = find_slot(manager, incoming_preset.name);
+        if (slot < 0 && removed_contains(state, incoming_preset.name)) continue;
+        int local = slot >= 0 && state != NULL ? state->unsaved[slot] : 0;
+        if (slot < 0) {
+            if (manager->count >= MAX_PRESETS) presets_compact(manager);
+            preset_insert(manager, incoming_preset.name, incoming_preset.command, incoming_preset.encrypt, incoming_preset.created_at);
+            slot = manager->count - 1;
+            if (state != NULL) state->unsaved[slot] = 0;
+        } else if (!(local & UNSAVED_ADDED) && (strcmp(manager->presets[slot].command, incoming_preset.command) != 0 || manager->presets[slot].encrypt != incoming_preset.encrypt)) {
+            index_remove(manager, slot);
+            strcpy(manager->presets[slot].command, incoming_preset.command);
+            manager->presets[slot].encrypt = incoming_preset.encrypt;
+            index_add(manager, slot);
+        }
+        cmdset_preset_t *preset = &manager->presets[slot];
+        if (incoming_preset.use_count > preset->use_count || incoming_preset.last_used > preset->last_used) {
+            if (incoming_preset.use_count > preset->use_count) preset->use_count = incoming_preset.use_count;
+            if (incoming_preset.last_used > preset->last_used) preset->last_used = incoming_preset.last_used;
+            rank_remove(manager, slot);
+            rank_insert(manager, slot);
+        }
+        if (!(local & (UNSAVED_ADDED | UNSAVED_TAGS))) tags_sync(manager, slot, object);
+        if (!(local & (UNSAVED_ADDED | UNSAVED_LIMIT))) limit_from_json(manager, slot, object);
+        if (!(local & (UNSAVED_ADDED | UNSAVED_SCHED))) sched_from_json(manager, slot, object);
+        usage_from_json(manager, slot, object, 1);
+    }
+    json_object_put(root);
+    if (state != NULL) state->store_hash = store_hash;
+    return CMDSET_SUCCESS;
+}
+
+#ifdef __linux__
+static void* watcher_main(void *argument) {
+    cmdset_manager_t *manager = argument;
+    struct cmdset_state *state = manager->state;
+    char path[sizeof(default_ctx.store_path)];
+    store_path(manager, "", path, sizeof(path));
+    const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    union {
+        struct inotify_event event;
+        char bytes[4096];
+    } buffer;
+    struct pollfd fds[2] = {{state->watch_fd, POLLIN, 0}, {state->watch_pipe[0], POLLIN, 0}};
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents != 0) break;
+        ssize_t length = read(state->watch_fd, buffer.bytes, sizeof(buffer.bytes));
+        if (length <= 0) continue;
+        int changed = 0;
+        for (ssize_t offset = 0; offset < length; ) {
+            const struct inotify_event *event = (const struct inotify_event *)(buffer.bytes + offset);
+            if (event->len > 0 && strcmp(event->name, name) == 0) changed = 1;
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+        if (changed) cmdset_refresh(manager);
+    }
+    return NULL;
+}
+#endif
+
+static void watcher_stop(cmdset_manager_t *manager) {
+    struct cmdset_state *state = manager->state;
+    if (state == NULL || !state->watcher_running) return;
+    char stop = 0;
+    ssize_t written = write(state->watch_pipe[1], &stop, 1);
+    (void)written;
+    pthread_join(state->watcher, NULL);
+    close(state->watch_fd);
+    close(state->watch_pipe[0]);
+    close(state->watch_pipe[1]);
+    state->watcher_running = 0;
+}
+
+// Takes one of limit slot files kept next to the store and returns its
+// descriptor. The flock goes away with the descriptor, so a run that dies
+// never leaks its slot, and O_CLOEXEC keeps it out of the command so that
+// daemons it leaves behind do not hold the slot either.
+static int concurrency_acquire(cmdset_manager_t *manager, const char *name, int limit, int wait) {
+    char directory[sizeof(default_ctx.store_path) + 8];
+    store_path(manager, ".locks", directory, sizeof(directory));
+    if (directory[0] == '\0' || (mkdir(directory, 0700) != 0 && errno != EEXIST)) {
+        snprintf(last_error_message, sizeof(last_error_message), "Could not create lock directory: %s", strerror(errno));
+        return CMDSET_ERROR_FILE;
+    }
+    unsigned long long key = hash_content(name, strlen(name));
+    char path[sizeof(directory) + 32];
+    long delay_ms = 10;
+    for (;;) {
+        for (int i = 0; i < limit; i++) {
+            snprintf(path, sizeof(path), "%s/%016llx.%d", directory, key, i);
+            int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            if (fd < 0) {
+                snprintf(last_error_message, sizeof(last_error_message), "Could not open slot file: %s", strerror(errno));
+                return CMDSET_ERROR_FILE;
+            }
+            if (flock(fd, LOCK_EX | LOCK_NB) == 0) return fd;
+            close(fd);
+        }
+        if (!wait) {
+            strcpy(last_error_message, "Concurrency limit reached");
+            return CMDSET_ERROR_BUSY;
+        }
+        struct timespec pause = {0, delay_ms * 1000000L};
+        nanosleep(&pause, NULL);
+        if (delay_ms < 160) delay_ms *= 2;
+    }
+}
+
+static int sched_parse_setting(char *word, sched_profile_t *profile) {
+    char *value = strchr(word, '=');
+    if (value == NULL) return strcmp(word, "default") == 0 ? 0 : -1;
+    *value++ = '\0';
+    char *end;
+    if (strcmp(word, "nice") == 0) {
+        long nice = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || nice < -20 || nice > 19) return -1;
+        profile->nice = (int)nice;
+        profile->flags |= PROFILE_NICE;
+        return 0;
     }
-    json_object *presets_array;
-    if (!json_object_object_get_ex(root, "presets", &presets_array) || 
-        !json_object_is_type(presets_array, json_type_array)) {
-        json_object_put(root);
-        strcpy(last_error_message, "Invalid preset file format - missing presets array");
-        return CMDSET_ERROR_JSON;
+#ifdef __linux__
+    if (strcmp(word, "io") == 0) {
+        char *level = strchr(value, ':');
+        if (level != NULL) *level++ = '\0';
+        if (strcmp(value, "realtime") == 0 || strcmp(value, "rt") == 0) profile->io_class = 1;
+        else if (strcmp(value, "best-effort") == 0 || strcmp(value, "be") == 0) profile->io_class = 2;
+        else if (strcmp(value, "idle") == 0 && level == NULL) profile->io_class = 3;
+        else return -1;
+        profile->io_level = profile->io_class == 3 ? 0 : 4;
+        if (level != NULL) {
+            long number = strtol(level, &end, 10);
+            if (end == level || *end != '\0' || number < 0 || number > 7) return -1;
+            profile->io_level = (int)number;
+        }
+        profile->flags |= PROFILE_IO;
+        return 0;
     }
-    int array_size = json_object_array_length(presets_array);
-    for (int i = 0; i < array_size && manager->count < MAX_PRESETS; i++) {
-        json_object *preset = json_object_array_get_idx(presets_array, i);
-        if (preset != NULL) {
-            json_object *name_item;
-            if (!json_object_object_get_ex(preset, "name", &name_item) || 
-                !json_object_is_type(name_item, json_type_string)) {
-                continue;
-            }
-            const char *name_str = json_object_get_string(name_item);
-            int exists = 0;
-            for (int j = 0; j < manager->count; j++) {
-                if (manager->presets[j].active && strcmp(manager->presets[j].name, name_str) == 0) {
-                    exists = 1;
-                    break;
-                }
+    if (strcmp(word, "cpus") == 0) {
+        memset(profile->cpus, 0, sizeof(profile->cpus));
+        for (char *range = value; ; range = end + 1) {
+            long first = strtol(range, &end, 10);
+            if (end == range || first < 0 || first >= SCHED_MAX_CPUS) return -1;
+            long last = first;
+            if (*end == '-') {
+                range = end + 1;
+                last = strtol(range, &end, 10);
+                if (end == range || last < first || last >= SCHED_MAX_CPUS) return -1;
             }
-            if (exists) continue;
-            manager->presets[manager->count].active = 1;
-            strncpy(manager->presets[manager->count].name, name_str, MAX_NAME_LEN - 1);
-            manager->presets[manager->count].name[MAX_NAME_LEN - 1] = '\0';
-            json_object *command_item;
-            if (json_object_object_get_ex(preset, "command", &command_item) && 
-                json_object_is_type(command_item, json_type_string)) {
-                const char *command_str = json_object_get_string(command_item);
-                strncpy(manager->presets[manager->count].command, command_str, MAX_COMMAND_LEN - 1);
-                manager->presets[manager->count].command[MAX_COMMAND_LEN - 1] = '\0';
-            } else continue;
-            json_object *encrypt_item;
-            if (json_object_object_get_ex(preset, "encrypt", &encrypt_item)) manager->presets[manager->count].encrypt = json_object_get_boolean(encrypt_item) ? 1 : 0;
-            else manager->presets[manager->count].encrypt = 0;
-            json_object *created_item;
-            if (json_object_object_get_ex(preset, "created_at", &created_item) && 
-                json_object_is_type(created_item, json_type_int)) {
-                manager->presets[manager->count].created_at = (time_t)json_object_get_int64(created_item);
-            } else manager->presets[manager->count].created_at = time(NULL);
-            json_object *last_used_item;
-            if (json_object_object_get_ex(preset, "last_used", &last_used_item) && 
-                json_object_is_type(last_used_item, json_type_int)) {
-                manager->presets[manager->count].last_used = (time_t)json_object_get_int64(last_used_item);
-            } else manager->presets[manager->count].last_used = 0;
-            json_object *use_count_item;
-            if (json_object_object_get_ex(preset, "use_count", &use_count_item) && 
-                json_object_is_type(use_count_item, json_type_int)) {
-                manager->presets[manager->count].use_count = json_object_get_int(use_count_item);
-            } else manager->presets[manager->count].use_count = 0;
-            manager->count++;
+            for (long cpu = first; cpu <= last; cpu++) profile->cpus[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+            if (*end == '\0') break;
+            if (*end != ',') return -1;
         }
+        profile->flags |= PROFILE_CPUS;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+// Parses "cpus=0-3,6 nice=10 io=best-effort:7"; each setting is optional and
+// an empty spec or "default" leaves scheduling alone. CPU sets and IO
+// priorities are Linux-only.
+static int sched_parse(const char *spec, sched_profile_t *profile) {
+    memset(profile, 0, sizeof(*profile));
+    for (const char *cursor = spec; cursor != NULL && *cursor != '\0'; ) {
+        while (isspace((unsigned char)*cursor)) cursor++;
+        const char *end = cursor;
+        while (*end != '\0' && !isspace((unsigned char)*end)) end++;
+        char word[SCHED_MAX_CPUS * 4];
+        size_t length = end - cursor;
+        if (length == 0) break;
+        if (length < sizeof(word)) {
+            memcpy(word, cursor, length);
+            word[length] = '\0';
+        }
+        if (length >= sizeof(word) || sched_parse_setting(word, profile) != 0) {
+            snprintf(last_error_message, sizeof(last_error_message), "Invalid scheduling setting '%.*s'", 64, cursor);
+            return CMDSET_ERROR_INVALID;
+        }
+        cursor = end;
     }
-    json_object_put(root);
     return CMDSET_SUCCESS;
 }
 
-int cmdset_encrypt_command(const char *plaintext, char *encrypted) {
-    return encrypt_command_internal(plaintext, encrypted, NULL);
+static int sched_format(const sched_profile_t *profile, char *spec, int max_len) {
+    static const char *io_classes[] = {"none", "realtime", "best-effort", "idle"};
+    int offset = 0;
+    int truncated = 0;
+    spec[0] = '\0';
+    if (profile->flags & PROFILE_CPUS) {
+        append_output(spec, max_len, &offset, &truncated, "cpus=");
+        const char *separator = "";
+        for (int cpu = 0; cpu < SCHED_MAX_CPUS; cpu++) {
+            if (!(profile->cpus[cpu / 64] >> (cpu % 64) & 1)) continue;
+            int last = cpu;
+            while (last + 1 < SCHED_MAX_CPUS && (profile->cpus[(last + 1) / 64] >> ((last + 1) % 64) & 1)) last++;
+            if (last > cpu) append_output(spec, max_len, &offset, &truncated, "%s%d-%d", separator, cpu, last);
+            else append_output(spec, max_len, &offset, &truncated, "%s%d", separator, cpu);
+            separator = ",";
+            cpu = last;
+        }
+    }
+    if (profile->flags & PROFILE_NICE) append_output(spec, max_len, &offset, &truncated, "%snice=%d", offset > 0 ? " " : "", profile->nice);
+    if (profile->flags & PROFILE_IO) {
+        append_output(spec, max_len, &offset, &truncated, "%sio=%s", offset > 0 ? " " : "", io_classes[profile->io_class]);
+        if (profile->io_class != 3) append_output(spec, max_len, &offset, &truncated, ":%d", profile->io_level);
+    }
+    if (truncated) {
+        strcpy(last_error_message, "Output buffer too small");
+        return CMDSET_ERROR_TRUNCATED;
+    }
+    return CMDSET_SUCCESS;
 }
 
-int cmdset_decrypt_command(const char *encrypted, char *plaintext) {
-    return decrypt_command_internal(encrypted, plaintext, NULL);
+// Runs in the forked child, so only async-signal-safe calls are allowed.
+static int sched_apply(const sched_profile_t *profile) {
+#ifdef __linux__
+    if (profile->flags & PROFILE_CPUS) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < SCHED_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+            if (profile->cpus[cpu / 64] >> (cpu % 64) & 1) CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) return -1;
+    }
+    if ((profile->flags & PROFILE_IO) && syscall(SYS_ioprio_set, 1, 0, profile->io_class << 13 | profile->io_level) != 0) return -1;
+#endif
+    if ((profile->flags & PROFILE_NICE) && setpriority(PRIO_PROCESS, 0, profile->nice) != 0) return -1;
+    return 0;
 }
 
-void cmdset_cleanup(cmdset_manager_t *manager) {
-    if (manager != NULL) memset(manager, 0, sizeof(cmdset_manager_t));
-    clear_session();
+static void usage_add(cmdset_usage_t *total, const cmdset_usage_t *run) {
+    total->runs += run->runs;
+    total->wall_seconds += run->wall_seconds;
+    total->user_seconds += run->user_seconds;
+    total->system_seconds += run->system_seconds;
+    total->last_wall_seconds = run->last_wall_seconds;
+    if (run->max_rss_kb > total->max_rss_kb) total->max_rss_kb = run->max_rss_kb;
+    total->in_blocks += run->in_blocks;
+    total->out_blocks += run->out_blocks;
 }
 
-int cmdset_get_preset_count(cmdset_manager_t *manager) {
-    if (manager == NULL) return 0;
-    int count = 0;
-    for (int i = 0; i < manager->count; i++) {
-        if (manager->presets[i].active) count++;
+static pthread_mutex_t run_signals_lock = PTHREAD_MUTEX_INITIALIZER;
+static int run_signals_users = 0;
+static struct sigaction run_saved_int;
+static struct sigaction run_saved_quit;
+
+// Ignores SIGINT and SIGQUIT and blocks SIGCHLD in the calling thread, as
+// system() does while a command runs. The dispositions are shared by every
+// thread, so holders are counted and the last one restores them.
+static void signals_hold(sigset_t *saved_mask, struct sigaction *child_int, struct sigaction *child_quit) {
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    pthread_mutex_lock(&run_signals_lock);
+    if (run_signals_users++ == 0) {
+        sigaction(SIGINT, &ignore, &run_saved_int);
+        sigaction(SIGQUIT, &ignore, &run_saved_quit);
     }
-    return count;
+    *child_int = run_saved_int;
+    *child_quit = run_saved_quit;
+    pthread_mutex_unlock(&run_signals_lock);
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &blocked, saved_mask);
 }
 
-int cmdset_get_preset_by_index(cmdset_manager_t *manager, int index, cmdset_preset_t *preset) {
-    if (manager == NULL || preset == NULL) {
-        strcpy(last_error_message, "Invalid parameters");
-        return CMDSET_ERROR_INVALID;
+static void signals_release(const sigset_t *saved_mask) {
+    pthread_sigmask(SIG_SETMASK, saved_mask, NULL);
+    pthread_mutex_lock(&run_signals_lock);
+    if (--run_signals_users == 0) {
+        sigaction(SIGINT, &run_saved_int, NULL);
+        sigaction(SIGQUIT, &run_saved_quit, NULL);
     }
-    int current_index = 0;
-    for (int i = 0; i < manager->count; i++) {
-        if (manager->presets[i].active) {
-            if (current_index == index) {
-                *preset = manager->presets[i];
-                return CMDSET_SUCCESS;
-            }
-            current_index++;
-        }
+    pthread_mutex_unlock(&run_signals_lock);
+}
+
+// Forks /bin/sh -c command. The child puts back whatever signal state it is
+// given and applies the profile; if that fails it exits with status 126.
+static pid_t command_spawn(const char *command, const sched_profile_t *profile, const struct sigaction *child_int, const struct sigaction *child_quit, const sigset_t *child_mask) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    if (child_int != NULL) sigaction(SIGINT, child_int, NULL);
+    if (child_quit != NULL) sigaction(SIGQUIT, child_quit, NULL);
+    if (child_mask != NULL) sigprocmask(SIG_SETMASK, child_mask, NULL);
+    if (sched_apply(profile) != 0) {
+        static const char message[] = "cmdset: could not apply the scheduling profile\n";
+        ssize_t written = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)written;
+        _exit(126);
     }
-    strcpy(last_error_message, "Index out of range");
-    return CMDSET_ERROR_NOT_FOUND;
+    execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    _exit(127);
 }
 
 static int derive_key(const char *password, const unsigned char *salt, unsigned char *key) {
@@ -547,6 +5146,29 @@ static int derive_key(const char *password, const unsigned char *salt, unsigned
     return 0;
 }
 
+// Keys derived from the context's active session password are cached by salt,
+// so re-running an encrypted preset skips PBKDF2. clear_session drops them.
+static int derive_key_cached(cmdset_ctx_t *context, const char *password, const unsigned char *salt, unsigned char *key) {
+    int cacheable = is_session_valid(context) && strcmp(password, context->session_password) == 0;
+    if (cacheable) {
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            if (context->key_cache[i].used && memcmp(context->key_cache[i].salt, salt, SALT_LEN) == 0) {
+                memcpy(key, context->key_cache[i].key, KEY_LEN);
+                return 0;
+            }
+        }
+    }
+    if (derive_key(password, salt, key) != 0) return 1;
+    if (cacheable) {
+        key_cache_entry_t *entry = &context->key_cache[context->key_cache_next];
+        memcpy(entry->salt, salt, SALT_LEN);
+        memcpy(entry->key, key, KEY_LEN);
+        entry->used = 1;
+        context->key_cache_next = (context->key_cache_next + 1) % KEY_CACHE_SIZE;
+    }
+    return 0;
+}
+
 static int get_master_password(char *password, int max_len) {
     printf("Enter master password for encryption: ");
     fflush(stdout);
@@ -576,32 +5198,47 @@ static int get_master_password(char *password, int max_len) {
         return 0;
 }
 
-static int get_session_password(char *password, int max_len, const char *preset_name) {
-    if (strlen(session_file) == 0) {
+static void session_path(cmdset_ctx_t *context) {
+    if (context->persist_session && strlen(context->session_file) == 0) {
         const char *home = getenv("HOME");
-        if (home != NULL) snprintf(session_file, sizeof(session_file), "%s/.cmdset_session", home);
-        else strcpy(session_file, "/tmp/.cmdset_session");
+        if (home != NULL) snprintf(context->session_file, sizeof(context->session_file), "%s/.cmdset_session", home);
+        else strcpy(context->session_file, "/tmp/.cmdset_session");
+    }
+}
+
+// Deletes the password session persisted for the context, if it keeps one.
+static void session_remove(cmdset_ctx_t *context) {
+    session_path(context);
+    if (context->persist_session && context->session_file[0] != '\0') unlink(context->session_file);
+}
+
+static int get_session_password(cmdset_ctx_t *context, char *password, int max_len, const char *preset_name) {
+    if (context->fixed_password) {
+        strncpy(password, context->session_password, max_len - 1);
+        password[max_len - 1] = '\0';
+        return 0;
     }
-    if (is_session_valid() && strlen(current_preset_name) > 0 && 
-        preset_name != NULL && strcmp(current_preset_name, preset_name) == 0) {
-        strncpy(password, session_password, max_len - 1);
+    session_path(context);
+    if (is_session_valid(context) && strlen(context->current_preset_name) > 0 && 
+        preset_name != NULL && strcmp(context->current_preset_name, preset_name) == 0) {
+        strncpy(password, context->session_password, max_len - 1);
         password[max_len - 1] = '\0';
         return 0;
     }
-    FILE *f = fopen(session_file, "r");
+    FILE *f = context->persist_session ? fopen(context->session_file, "r") : NULL;
     if (f != NULL) {
         time_t file_time;
         if (fscanf(f, "%ld\n", &file_time) == 1) {
             time_t current_time = time(NULL);
             if (current_time - file_time <= SESSION_TIMEOUT) {
-                if (fgets(session_password, sizeof(session_password), f) != NULL) {
-                    session_password[strcspn(session_password, "\n")] = '\0';
-                    if (fgets(current_preset_name, sizeof(current_preset_name), f) != NULL) {
-                        current_preset_name[strcspn(current_preset_name, "\n")] = '\0';
-                        if (preset_name != NULL && strcmp(current_preset_name, preset_name) == 0) {
-                            session_start_time = file_time;
-                            session_active = 1;
-                            strncpy(password, session_password, max_len - 1);
+                if (fgets(context->session_password, sizeof(context->session_password), f) != NULL) {
+                    context->session_password[strcspn(context->session_password, "\n")] = '\0';
+                    if (fgets(context->current_preset_name, sizeof(context->current_preset_name), f) != NULL) {
+                        context->current_preset_name[strcspn(context->current_preset_name, "\n")] = '\0';
+                        if (preset_name != NULL && strcmp(context->current_preset_name, preset_name) == 0) {
+                            context->session_start_time = file_time;
+                            context->session_active = 1;
+                            strncpy(password, context->session_password, max_len - 1);
                             password[max_len - 1] = '\0';
                             fclose(f);
                             return 0;
@@ -616,25 +5253,42 @@ static int get_session_password(char *password, int max_len, const char *preset_
     return 0;
 }
 
-static int is_session_valid(void) {
-    if (!session_active) return 0;
+static int is_session_valid(cmdset_ctx_t *context) {
+    if (context->fixed_password) return 1;
+    if (!context->session_active) return 0;
     time_t current_time = time(NULL);
-    if (current_time - session_start_time > SESSION_TIMEOUT) {
-        clear_session();
+    if (current_time - context->session_start_time > SESSION_TIMEOUT) {
+        clear_session(context);
         return 0;
     }
     return 1;
 }
 
-static void clear_session(void) {
-    memset(session_password, 0, sizeof(session_password));
-    session_start_time = 0;
-    session_active = 0;
+static void clear_session(cmdset_ctx_t *context) {
+    if (context->fixed_password) return;
+    memset(context->key_cache, 0, sizeof(context->key_cache));
+    memset(context->session_password, 0, sizeof(context->session_password));
+    context->session_start_time = 0;
+    context->session_active = 0;
+}
+
+static int encrypt_command_internal(cmdset_ctx_t *context, const char *plaintext, char *encrypted, const char *preset_name) {
+    pthread_mutex_lock(&context->lock);
+    int result = encrypt_command_unlocked(context, plaintext, encrypted, preset_name);
+    pthread_mutex_unlock(&context->lock);
+    return result;
+}
+
+static int decrypt_command_internal(cmdset_ctx_t *context, const char *encrypted, char *plaintext, const char *preset_name) {
+    pthread_mutex_lock(&context->lock);
+    int result = decrypt_command_unlocked(context, encrypted, plaintext, preset_name);
+    pthread_mutex_unlock(&context->lock);
+    return result;
 }
 
-static int encrypt_command_internal(const char *plaintext, char *encrypted, const char *preset_name) {
+static int encrypt_command_unlocked(cmdset_ctx_t *context, const char *plaintext, char *encrypted, const char *preset_name) {
     char master_password[256];
-    if (get_session_password(master_password, sizeof(master_password), preset_name) != 0) return 1;
+    if (get_session_password(context, master_password, sizeof(master_password), preset_name) != 0) return 1;
     unsigned char salt[SALT_LEN];
     unsigned char iv[IV_LEN];
     if (RAND_bytes(salt, SALT_LEN) != 1 || RAND_bytes(iv, IV_LEN) != 1) {
@@ -642,7 +5296,7 @@ static int encrypt_command_internal(const char *plaintext, char *encrypted, cons
         return 1;
     }
     unsigned char key[KEY_LEN];
-    if (derive_key(master_password, salt, key) != 0) {
+    if (derive_key_cached(context, master_password, salt, key) != 0) {
         memset(master_password, 0, sizeof(master_password));
         return 1;
     }
@@ -695,21 +5349,21 @@ static int encrypt_command_internal(const char *plaintext, char *encrypted, cons
         encrypted[encoded_len++] = (i + 2 < combined_len) ? base64_chars[combined_bytes & 0x3F] : '=';
     }
     encrypted[encoded_len] = '\0';
-    if (preset_name != NULL) {
-        strncpy(current_preset_name, preset_name, sizeof(current_preset_name) - 1);
-        current_preset_name[sizeof(current_preset_name) - 1] = '\0';
-        strncpy(session_password, master_password, sizeof(session_password) - 1);
-        session_password[sizeof(session_password) - 1] = '\0';
-        session_start_time = time(NULL);
-        session_active = 1;
-        FILE *session_f = fopen(session_file, "w");
+    if (preset_name != NULL && !context->fixed_password) {
+        strncpy(context->current_preset_name, preset_name, sizeof(context->current_preset_name) - 1);
+        context->current_preset_name[sizeof(context->current_preset_name) - 1] = '\0';
+        strncpy(context->session_password, master_password, sizeof(context->session_password) - 1);
+        context->session_password[sizeof(context->session_password) - 1] = '\0';
+        context->session_start_time = time(NULL);
+        context->session_active = 1;
+        FILE *session_f = context->persist_session ? fopen(context->session_file, "w") : NULL;
         if (session_f != NULL) {
-            fprintf(session_f, "%ld\n%s\n%s\n", session_start_time, session_password, current_preset_name);
+            fprintf(session_f, "%ld\n%s\n%s\n", context->session_start_time, context->session_password, context->current_preset_name);
             fflush(session_f);
             fclose(session_f);
-            chmod(session_file, 0600);
+            chmod(context->session_file, 0600);
+            printf("Password cached for %d minutes. Use 'cmdset clear-session' to clear.\n", SESSION_TIMEOUT / 60);
         }
-        printf("Password cached for %d minutes. Use 'cmdset clear-session' to clear.\n", SESSION_TIMEOUT / 60);
     }
     memset(master_password, 0, sizeof(master_password));
     memset(key, 0, KEY_LEN);
@@ -720,9 +5374,9 @@ static int encrypt_command_internal(const char *plaintext, char *encrypted, cons
     return 0;
 }
 
-static int decrypt_command_internal(const char *encrypted, char *plaintext, const char *preset_name) {
+static int decrypt_command_unlocked(cmdset_ctx_t *context, const char *encrypted, char *plaintext, const char *preset_name) {
     char master_password[256];
-    if (get_session_password(master_password, sizeof(master_password), preset_name) != 0) return 1;
+    if (get_session_password(context, master_password, sizeof(master_password), preset_name) != 0) return 1;
     const char *base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     int encrypted_len = strlen(encrypted);
     int decoded_len = (encrypted_len * 3) / 4;
@@ -747,7 +5401,7 @@ static int decrypt_command_internal(const char *encrypted, char *plaintext, cons
     unsigned char *ciphertext = decoded + SALT_LEN + IV_LEN;
     int ciphertext_len = decoded_len - SALT_LEN - IV_LEN;
     unsigned char key[KEY_LEN];
-    if (derive_key(master_password, salt, key) != 0) {
+    if (derive_key_cached(context, master_password, salt, key) != 0) {
         free(decoded);
         memset(master_password, 0, sizeof(master_password));
         return 1;
@@ -783,8 +5437,8 @@ static int decrypt_command_internal(const char *encrypted, char *plaintext, cons
         free(decoded);
         memset(master_password, 0, sizeof(master_password));
         memset(key, 0, KEY_LEN);
-        clear_session();
-        system("rm -f ~/.cmdset_session");
+        clear_session(context);
+        session_remove(context);
         return 1;
     }
     plaintext_len += len;
@@ -792,21 +5446,21 @@ static int decrypt_command_internal(const char *encrypted, char *plaintext, cons
     strcpy(plaintext, (char*)temp_plaintext);
     EVP_CIPHER_CTX_free(ctx);
     free(decoded);
-    if (preset_name != NULL) {
-        strncpy(current_preset_name, preset_name, sizeof(current_preset_name) - 1);
-        current_preset_name[sizeof(current_preset_name) - 1] = '\0';
-        strncpy(session_password, master_password, sizeof(session_password) - 1);
-        session_password[sizeof(session_password) - 1] = '\0';
-        session_start_time = time(NULL);
-        session_active = 1;
-        FILE *session_f = fopen(session_file, "w");
+    if (preset_name != NULL && !context->fixed_password) {
+        strncpy(context->current_preset_name, preset_name, sizeof(context->current_preset_name) - 1);
+        context->current_preset_name[sizeof(context->current_preset_name) - 1] = '\0';
+        strncpy(context->session_password, master_password, sizeof(context->session_password) - 1);
+        context->session_password[sizeof(context->session_password) - 1] = '\0';
+        context->session_start_time = time(NULL);
+        context->session_active = 1;
+        FILE *session_f = context->persist_session ? fopen(context->session_file, "w") : NULL;
         if (session_f != NULL) {
-            fprintf(session_f, "%ld\n%s\n%s\n", session_start_time, session_password, current_preset_name);
+            fprintf(session_f, "%ld\n%s\n%s\n", context->session_start_time, context->session_password, context->current_preset_name);
             fflush(session_f);
             fclose(session_f);
-            chmod(session_file, 0600);
+            chmod(context->session_file, 0600);
+            printf("Password cached for %d minutes. Use 'cmdset clear-session' to clear.\n", SESSION_TIMEOUT / 60);
         }
-        printf("Password cached for %d minutes. Use 'cmdset clear-session' to clear.\n", SESSION_TIMEOUT / 60);
     }
     memset(master_password, 0, sizeof(master_password));
     memset(key, 0, KEY_LEN);
@@ -814,6 +5468,20 @@ static int decrypt_command_internal(const char *encrypted, char *plaintext, cons
 }
 
 #ifndef CMDSET_BUILD_LIB
+typedef struct {
+    char name[MAX_NAME_LEN];
+    cmdset_usage_t usage;
+} usage_row_t;
+
+static int compare_usage_rows(const void *a, const void *b) {
+    const cmdset_usage_t *left = &((const usage_row_t *)a)->usage;
+    const cmdset_usage_t *right = &((const usage_row_t *)b)->usage;
+    double left_cpu = left->user_seconds + left->system_seconds;
+    double right_cpu = right->user_seconds + right->system_seconds;
+    if (left_cpu != right_cpu) return left_cpu < right_cpu ? 1 : -1;
+    return left->wall_seconds < right->wall_seconds ? 1 : left->wall_seconds > right->wall_seconds ? -1 : 0;
+}
+
 void print_usage(const char* program_name) {
     printf("Usage: %s [command] [options...]\n", program_name);
     printf(" %s add <name> <command>                Add a new preset\n", program_name);
@@ -824,32 +5492,111 @@ void print_usage(const char* program_name) {
     printf(" %s rm <name>                           Remove a preset (short)\n", program_name);
     printf(" %s list                                List all presets\n", program_name);
     printf(" %s ls                                  List all presets (short)\n", program_name);
+    printf(" %s ls --top [N]                        List the N most frecent presets (default 10)\n", program_name);
+    printf(" %s ls --tag <tag> [--tag <tag>...]     List presets carrying all the given tags\n", program_name);
+    printf(" %s ls --format <json|ndjson|tsv>       List presets in a machine-readable format\n", program_name);
+    printf(" %s ls --where <expression>             List presets matching a filter expression\n", program_name);
+    printf(" %s tag <name> <tag> [tag...]           Add tags to a preset\n", program_name);
+    printf(" %s untag <name> <tag> [tag...]         Remove tags from a preset\n", program_name);
+    printf(" %s exec-many --tag <tag> [--tag...]    Execute every preset carrying all the given tags\n", program_name);
+    printf(" %s em --tag <tag> [--tag...]           Execute every preset carrying the tags (short)\n", program_name);
+    printf(" %s search <query>                      Search preset names (fuzzy) and commands (substring)\n", program_name);
+    printf(" %s lookup <token> [AND|OR <token>...]  List presets whose commands contain the tokens\n", program_name);
+    printf(" %s lk <token> [AND|OR <token>...]      List presets by command tokens (short)\n", program_name);
     printf(" %s exec <name> [args...]               Execute a preset with optional arguments\n", program_name);
     printf(" %s e <name> [args...]                  Execute a preset with optional arguments (short)\n", program_name);
     printf(" %s run <name> [args...]                Execute a preset with optional arguments (short)\n", program_name);
+    printf(" %s exec --no-wait <name> [args...]     Fail instead of waiting when the preset is at its limit\n", program_name);
+    printf(" %s limit <name> <N>                    Allow at most N concurrent runs of a preset (0 = unlimited)\n", program_name);
+    printf(" %s sched <name> [cpus=L] [nice=N] [io=C]  Set or show the scheduling profile of a preset\n", program_name);
+    printf(" %s stats [name]                        Show the resources used by a preset, or rank all by CPU time\n", program_name);
     printf(" %s help                                Show this help message\n", program_name);
     printf(" %s h                                   Show this help message (short)\n", program_name);
     printf(" %s clear-session                       Clear cached password session\n", program_name);
     printf(" %s cs                                  Clear cached password session (short)\n", program_name);
     printf(" %s status                              Show session status\n", program_name);
     printf(" %s s                                   Show session status (short)\n", program_name);
+    printf(" %s completion <bash|zsh|fish>          Print a shell completion script\n", program_name);
     printf(" %s export [filename]                   Export presets to JSON file\n", program_name);
     printf(" %s exp [filename]                      Export presets to JSON file (short)\n", program_name);
     printf(" %s import [filename]                   Import presets from JSON file\n", program_name);
     printf(" %s imp [filename]                      Import presets from JSON file (short)\n", program_name);
 }
 
+#define COMPLETION_COMMANDS "add a list ls exec e run limit sched stats remove rm search lookup lk tag untag exec-many em export exp import imp status s clear-session cs completion help h"
+#define COMPLETION_PRESET_COMMANDS "exec|e|run|limit|sched|stats|remove|rm|tag|untag"
+
+static int print_completion_script(const char *shell) {
+    if (strcmp(shell, "bash") == 0) {
+        printf("_cmdset() {\n"
+               "    local cur=${COMP_WORDS[COMP_CWORD]}\n"
+               "    if [[ $COMP_CWORD -eq 1 ]]; then\n"
+               "        COMPREPLY=($(compgen -W \"%s\" -- \"$cur\"))\n"
+               "    elif [[ $COMP_CWORD -eq 2 ]]; then\n"
+               "        case ${COMP_WORDS[1]} in\n"
+               "            %s) COMPREPLY=($(cmdset __complete \"$cur\" 2>/dev/null)) ;;\n"
+               "        esac\n"
+               "    fi\n"
+               "}\n"
+               "complete -F _cmdset cmdset\n", COMPLETION_COMMANDS, COMPLETION_PRESET_COMMANDS);
+    } else if (strcmp(shell, "zsh") == 0) {
+        printf("#compdef cmdset\n"
+               "_cmdset() {\n"
+               "    if (( CURRENT == 2 )); then\n"
+               "        compadd -- %s\n"
+               "    elif (( CURRENT == 3 )); then\n"
+               "        case $words[2] in\n"
+               "            %s) compadd -V presets -- ${(f)\"$(cmdset __complete \"$PREFIX\" 2>/dev/null)\"} ;;\n"
+               "        esac\n"
+               "    fi\n"
+               "}\n"
+               "compdef _cmdset cmdset\n", COMPLETION_COMMANDS, COMPLETION_PRESET_COMMANDS);
+    } else if (strcmp(shell, "fish") == 0) {
+        char preset_commands[] = COMPLETION_PRESET_COMMANDS;
+        for (char *p = preset_commands; *p != '\0'; p++) {
+            if (*p == '|') *p = ' ';
+        }
+        printf("complete -c cmdset -f\n"
+               "complete -c cmdset -n __fish_use_subcommand -a \"%s\"\n"
+               "complete -c cmdset -k -n \"__fish_seen_subcommand_from %s; and test (count (commandline -opc)) -eq 2\" -a \"(cmdset __complete (commandline -ct) 2>/dev/null)\"\n",
+               COMPLETION_COMMANDS, preset_commands);
+    } else return 1;
+    return 0;
+}
+
+static void print_preset(cmdset_manager_t *manager, const cmdset_preset_t *preset) {
+    char tags[MAX_PRESETS][MAX_TAG_LEN];
+    printf("  %s: %s%s", preset->name, preset->command, preset->encrypt ? " (encrypted)" : "");
+    int tag_count = cmdset_get_preset_tags(manager, preset, tags, MAX_PRESETS);
+    for (int i = 0; i < tag_count; i++) printf("%s%s%s", i == 0 ? " [" : ", ", tags[i], i == tag_count - 1 ? "]" : "");
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         print_usage(argv[0]);
         return 1;
     }
+    if (strcmp(argv[1], "__complete") == 0) return cmdset_complete(argc > 2 ? argv[2] : "", STDOUT_FILENO) < 0 ? 1 : 0;
+    if (strcmp(argv[1], "completion") == 0) {
+        if (argc < 3 || print_completion_script(argv[2]) != 0) {
+            fprintf(stderr, "Error: completion command requires a shell: bash, zsh or fish\n");
+            return 1;
+        }
+        return 0;
+    }
     cmdset_manager_t manager;
     int result = cmdset_init(&manager);
     if (result != 0) {
         fprintf(stderr, "Error: Failed to initialize CmdSet: %s\n", cmdset_get_error_message(result));
         return 1;
     }
+    const char *half_life_env = getenv("CMDSET_FRECENCY_HALF_LIFE");
+    const char *count_weight_env = getenv("CMDSET_FRECENCY_COUNT_WEIGHT");
+    if (half_life_env != NULL || count_weight_env != NULL) {
+        double half_life = half_life_env != NULL ? atof(half_life_env) * 24 * 3600 : FRECENCY_HALF_LIFE;
+        double count_weight = count_weight_env != NULL ? atof(count_weight_env) : FRECENCY_COUNT_WEIGHT;
+        if (cmdset_set_frecency_params(&manager, half_life, count_weight) != 0) fprintf(stderr, "Warning: Ignoring invalid frecency parameters\n");
+    }
     if (strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "h") == 0) {
         print_usage(argv[0]);
         cmdset_cleanup(&manager);
@@ -891,49 +5638,368 @@ int main(int argc, char* argv[]) {
         printf("Preset '%s' added successfully\n", name);
     }
     else if (strcmp(argv[1], "list") == 0 || strcmp(argv[1], "ls") == 0) {
-        int count = cmdset_get_preset_count(&manager);
-        if (count == 0) printf("No presets found\n");
+        int top = 0;
+        int format = -1;
+        int tag_count = 0;
+        const char *where = NULL;
+        const char **tags = malloc(sizeof(char *) * argc);
+        if (tags == NULL) {
+            fprintf(stderr, "Error: %s\n", cmdset_get_error_message(CMDSET_ERROR_MEMORY));
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--top") == 0) {
+                top = (i + 1 < argc && argv[i + 1][0] != '-') ? atoi(argv[++i]) : 10;
+                if (top <= 0) {
+                    fprintf(stderr, "Error: --top requires a positive count\n");
+                    free(tags);
+                    cmdset_cleanup(&manager);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--tag") == 0 && i + 1 < argc) tags[tag_count++] = argv[++i];
+            else if (strcmp(argv[i], "--where") == 0 && i + 1 < argc) where = argv[++i];
+            else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "json") == 0) format = CMDSET_FORMAT_JSON;
+                else if (strcmp(argv[i], "ndjson") == 0) format = CMDSET_FORMAT_NDJSON;
+                else if (strcmp(argv[i], "tsv") == 0) format = CMDSET_FORMAT_TSV;
+                else {
+                    fprintf(stderr, "Error: Unknown list format '%s' (expected json, ndjson or tsv)\n", argv[i]);
+                    free(tags);
+                    cmdset_cleanup(&manager);
+                    return 1;
+                }
+            }
+            else {
+                fprintf(stderr, "Error: Unknown list option '%s'\n", argv[i]);
+                free(tags);
+                print_usage(argv[0]);
+                cmdset_cleanup(&manager);
+                return 1;
+            }
+        }
+        cmdset_preset_t presets[MAX_PRESETS];
+        int count = 0;
+        if (top > 0) count = cmdset_get_top_presets(&manager, MAX_PRESETS, presets);
+        else {
+            cmdset_cursor_t cursor;
+            cmdset_cursor_init(&manager, &cursor);
+            while (count < MAX_PRESETS && cmdset_cursor_next(&cursor, &presets[count]) == 1) count++;
+            cmdset_cursor_release(&cursor);
+        }
+        if (tag_count > 0) {
+            cmdset_preset_t tagged[MAX_PRESETS];
+            int tagged_count = cmdset_filter_by_tags(&manager, tags, tag_count, tagged, MAX_PRESETS);
+            int kept = 0;
+            for (int i = 0; i < count; i++) {
+                for (int j = 0; j < tagged_count; j++) {
+                    if (strcmp(presets[i].name, tagged[j].name) != 0) continue;
+                    presets[kept++] = presets[i];
+                    break;
+                }
+            }
+            count = kept;
+        }
+        free(tags);
+        if (where != NULL) {
+            cmdset_query_t *query;
+            result = cmdset_query_compile(where, &query);
+            if (result != CMDSET_SUCCESS) {
+                fprintf(stderr, "Error: Invalid --where expression: %s\n", cmdset_get_last_error());
+                cmdset_cleanup(&manager);
+                return 1;
+            }
+            int kept = 0;
+            for (int i = 0; i < count; i++) {
+                if (cmdset_query_match(query, &presets[i]) == 1) presets[kept++] = presets[i];
+            }
+            count = kept;
+            cmdset_query_free(query);
+        }
+        if (top > 0 && count > top) count = top;
+        if (format >= 0) {
+            fflush(stdout);
+            result = cmdset_write_presets(&manager, presets, count, STDOUT_FILENO, format);
+            if (result < 0) {
+                fprintf(stderr, "Error: Failed to list presets: %s\n", cmdset_get_error_message(result));
+                cmdset_cleanup(&manager);
+                return 1;
+            }
+        }
+        else if (count == 0) printf("No presets found\n");
+        else if (top > 0) {
+            printf("Top %d preset(s) by frecency:\n", count);
+            for (int i = 0; i < count; i++) {
+                print_preset(&manager, &presets[i]);
+                printf(" (score %.2f, used %d times)\n", cmdset_get_frecency(&manager, &presets[i]), presets[i].use_count);
+            }
+        }
         else {
             printf("Found %d preset(s):\n", count);
             for (int i = 0; i < count; i++) {
-                cmdset_preset_t preset;
-                if (cmdset_get_preset_by_index(&manager, i, &preset) == 0) printf("  %s: %s%s\n", preset.name, preset.command, preset.encrypt ? " (encrypted)" : "");
+                print_preset(&manager, &presets[i]);
+                printf("\n");
             }
         }
     }
-    else if (strcmp(argv[1], "exec") == 0 || strcmp(argv[1], "e") == 0 || strcmp(argv[1], "run") == 0) {
+    else if (strcmp(argv[1], "tag") == 0 || strcmp(argv[1], "untag") == 0) {
+        int untag = strcmp(argv[1], "untag") == 0;
+        if (argc < 4) {
+            fprintf(stderr, "Error: %s command requires preset name and at least one tag\n", argv[1]);
+            print_usage(argv[0]);
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        for (int i = 3; i < argc; i++) {
+            result = untag ? cmdset_untag_preset(&manager, argv[2], argv[i]) : cmdset_tag_preset(&manager, argv[2], argv[i]);
+            if (result != 0) {
+                fprintf(stderr, "Error: Failed to %s '%s' with '%s': %s\n", argv[1], argv[2], argv[i], cmdset_get_error_message(result));
+                cmdset_cleanup(&manager);
+                return 1;
+            }
+        }
+        result = cmdset_save_presets(&manager);
+        if (result != 0) fprintf(stderr, "Warning: Failed to save presets: %s\n", cmdset_get_error_message(result));
+        printf("Preset '%s' %s\n", argv[2], untag ? "untagged" : "tagged");
+    }
+    else if (strcmp(argv[1], "exec-many") == 0 || strcmp(argv[1], "em") == 0) {
+        int tag_count = 0;
+        const char **tags = malloc(sizeof(char *) * argc);
+        if (tags == NULL) {
+            fprintf(stderr, "Error: %s\n", cmdset_get_error_message(CMDSET_ERROR_MEMORY));
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        for (int i = 2; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--tag") == 0) tags[tag_count++] = argv[i + 1];
+        }
+        if (tag_count == 0) {
+            fprintf(stderr, "Error: exec-many command requires at least one --tag\n");
+            free(tags);
+            print_usage(argv[0]);
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        cmdset_preset_t presets[MAX_PRESETS];
+        int count = cmdset_filter_by_tags(&manager, tags, tag_count, presets, MAX_PRESETS);
+        free(tags);
+        if (count <= 0) printf("No presets found\n");
+        int failures = 0;
+        for (int i = 0; i < count; i++) {
+            char name[MAX_NAME_LEN];
+            strcpy(name, presets[i].name);
+            printf("==> %s\n", name);
+            fflush(stdout);
+            result = cmdset_execute_preset(&manager, name, NULL);
+            if (result != 0) {
+                if (result < 0) fprintf(stderr, "Error: Failed to execute preset '%s': %s\n", name, cmdset_get_error_message(result));
+                failures++;
+            }
+        }
+        if (count > 0) {
+            result = cmdset_save_presets(&manager);
+            if (result != 0) fprintf(stderr, "Warning: Failed to save usage statistics: %s\n", cmdset_get_error_message(result));
+        }
+        cmdset_cleanup(&manager);
+        return failures > 0 ? 1 : 0;
+    }
+    else if (strcmp(argv[1], "search") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Error: search command requires a query\n");
+            print_usage(argv[0]);
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        cmdset_search_result_t results[MAX_PRESETS];
+        int count = cmdset_search(&manager, argv[2], results, MAX_PRESETS);
+        if (count < 0) {
+            fprintf(stderr, "Error: Failed to search presets: %s\n", cmdset_get_error_message(count));
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        if (count == 0) printf("No presets match '%s'\n", argv[2]);
+        else {
+            printf("Found %d matching preset(s):\n", count);
+            for (int i = 0; i < count; i++) printf("  %s: %s%s\n", results[i].preset.name, results[i].preset.command, results[i].preset.encrypt ? " (encrypted)" : "");
+        }
+    }
+    else if (strcmp(argv[1], "lookup") == 0 || strcmp(argv[1], "lk") == 0) {
         if (argc < 3) {
+            fprintf(stderr, "Error: lookup command requires at least one token\n");
+            print_usage(argv[0]);
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        size_t expression_len = 0;
+        for (int i = 2; i < argc; i++) expression_len += strlen(argv[i]) + 1;
+        char *expression = malloc(expression_len);
+        if (expression == NULL) {
+            fprintf(stderr, "Error: %s\n", cmdset_get_error_message(CMDSET_ERROR_MEMORY));
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        strcpy(expression, argv[2]);
+        for (int i = 3; i < argc; i++) {
+            strcat(expression, " ");
+            strcat(expression, argv[i]);
+        }
+        cmdset_preset_t matches[MAX_PRESETS];
+        int count = cmdset_lookup_tokens(&manager, expression, matches, MAX_PRESETS);
+        free(expression);
+        if (count < 0) {
+            fprintf(stderr, "Error: Failed to look up tokens: %s\n", cmdset_get_error_message(count));
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        if (count == 0) printf("No presets reference those tokens\n");
+        else {
+            printf("Found %d matching preset(s):\n", count);
+            for (int i = 0; i < count; i++) printf("  %s: %s\n", matches[i].name, matches[i].command);
+        }
+    }
+    else if (strcmp(argv[1], "exec") == 0 || strcmp(argv[1], "e") == 0 || strcmp(argv[1], "run") == 0) {
+        int first = argc > 2 && strcmp(argv[2], "--no-wait") == 0 ? 3 : 2;
+        if (argc <= first) {
             fprintf(stderr, "Error: exec command requires preset name\n");
             print_usage(argv[0]);
             cmdset_cleanup(&manager);
             return 1;
         }
-        char* name = argv[2];
+        char* name = argv[first];
+        cmdset_preset_t candidates[MAX_PRESETS];
+        int candidate_count = cmdset_resolve_prefix(&manager, name, candidates, MAX_PRESETS);
+        if (candidate_count == 1) name = candidates[0].name;
+        else if (candidate_count > 1) {
+            fprintf(stderr, "Error: Ambiguous preset prefix '%s', candidates:\n", name);
+            for (int i = 0; i < candidate_count && i < MAX_PRESETS; i++) fprintf(stderr, "  %s\n", candidates[i].name);
+            cmdset_cleanup(&manager);
+            return 1;
+        }
         char* additional_args = NULL;
-        if (argc > 3) {
+        if (argc > first + 1) {
             int total_len = 0;
-            for (int i = 3; i < argc; i++) {
+            for (int i = first + 1; i < argc; i++) {
                 total_len += strlen(argv[i]) + 1;
             }
             additional_args = malloc(total_len);
             if (additional_args) {
-                strcpy(additional_args, argv[3]);
-                for (int i = 4; i < argc; i++) {
+                strcpy(additional_args, argv[first + 1]);
+                for (int i = first + 2; i < argc; i++) {
                     strcat(additional_args, " ");
                     strcat(additional_args, argv[i]);
                 }
             }
         }
-        result = cmdset_execute_preset(&manager, name, additional_args);
+        result = cmdset_execute_preset_ex(&manager, name, additional_args, first == 3 ? CMDSET_EXEC_NOWAIT : CMDSET_EXEC_WAIT);
         if (result < 0) {
             fprintf(stderr, "Error: Failed to execute preset: %s\n", cmdset_get_error_message(result));
+            if (result == CMDSET_ERROR_NOT_FOUND) {
+                cmdset_preset_t suggestions[3];
+                int suggestion_count = cmdset_suggest(&manager, name, suggestions, 3);
+                for (int i = 0; i < suggestion_count; i++) fprintf(stderr, "%s'%s'%s", i == 0 ? "Did you mean " : ", ", suggestions[i].name, i == suggestion_count - 1 ? "?\n" : "");
+            }
             if (additional_args) free(additional_args);
             cmdset_cleanup(&manager);
             return 1;
         }
         if (additional_args) free(additional_args);
+        int save_result = cmdset_save_presets(&manager);
+        if (save_result != 0) fprintf(stderr, "Warning: Failed to save usage statistics: %s\n", cmdset_get_error_message(save_result));
         return result; // Return the exit code from the executed command
     }
+    else if (strcmp(argv[1], "limit") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Error: limit command requires preset name and a maximum\n");
+            print_usage(argv[0]);
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        char *end;
+        errno = 0;
+        long limit = strtol(argv[3], &end, 10);
+        if (end == argv[3] || *end != '\0' || errno == ERANGE || limit < 0 || limit > INT_MAX) {
+            fprintf(stderr, "Error: Invalid maximum '%s': expected a whole number from 0 to %d\n", argv[3], INT_MAX);
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        result = cmdset_set_max_concurrency(&manager, argv[2], (int)limit);
+        if (result != 0) {
+            fprintf(stderr, "Error: Failed to limit preset: %s\n", cmdset_get_error_message(result));
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        result = cmdset_save_presets(&manager);
+        if (result != 0) fprintf(stderr, "Warning: Failed to save presets: %s\n", cmdset_get_error_message(result));
+        if (limit > 0) printf("Preset '%s' limited to %ld concurrent run(s)\n", argv[2], limit);
+        else printf("Preset '%s' is no longer limited\n", argv[2]);
+    }
+    else if (strcmp(argv[1], "stats") == 0) {
+        cmdset_usage_t usage;
+        if (argc >= 3) {
+            result = cmdset_get_usage(&manager, argv[2], &usage);
+            if (result != 0) {
+                fprintf(stderr, "Error: %s\n", cmdset_get_last_error());
+                cmdset_cleanup(&manager);
+                return 1;
+            }
+            printf("Preset: %s\n", argv[2]);
+            printf("Runs: %ld\n", usage.runs);
+            if (usage.runs > 0) {
+                printf("Wall time: %.2fs total, %.2fs average, %.2fs last run\n", usage.wall_seconds, usage.wall_seconds / usage.runs, usage.last_wall_seconds);
+                printf("CPU time: %.2fs user, %.2fs system, %.2fs average\n", usage.user_seconds, usage.system_seconds, (usage.user_seconds + usage.system_seconds) / usage.runs);
+                printf("Peak RSS: %ld KB\n", usage.max_rss_kb);
+                printf("Block IO: %ld in, %ld out\n", usage.in_blocks, usage.out_blocks);
+            }
+        } else {
+            usage_row_t rows[MAX_PRESETS];
+            int row_count = 0;
+            cmdset_cursor_t cursor;
+            cmdset_preset_t preset;
+            cmdset_cursor_init(&manager, &cursor);
+            while (row_count < MAX_PRESETS && cmdset_cursor_next(&cursor, &preset) == 1) {
+                strcpy(rows[row_count].name, preset.name);
+                if (cmdset_get_usage(&manager, preset.name, &rows[row_count].usage) == 0 && rows[row_count].usage.runs > 0) row_count++;
+            }
+            cmdset_cursor_release(&cursor);
+            qsort(rows, row_count, sizeof(usage_row_t), compare_usage_rows);
+            if (row_count == 0) printf("No runs recorded yet\n");
+            else {
+                printf("%-30s %6s %10s %10s %10s %10s\n", "Preset", "Runs", "Wall (s)", "CPU (s)", "Avg (s)", "RSS (KB)");
+                for (int i = 0; i < row_count; i++) {
+                    const cmdset_usage_t *row = &rows[i].usage;
+                    printf("%-30s %6ld %10.2f %10.2f %10.2f %10ld\n", rows[i].name, row->runs, row->wall_seconds,
+                           row->user_seconds + row->system_seconds, row->wall_seconds / row->runs, row->max_rss_kb);
+                }
+            }
+        }
+    }
+    else if (strcmp(argv[1], "sched") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Error: sched command requires preset name\n");
+            print_usage(argv[0]);
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        char spec[4096] = "";
+        for (int i = 3; i < argc; i++) {
+            if (strlen(spec) + strlen(argv[i]) + 2 > sizeof(spec)) break;
+            if (i > 3) strcat(spec, " ");
+            strcat(spec, argv[i]);
+        }
+        if (argc > 3) {
+            result = cmdset_set_sched_profile(&manager, argv[2], spec);
+            if (result == 0) result = cmdset_save_presets(&manager);
+        }
+        if (result == 0) result = cmdset_get_sched_profile(&manager, argv[2], spec, sizeof(spec));
+        if (result != 0) {
+            fprintf(stderr, "Error: %s\n", cmdset_get_last_error());
+            cmdset_cleanup(&manager);
+            return 1;
+        }
+        printf("%s: %s\n", argv[2], spec[0] != '\0' ? spec : "default scheduling");
+    }
     else if (strcmp(argv[1], "remove") == 0 || strcmp(argv[1], "rm") == 0) {
         if (argc < 3) {
             fprintf(stderr, "Error: remove command requires preset name\n");
@@ -955,8 +6021,8 @@ int main(int argc, char* argv[]) {
         printf("Preset '%s' removed successfully\n", name);
     }
     else if (strcmp(argv[1], "clear-session") == 0 || strcmp(argv[1], "cs") == 0) {
-        clear_session();
-        system("rm -f ~/.cmdset_session");
+        cmdset_ctx_clear_session(NULL);
+        session_remove(&default_ctx);
         printf("Password session cleared\n");
     }
     else if (strcmp(argv[1], "status") == 0 || strcmp(argv[1], "s") == 0) {
@@ -1,11 +1,35 @@
 #ifndef CMDSET_H
 #define CMDSET_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-typedef struct {
+// Calls that can fail return one of these; cmdset_get_error_message() names
+// them and cmdset_get_last_error() says what went wrong.
+#define CMDSET_SUCCESS 0
+#define CMDSET_ERROR_MEMORY -1
+#define CMDSET_ERROR_FILE -2
+#define CMDSET_ERROR_NOT_FOUND -3
+#define CMDSET_ERROR_EXISTS -4
+#define CMDSET_ERROR_INVALID -5
+#define CMDSET_ERROR_ENCRYPTION -6
+#define CMDSET_ERROR_JSON -7
+#define CMDSET_ERROR_TRUNCATED -8
+#define CMDSET_ERROR_BUSY -9
+
+// Define CMDSET_OPAQUE before including this header to hide the layout of
+// presets and managers. Such callers create managers with
+// cmdset_manager_new(), read presets through the cmdset_preset_*()
+// accessors and allocate arrays for the calls that copy presets out with
+// cmdset_preset_array_new() and cmdset_search_result_array_new(), so they
+// keep working when the layout changes.
+#ifdef CMDSET_OPAQUE
+typedef struct cmdset_preset cmdset_preset_t;
+#else
+typedef struct cmdset_preset {
     char name[50];
     char command[500];
     int active;
@@ -14,13 +38,105 @@ typedef struct {
     long last_used;
     int use_count;
 } cmdset_preset_t;
+#endif
+
+struct cmdset_state;
+struct cmdset_snapshot;
+struct store_version;
+
+typedef struct cmdset_ctx cmdset_ctx_t;
 
 typedef struct {
+    void *(*malloc)(size_t size, void *user_data);
+    void *(*realloc)(void *pointer, size_t size, void *user_data);
+    void (*free)(void *pointer, void *user_data);
+    void *user_data;
+} cmdset_allocator_t;
+
+#ifdef CMDSET_OPAQUE
+typedef struct cmdset_manager cmdset_manager_t;
+#else
+typedef struct cmdset_manager {
     cmdset_preset_t presets[100];
     int count;
+    struct cmdset_state *state;
 } cmdset_manager_t;
+#endif
+
+// A cursor walks the presets of one snapshot, pinned by cmdset_cursor_init()
+// and unpinned when cmdset_cursor_next() reaches the end or by
+// cmdset_cursor_release(), so presets that other threads move while it
+// runs are neither skipped nor seen twice.
+typedef struct {
+    cmdset_manager_t *manager;
+    int position;
+    struct cmdset_snapshot *snapshot;
+    const struct store_version *version;
+} cmdset_cursor_t;
+
+#ifdef CMDSET_OPAQUE
+typedef struct cmdset_search_result cmdset_search_result_t;
+#else
+typedef struct cmdset_search_result {
+    cmdset_preset_t preset;
+    int score;
+} cmdset_search_result_t;
+#endif
+
+typedef enum {
+    CMDSET_FORMAT_JSON,
+    CMDSET_FORMAT_NDJSON,
+    CMDSET_FORMAT_TSV
+} cmdset_format_t;
+
+typedef enum {
+    CMDSET_EXEC_WAIT = 0,
+    CMDSET_EXEC_NOWAIT = 1
+} cmdset_exec_flags_t;
+
+// Resources used by a preset's runs, summed over every run unless noted.
+typedef struct {
+    long runs;
+    double wall_seconds;
+    double user_seconds;
+    double system_seconds;
+    double last_wall_seconds;
+    long max_rss_kb;
+    long in_blocks;
+    long out_blocks;
+} cmdset_usage_t;
+
+// A preset in a cmdset_dump_packed() buffer. Offsets are from the start of
+// the buffer and point at NUL-terminated text; lengths exclude the NUL.
+typedef struct {
+    unsigned int name_offset;
+    unsigned int name_length;
+    unsigned int command_offset;
+    unsigned int command_length;
+    long created_at;
+    long last_used;
+    int use_count;
+    int encrypt;
+} cmdset_packed_preset_t;
+
+typedef struct cmdset_query cmdset_query_t;
+
+typedef struct cmdset_snapshot cmdset_snapshot_t;
+
+typedef struct cmdset_txn cmdset_txn_t;
+
+typedef struct cmdset_run cmdset_run_t;
+
+typedef int (*cmdset_foreach_fn)(const cmdset_preset_t *preset, void *user_data);
 
 int cmdset_init(cmdset_manager_t *manager);
+int cmdset_init_with_ctx(cmdset_manager_t *manager, cmdset_ctx_t *ctx);
+cmdset_ctx_t* cmdset_ctx_new(void);
+void cmdset_ctx_free(cmdset_ctx_t *ctx);
+int cmdset_ctx_set_store(cmdset_ctx_t *ctx, const char *path);
+int cmdset_ctx_set_password(cmdset_ctx_t *ctx, const char *password);
+int cmdset_ctx_set_allocator(cmdset_ctx_t *ctx, const cmdset_allocator_t *allocator);
+void cmdset_ctx_clear_session(cmdset_ctx_t *ctx);
 int cmdset_add_preset(cmdset_manager_t *manager, const char *name, const char *command, int encrypt);
 int cmdset_remove_preset(cmdset_manager_t *manager, const char *name);
 int cmdset_execute_preset(cmdset_manager_t *manager, const char *name, const char *additional_args);
@@ -35,8 +151,78 @@ int cmdset_decrypt_command(const char *encrypted, char *plaintext);
 void cmdset_cleanup(cmdset_manager_t *manager);
 
 const char* cmdset_get_error_message(int error_code);
+const char* cmdset_get_last_error(void);
 int cmdset_get_preset_count(cmdset_manager_t *manager);
 int cmdset_get_preset_by_index(cmdset_manager_t *manager, int index, cmdset_preset_t *preset);
+void cmdset_cursor_init(cmdset_manager_t *manager, cmdset_cursor_t *cursor);
+int cmdset_cursor_next(cmdset_cursor_t *cursor, cmdset_preset_t *preset);
+void cmdset_cursor_release(cmdset_cursor_t *cursor);
+int cmdset_foreach(cmdset_manager_t *manager, cmdset_foreach_fn callback, void *user_data);
+int cmdset_set_frecency_params(cmdset_manager_t *manager, double half_life, double count_weight);
+double cmdset_get_frecency(cmdset_manager_t *manager, const cmdset_preset_t *preset);
+int cmdset_get_top_presets(cmdset_manager_t *manager, int k, cmdset_preset_t *presets);
+int cmdset_search(cmdset_manager_t *manager, const char *query, cmdset_search_result_t *results, int max_results);
+int cmdset_lookup_tokens(cmdset_manager_t *manager, const char *expression, cmdset_preset_t *presets, int max_presets);
+int cmdset_resolve_prefix(cmdset_manager_t *manager, const char *prefix, cmdset_preset_t *presets, int max_presets);
+int cmdset_suggest(cmdset_manager_t *manager, const char *name, cmdset_preset_t *presets, int max_presets);
+int cmdset_tag_preset(cmdset_manager_t *manager, const char *name, const char *tag);
+int cmdset_untag_preset(cmdset_manager_t *manager, const char *name, const char *tag);
+int cmdset_get_preset_tags(cmdset_manager_t *manager, const cmdset_preset_t *preset, char (*tags)[32], int max_tags);
+int cmdset_filter_by_tags(cmdset_manager_t *manager, const char **tags, int tag_count, cmdset_preset_t *presets, int max_presets);
+int cmdset_query_compile(const char *expression, cmdset_query_t **query);
+int cmdset_query_match(const cmdset_query_t *query, const cmdset_preset_t *preset);
+void cmdset_query_free(cmdset_query_t *query);
+int cmdset_filter_where(cmdset_manager_t *manager, const char *expression, cmdset_preset_t *presets, int max_presets);
+int cmdset_write_presets(cmdset_manager_t *manager, const cmdset_preset_t *presets, int count, int fd, cmdset_format_t format);
+int cmdset_complete(const char *prefix, int fd);
+int cmdset_complete_with_ctx(cmdset_ctx_t *ctx, const char *prefix, int fd);
+cmdset_snapshot_t* cmdset_snapshot_acquire(cmdset_manager_t *manager);
+void cmdset_snapshot_release(cmdset_snapshot_t *snapshot);
+unsigned long cmdset_snapshot_version(const cmdset_snapshot_t *snapshot);
+int cmdset_snapshot_count(const cmdset_snapshot_t *snapshot);
+const cmdset_preset_t* cmdset_snapshot_presets(const cmdset_snapshot_t *snapshot);
+const cmdset_preset_t* cmdset_snapshot_find(const cmdset_snapshot_t *snapshot, const char *name);
+int cmdset_snapshot_get_tags(const cmdset_snapshot_t *snapshot, const cmdset_preset_t *preset, const char **tags, int max_tags);
+cmdset_manager_t* cmdset_manager_new(cmdset_ctx_t *ctx);
+void cmdset_manager_free(cmdset_manager_t *manager);
+const cmdset_preset_t* cmdset_snapshot_preset(const cmdset_snapshot_t *snapshot, int index);
+const char* cmdset_preset_name(const cmdset_preset_t *preset, size_t *length);
+const char* cmdset_preset_command(const cmdset_preset_t *preset, size_t *length);
+int cmdset_preset_is_encrypted(const cmdset_preset_t *preset);
+long cmdset_preset_created_at(const cmdset_preset_t *preset);
+long cmdset_preset_last_used(const cmdset_preset_t *preset);
+int cmdset_preset_use_count(const cmdset_preset_t *preset);
+cmdset_preset_t* cmdset_preset_array_new(int count);
+cmdset_preset_t* cmdset_preset_array_at(cmdset_preset_t *array, int index);
+void cmdset_preset_array_free(cmdset_preset_t *array);
+cmdset_search_result_t* cmdset_search_result_array_new(int count);
+const cmdset_preset_t* cmdset_search_result_preset(const cmdset_search_result_t *array, int index);
+int cmdset_search_result_score(const cmdset_search_result_t *array, int index);
+void cmdset_search_result_array_free(cmdset_search_result_t *array);
+cmdset_txn_t* cmdset_txn_begin(cmdset_manager_t *manager);
+int cmdset_txn_add(cmdset_txn_t *txn, const char *name, const char *command, int encrypt);
+int cmdset_txn_remove(cmdset_txn_t *txn, const char *name);
+int cmdset_txn_commit(cmdset_txn_t *txn);
+void cmdset_txn_rollback(cmdset_txn_t *txn);
+int cmdset_set_write_behind(cmdset_manager_t *manager, int delay_ms, int max_pending);
+int cmdset_flush(cmdset_manager_t *manager);
+int cmdset_watch(cmdset_manager_t *manager, int enable);
+int cmdset_refresh(cmdset_manager_t *manager);
+int cmdset_execute_preset_ex(cmdset_manager_t *manager, const char *name, const char *additional_args, int flags);
+int cmdset_set_max_concurrency(cmdset_manager_t *manager, const char *name, int limit);
+int cmdset_get_max_concurrency(cmdset_manager_t *manager, const char *name);
+int cmdset_set_sched_profile(cmdset_manager_t *manager, const char *name, const char *spec);
+int cmdset_get_sched_profile(cmdset_manager_t *manager, const char *name, char *spec, int max_len);
+int cmdset_get_usage(cmdset_manager_t *manager, const char *name, cmdset_usage_t *usage);
+int cmdset_execute_start(cmdset_manager_t *manager, const char *name, const char *additional_args, int flags, cmdset_run_t **run);
+int cmdset_run_pid(const cmdset_run_t *run);
+int cmdset_run_fd(const cmdset_run_t *run);
+int cmdset_run_poll(cmdset_run_t *run, int *status);
+int cmdset_run_wait(cmdset_run_t *run, int *status);
+int cmdset_run_kill(cmdset_run_t *run, int sig);
+void cmdset_run_free(cmdset_run_t *run);
+int cmdset_dump_packed(cmdset_manager_t *manager, void *buffer, size_t size, size_t *needed);
+int cmdset_add_many(cmdset_manager_t *manager, const char *entries, size_t size, int encrypt);
 
 #ifdef __cplusplus
 }
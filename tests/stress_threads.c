@@ -0,0 +1,281 @@
+// Hammers one shared manager from many threads while another churns presets
+// past the store's capacity, so removed slots are reclaimed, and another
+// keeps saving it. Every result is read back and checked. Before that, it
+// checks that merging a write from another manager keeps changes still
+// waiting for write-behind, and that a cursor still sees presets that a
+// compaction moves below it.
+// Build and run with `make stress`; pass the thread and iteration counts to
+// override defaults.
+#define _POSIX_C_SOURCE 200809L
+#include "../cmdset.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STABLE_PRESETS 40
+#define CHURN_BATCH 8
+// MAX_PRESETS in cmdset.c. Each worker holds at most one scratch preset, the
+// churn thread CHURN_BATCH, so every add must succeed while they fit in the
+// slots left over.
+#define STORE_CAPACITY 100
+
+static cmdset_manager_t manager;
+static int iterations = 2000;
+static int executions[STABLE_PRESETS];
+static int failures = 0;
+static int stopping = 0;
+
+static void fail(const char *what, int thread) {
+    fprintf(stderr, "thread %d: %s (%s)\n", thread, what, cmdset_get_last_error());
+    __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+}
+
+static int stable_index(const char *name) {
+    int index;
+    char rest;
+    if (sscanf(name, "stable-%d%c", &index, &rest) != 1 || index < 0 || index >= STABLE_PRESETS) return -1;
+    return index;
+}
+
+static int known_name(const char *name) {
+    return stable_index(name) >= 0 || strncmp(name, "scratch-", 8) == 0 || strncmp(name, "churn-", 6) == 0;
+}
+
+static void *churner(void *arg) {
+    (void)arg;
+    char name[64];
+    for (int round = 0; !__atomic_load_n(&stopping, __ATOMIC_RELAXED); round++) {
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            snprintf(name, sizeof(name), "churn-%d-%d", round, i);
+            if (cmdset_add_preset(&manager, name, "true", 0) != 0) fail("churn add", -1);
+        }
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            snprintf(name, sizeof(name), "churn-%d-%d", round, i);
+            if (cmdset_remove_preset(&manager, name) != 0) fail("churn remove", -1);
+        }
+    }
+    return NULL;
+}
+
+static void *saver(void *arg) {
+    (void)arg;
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+        if (cmdset_save_presets(&manager) != 0) fail("save", -2);
+    }
+    return NULL;
+}
+
+static void *worker(void *arg) {
+    int thread = (int)(long)arg;
+    unsigned int seed = (unsigned int)thread * 7919u + 1;
+    char name[64];
+    char missing[64];
+    snprintf(missing, sizeof(missing), "missing-%d", thread);
+    for (int i = 0; i < iterations; i++) {
+        int target = rand_r(&seed) % STABLE_PRESETS;
+        snprintf(name, sizeof(name), "stable-%d", target);
+        int op = rand_r(&seed) % 100;
+        cmdset_preset_t preset;
+        if (op < 40) {
+            if (cmdset_find_preset(&manager, name, &preset) != 0 || strcmp(preset.name, name) != 0) fail("find", thread);
+        } else if (op < 45) {
+            if (cmdset_find_preset(&manager, missing, &preset) != CMDSET_ERROR_NOT_FOUND) fail("find missing", thread);
+            else if (strcmp(cmdset_get_last_error(), "Preset not found") != 0) fail("thread-local error", thread);
+        } else if (op < 50) {
+            if (cmdset_execute_preset(&manager, name, NULL) != 0) fail("exec", thread);
+            else __atomic_add_fetch(&executions[target], 1, __ATOMIC_RELAXED);
+        } else if (op < 55) {
+            cmdset_preset_t top[10];
+            int count = cmdset_get_top_presets(&manager, 10, top);
+            if (count < 10) fail("top", thread);
+            for (int j = 0; j < count; j++) {
+                if (!known_name(top[j].name)) fail("top name", thread);
+            }
+        } else if (op < 60) {
+            cmdset_preset_t matches[STORE_CAPACITY];
+            int count = cmdset_resolve_prefix(&manager, name, matches, STORE_CAPACITY);
+            if (count != 1 || strcmp(matches[0].name, name) != 0) fail("prefix", thread);
+        } else if (op < 70) {
+            cmdset_search_result_t results[10];
+            int count = cmdset_search(&manager, "stable", results, 10);
+            if (count < 10) fail("search", thread);
+            for (int j = 0; j < count; j++) {
+                if (stable_index(results[j].preset.name) < 0 || results[j].score <= 0) fail("search result", thread);
+            }
+        } else if (op < 75) {
+            cmdset_preset_t matches[STORE_CAPACITY];
+            int count = cmdset_filter_where(&manager, "use_count >= 0 && !encrypt", matches, STORE_CAPACITY);
+            if (count < STABLE_PRESETS) fail("where", thread);
+            for (int j = 0; j < count; j++) {
+                if (!known_name(matches[j].name) || matches[j].encrypt || strcmp(matches[j].command, "true") != 0) fail("where result", thread);
+            }
+        } else if (op < 85) {
+            char tag[32];
+            snprintf(tag, sizeof(tag), "t%d", thread);
+            if (cmdset_tag_preset(&manager, name, tag) != 0) fail("tag", thread);
+            const char *tags[1] = {tag};
+            cmdset_preset_t tagged[STORE_CAPACITY];
+            int count = cmdset_filter_by_tags(&manager, tags, 1, tagged, STORE_CAPACITY);
+            if (count != 1 || strcmp(tagged[0].name, name) != 0) fail("filter tags", thread);
+            char names[STORE_CAPACITY][32];
+            int tag_count = count == 1 ? cmdset_get_preset_tags(&manager, &tagged[0], names, STORE_CAPACITY) : 0;
+            int has_tag = 0;
+            for (int j = 0; j < tag_count; j++) has_tag |= strcmp(names[j], tag) == 0;
+            if (count == 1 && !has_tag) fail("preset tags", thread);
+            if (cmdset_untag_preset(&manager, name, tag) != 0) fail("untag", thread);
+        } else if (op < 95) {
+            cmdset_cursor_t cursor;
+            cmdset_preset_t preset;
+            char seen[STABLE_PRESETS] = {0};
+            int stable = 0;
+            cmdset_cursor_init(&manager, &cursor);
+            while (cmdset_cursor_next(&cursor, &preset) == 1) {
+                int index = stable_index(preset.name);
+                if (!known_name(preset.name)) fail("cursor name", thread);
+                if (index >= 0 && !seen[index]++) stable++;
+            }
+            if (stable < STABLE_PRESETS) fail("cursor", thread);
+        } else {
+            char scratch[64];
+            snprintf(scratch, sizeof(scratch), "scratch-%d-%d", thread, i);
+            if (cmdset_add_preset(&manager, scratch, "true", 0) != 0) fail("add", thread);
+            else if (cmdset_remove_preset(&manager, scratch) != 0) fail("remove", thread);
+        }
+    }
+    return NULL;
+}
+
+// With write-behind holding local changes back, another manager writes the
+// store and this one merges it. The local changes must survive the merge
+// and the save after it.
+static int check_pending_merge(void) {
+    cmdset_manager_t other;
+    if (cmdset_add_preset(&manager, "doomed", "true", 0) != 0 || cmdset_save_presets(&manager) != 0) return 1;
+    if (cmdset_set_write_behind(&manager, 60000, 0) != 0) return 1;
+    if (cmdset_remove_preset(&manager, "doomed") != 0 || cmdset_tag_preset(&manager, "stable-0", "local") != 0 ||
+        cmdset_set_max_concurrency(&manager, "stable-1", 3) != 0) return 1;
+    if (cmdset_init(&other) != 0 || cmdset_load_presets(&other) != 0 || cmdset_add_preset(&other, "external", "true", 0) != 0 ||
+        cmdset_save_presets(&other) != 0) return 1;
+    cmdset_cleanup(&other);
+    if (cmdset_refresh(&manager) != 0) return 1;
+    cmdset_preset_t preset;
+    char tags[4][32];
+    if (cmdset_find_preset(&manager, "doomed", &preset) == 0) fail("merge: removed preset came back", -3);
+    if (cmdset_find_preset(&manager, "external", &preset) != 0) fail("merge: external preset missing", -3);
+    if (cmdset_find_preset(&manager, "stable-0", &preset) != 0 || cmdset_get_preset_tags(&manager, &preset, tags, 4) != 1 ||
+        strcmp(tags[0], "local") != 0) fail("merge: local tag lost", -3);
+    if (cmdset_get_max_concurrency(&manager, "stable-1") != 3) fail("merge: local limit lost", -3);
+    if (cmdset_set_write_behind(&manager, 0, 0) != 0 || cmdset_flush(&manager) != 0) return 1;
+    if (cmdset_init(&other) != 0 || cmdset_load_presets(&other) != 0) return 1;
+    if (cmdset_find_preset(&other, "doomed", &preset) == 0) fail("merge: save brought back removed preset", -3);
+    cmdset_cleanup(&other);
+    if (cmdset_remove_preset(&manager, "external") != 0 || cmdset_untag_preset(&manager, "stable-0", "local") != 0 ||
+        cmdset_set_max_concurrency(&manager, "stable-1", 0) != 0) return 1;
+    return 0;
+}
+
+// Walks past the first of a block of presets that sits above removed slots,
+// then adds until the store is compacted, which moves the block down below
+// the cursor's position. The walk must still see the whole block once.
+static int check_cursor_compaction(void) {
+    enum { BLOCK = 20 };
+    char name[64];
+    for (int i = 0; i < BLOCK; i++) {
+        snprintf(name, sizeof(name), "low-%d", i);
+        if (cmdset_add_preset(&manager, name, "true", 0) != 0) return 1;
+    }
+    for (int i = 0; i < BLOCK; i++) {
+        snprintf(name, sizeof(name), "high-%d", i);
+        if (cmdset_add_preset(&manager, name, "true", 0) != 0) return 1;
+    }
+    cmdset_cursor_t cursor;
+    cmdset_preset_t preset;
+    char seen[BLOCK] = {0};
+    int index;
+    cmdset_cursor_init(&manager, &cursor);
+    while (cmdset_cursor_next(&cursor, &preset) == 1 && strcmp(preset.name, "high-0") != 0) continue;
+    seen[0] = strcmp(preset.name, "high-0") == 0;
+    for (int i = 0; i < BLOCK; i++) {
+        snprintf(name, sizeof(name), "low-%d", i);
+        if (cmdset_remove_preset(&manager, name) != 0) return 1;
+    }
+    int filled = 0;
+    for (int slots = manager.count; manager.count >= slots; filled++) {
+        slots = manager.count;
+        snprintf(name, sizeof(name), "fill-%d", filled);
+        if (cmdset_add_preset(&manager, name, "true", 0) != 0) return 1;
+    }
+    while (cmdset_cursor_next(&cursor, &preset) == 1) {
+        if (sscanf(preset.name, "high-%d", &index) == 1 && index >= 0 && index < BLOCK && seen[index]++) fail("cursor: preset seen twice", -4);
+    }
+    for (int i = 0; i < BLOCK; i++) {
+        if (!seen[i]) fail("cursor: moved preset skipped", -4);
+        snprintf(name, sizeof(name), "high-%d", i);
+        if (cmdset_remove_preset(&manager, name) != 0) return 1;
+    }
+    for (int i = 0; i < filled; i++) {
+        snprintf(name, sizeof(name), "fill-%d", i);
+        if (cmdset_remove_preset(&manager, name) != 0) return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (argc > 2) iterations = atoi(argv[2]);
+    if (threads < 1 || threads > STORE_CAPACITY - STABLE_PRESETS - CHURN_BATCH) {
+        fprintf(stderr, "threads must be between 1 and %d\n", STORE_CAPACITY - STABLE_PRESETS - CHURN_BATCH);
+        return 1;
+    }
+    char directory[] = "/tmp/cmdset-stress-XXXXXX";
+    if (mkdtemp(directory) == NULL || chdir(directory) != 0) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (cmdset_init(&manager) != 0) return 1;
+    for (int i = 0; i < STABLE_PRESETS; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "stable-%d", i);
+        if (cmdset_add_preset(&manager, name, "true", 0) != 0) return 1;
+    }
+    if (check_pending_merge() != 0) {
+        fail("merge setup", -3);
+        return 1;
+    }
+    if (check_cursor_compaction() != 0) {
+        fail("cursor setup", -4);
+        return 1;
+    }
+    pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+    if (ids == NULL) return 1;
+    pthread_t churn, save;
+    pthread_create(&churn, NULL, churner, NULL);
+    pthread_create(&save, NULL, saver, NULL);
+    for (int i = 0; i < threads; i++) pthread_create(&ids[i], NULL, worker, (void *)(long)i);
+    for (int i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+    pthread_join(churn, NULL);
+    pthread_join(save, NULL);
+    free(ids);
+    for (int i = 0; i < STABLE_PRESETS; i++) {
+        char name[64];
+        cmdset_preset_t preset;
+        snprintf(name, sizeof(name), "stable-%d", i);
+        if (cmdset_find_preset(&manager, name, &preset) != 0 || preset.use_count != executions[i]) {
+            fprintf(stderr, "%s: use_count %d, expected %d\n", name, preset.use_count, executions[i]);
+            failures++;
+        }
+    }
+    cmdset_cleanup(&manager);
+    const char *files[] = {".cmdset_presets", ".cmdset_presets.idx", ".cmdset_presets.complete"};
+    for (int i = 0; i < 3; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%s", directory, files[i]);
+        unlink(path);
+    }
+    rmdir(directory);
+    printf("%d threads x %d iterations: %s\n", threads, iterations, failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
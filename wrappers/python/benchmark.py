@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Compare the ctypes wrapper (cmdset.CmdSet) with the native extension
+(cmdset.Manager, built by `make python-ext`) on the operations applications
+use most.
+
+    python3 wrappers/python/benchmark.py [--sizes 10,100] [--repeat 5] [--json]
+
+Each binding gets its own store in a temporary directory, filled with the
+given number of presets before timing starts. Every figure is the best of
+--repeat rounds, per call. add-many adds the whole store in one call.
+"""
+import argparse
+import json
+import os
+import shutil
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import cmdset
+
+OPERATIONS = ["init", "list", "find", "add-many", "exec-noop"]
+NOOP = "noop"
+
+
+class Store:
+    """A scratch directory holding a store; both bindings use the default store path in it."""
+    def __enter__(self):
+        self.previous = os.getcwd()
+        self.path = tempfile.mkdtemp(prefix="cmdset-bench-")
+        os.chdir(self.path)
+        return self
+
+    def __exit__(self, *exc):
+        os.chdir(self.previous)
+        shutil.rmtree(self.path, ignore_errors=True)
+        return False
+
+
+def presets(size):
+    return [(f"preset-{i:06d}", f"echo {i}") for i in range(size - 1)] + [(NOOP, "true")]
+
+
+def best(function, number, repeat):
+    times = []
+    for _ in range(repeat):
+        start = time.perf_counter()
+        for _ in range(number):
+            function()
+        times.append((time.perf_counter() - start) / number)
+    return min(times)
+
+
+def run(factory, size, repeat):
+    entries = presets(size)
+    names = [name for name, _ in entries]
+    results = {}
+    times = []
+    for _ in range(repeat):
+        with Store():
+            manager = factory()
+            start = time.perf_counter()
+            manager.add_many(entries)
+            times.append(time.perf_counter() - start)
+            manager.close()
+    results["add-many"] = min(times)
+    with Store():
+        manager = factory()
+        manager.add_many(entries)
+        results["init"] = best(lambda: factory().close(), 20, repeat)
+        results["list"] = best(manager.list, 50, repeat)
+        results["find"] = best(lambda: [manager.find(name) for name in names], 1, repeat) / len(names)
+        results["exec-noop"] = best(lambda: manager.exec(NOOP), 10, repeat)
+        manager.close()
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the cmdset Python bindings")
+    parser.add_argument("--sizes", default="10,100", help="comma-separated store sizes (default: 10,100)")
+    parser.add_argument("--repeat", type=int, default=5, help="rounds per measurement (default: 5)")
+    parser.add_argument("--json", action="store_true", help="print results as JSON for tracking regressions")
+    options = parser.parse_args()
+
+    bindings = {"ctypes": cmdset.CmdSet}
+    if hasattr(cmdset, "Manager"):
+        bindings["native"] = cmdset.Manager
+    else:
+        print("native extension not built; run `make python-ext` to compare it", file=sys.stderr)
+
+    rows = []
+    for size in (int(size) for size in options.sizes.split(",")):
+        try:
+            results = {name: run(factory, size, options.repeat) for name, factory in bindings.items()}
+        except RuntimeError as error:
+            print(f"skipping {size} presets: {error}", file=sys.stderr)
+            continue
+        for operation in OPERATIONS:
+            rows += [{"operation": operation, "presets": size, "binding": name, "seconds": results[name][operation]}
+                     for name in bindings]
+
+    if options.json:
+        print(json.dumps(rows, indent=2))
+        return
+    names = list(bindings)
+    header = f"{'operation':<10} {'presets':>8}" + "".join(f" {name + ' (us)':>13}" for name in names)
+    if len(names) == 2:
+        header += f" {'ctypes/native':>14}"
+    print(header)
+    for index in range(0, len(rows), len(names)):
+        group = rows[index:index + len(names)]
+        line = f"{group[0]['operation']:<10} {group[0]['presets']:>8}"
+        line += "".join(f" {row['seconds'] * 1e6:>13.1f}" for row in group)
+        if len(group) == 2:
+            line += f" {group[0]['seconds'] / group[1]['seconds']:>14.2f}"
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,26 +1,9 @@
 import os
 import sys
 import ctypes
-from ctypes import c_int, c_char_p, c_long, c_void_p, Structure
-
-
-class CmdsetPreset(Structure):
-    _fields_ = [
-        ("name", ctypes.c_char * 50),
-        ("command", ctypes.c_char * 500),
-        ("active", c_int),
-        ("encrypt", c_int),
-        ("created_at", c_long),
-        ("last_used", c_long),
-        ("use_count", c_int),
-    ]
-
-
-class CmdsetManager(Structure):
-    _fields_ = [
-        ("presets", CmdsetPreset * 100),
-        ("count", c_int),
-    ]
+import struct
+import weakref
+from ctypes import c_int, c_char_p, c_long, c_size_t, c_void_p
 
 
 class Preset:
@@ -53,6 +36,19 @@ class Preset:
         return f"Preset(name='{self.name}', command='{self.command[:30]}...', encrypted={self.encrypt})"
 
 
+# Return codes from cmdset.h
+CMDSET_SUCCESS = 0
+CMDSET_ERROR_MEMORY = -1
+CMDSET_ERROR_FILE = -2
+CMDSET_ERROR_NOT_FOUND = -3
+CMDSET_ERROR_EXISTS = -4
+CMDSET_ERROR_INVALID = -5
+CMDSET_ERROR_ENCRYPTION = -6
+CMDSET_ERROR_JSON = -7
+CMDSET_ERROR_TRUNCATED = -8
+CMDSET_ERROR_BUSY = -9
+
+
 class CmdSetError(Exception):
     pass
 
@@ -90,42 +86,185 @@ _lib_path = _find_library_path()
 _lib = ctypes.CDLL(_lib_path)
 
 
-# Function prototypes
-_lib.cmdset_init.argtypes = [ctypes.POINTER(CmdsetManager)]
-_lib.cmdset_init.restype = c_int
+# Function prototypes. Managers and presets are opaque handles: only the
+# accessor functions know their layout.
+_lib.cmdset_manager_new.argtypes = [c_void_p]
+_lib.cmdset_manager_new.restype = c_void_p
+
+_lib.cmdset_manager_free.argtypes = [c_void_p]
+_lib.cmdset_manager_free.restype = None
 
-_lib.cmdset_add_preset.argtypes = [ctypes.POINTER(CmdsetManager), c_char_p, c_char_p, c_int]
+_lib.cmdset_add_preset.argtypes = [c_void_p, c_char_p, c_char_p, c_int]
 _lib.cmdset_add_preset.restype = c_int
 
-_lib.cmdset_remove_preset.argtypes = [ctypes.POINTER(CmdsetManager), c_char_p]
+_lib.cmdset_remove_preset.argtypes = [c_void_p, c_char_p]
 _lib.cmdset_remove_preset.restype = c_int
 
-_lib.cmdset_execute_preset.argtypes = [ctypes.POINTER(CmdsetManager), c_char_p, c_char_p]
+_lib.cmdset_execute_preset.argtypes = [c_void_p, c_char_p, c_char_p]
 _lib.cmdset_execute_preset.restype = c_int
 
 _lib.cmdset_get_error_message.argtypes = [c_int]
 _lib.cmdset_get_error_message.restype = c_char_p
 
-_lib.cmdset_cleanup.argtypes = [ctypes.POINTER(CmdsetManager)]
-_lib.cmdset_cleanup.restype = None
+_lib.cmdset_get_last_error.argtypes = []
+_lib.cmdset_get_last_error.restype = c_char_p
 
-_lib.cmdset_get_preset_count.argtypes = [ctypes.POINTER(CmdsetManager)]
+_lib.cmdset_get_preset_count.argtypes = [c_void_p]
 _lib.cmdset_get_preset_count.restype = c_int
 
-_lib.cmdset_get_preset_by_index.argtypes = [ctypes.POINTER(CmdsetManager), c_int, ctypes.POINTER(CmdsetPreset)]
-_lib.cmdset_get_preset_by_index.restype = c_int
+_lib.cmdset_snapshot_acquire.argtypes = [c_void_p]
+_lib.cmdset_snapshot_acquire.restype = c_void_p
+
+_lib.cmdset_snapshot_release.argtypes = [c_void_p]
+_lib.cmdset_snapshot_release.restype = None
+
+_lib.cmdset_snapshot_count.argtypes = [c_void_p]
+_lib.cmdset_snapshot_count.restype = c_int
+
+_lib.cmdset_snapshot_preset.argtypes = [c_void_p, c_int]
+_lib.cmdset_snapshot_preset.restype = c_void_p
+
+_lib.cmdset_snapshot_find.argtypes = [c_void_p, c_char_p]
+_lib.cmdset_snapshot_find.restype = c_void_p
+
+_lib.cmdset_query_compile.argtypes = [c_char_p, ctypes.POINTER(c_void_p)]
+_lib.cmdset_query_compile.restype = c_int
+
+_lib.cmdset_query_match.argtypes = [c_void_p, c_void_p]
+_lib.cmdset_query_match.restype = c_int
+
+_lib.cmdset_query_free.argtypes = [c_void_p]
+_lib.cmdset_query_free.restype = None
+
+for _name in ("cmdset_preset_name", "cmdset_preset_command"):
+    getattr(_lib, _name).argtypes = [c_void_p, ctypes.POINTER(c_size_t)]
+    getattr(_lib, _name).restype = ctypes.POINTER(ctypes.c_char)
+
+_lib.cmdset_txn_begin.argtypes = [c_void_p]
+_lib.cmdset_txn_begin.restype = c_void_p
+
+_lib.cmdset_txn_add.argtypes = [c_void_p, c_char_p, c_char_p, c_int]
+_lib.cmdset_txn_add.restype = c_int
+
+_lib.cmdset_txn_remove.argtypes = [c_void_p, c_char_p]
+_lib.cmdset_txn_remove.restype = c_int
+
+_lib.cmdset_txn_commit.argtypes = [c_void_p]
+_lib.cmdset_txn_commit.restype = c_int
+
+_lib.cmdset_txn_rollback.argtypes = [c_void_p]
+_lib.cmdset_txn_rollback.restype = None
+
+_lib.cmdset_set_write_behind.argtypes = [c_void_p, c_int, c_int]
+_lib.cmdset_set_write_behind.restype = c_int
+
+_lib.cmdset_flush.argtypes = [c_void_p]
+_lib.cmdset_flush.restype = c_int
+
+_lib.cmdset_watch.argtypes = [c_void_p, c_int]
+_lib.cmdset_watch.restype = c_int
+
+_lib.cmdset_refresh.argtypes = [c_void_p]
+_lib.cmdset_refresh.restype = c_int
+
+_lib.cmdset_execute_preset_ex.argtypes = [c_void_p, c_char_p, c_char_p, c_int]
+_lib.cmdset_execute_preset_ex.restype = c_int
+
+_lib.cmdset_set_max_concurrency.argtypes = [c_void_p, c_char_p, c_int]
+_lib.cmdset_set_max_concurrency.restype = c_int
+
+_lib.cmdset_get_max_concurrency.argtypes = [c_void_p, c_char_p]
+_lib.cmdset_get_max_concurrency.restype = c_int
+
+_lib.cmdset_set_sched_profile.argtypes = [c_void_p, c_char_p, c_char_p]
+_lib.cmdset_set_sched_profile.restype = c_int
+
+_lib.cmdset_get_sched_profile.argtypes = [c_void_p, c_char_p, c_char_p, c_int]
+_lib.cmdset_get_sched_profile.restype = c_int
+
+
+class _Usage(ctypes.Structure):
+    _fields_ = [
+        ("runs", c_long),
+        ("wall_seconds", ctypes.c_double),
+        ("user_seconds", ctypes.c_double),
+        ("system_seconds", ctypes.c_double),
+        ("last_wall_seconds", ctypes.c_double),
+        ("max_rss_kb", c_long),
+        ("in_blocks", c_long),
+        ("out_blocks", c_long),
+    ]
+
+
+_lib.cmdset_get_usage.argtypes = [c_void_p, c_char_p, ctypes.POINTER(_Usage)]
+_lib.cmdset_get_usage.restype = c_int
+
+_lib.cmdset_dump_packed.argtypes = [c_void_p, c_void_p, c_size_t, ctypes.POINTER(c_size_t)]
+_lib.cmdset_dump_packed.restype = c_int
+
+_lib.cmdset_add_many.argtypes = [c_void_p, c_char_p, c_size_t, c_int]
+_lib.cmdset_add_many.restype = c_int
+
+# Mirrors cmdset_packed_preset_t: four text offsets and lengths, then
+# created_at, last_used, use_count and encrypt, in native layout.
+_PACKED_RECORD = struct.Struct("@IIIIllii")
+
+_lib.cmdset_preset_is_encrypted.argtypes = [c_void_p]
+_lib.cmdset_preset_is_encrypted.restype = c_int
+
+_lib.cmdset_preset_created_at.argtypes = [c_void_p]
+_lib.cmdset_preset_created_at.restype = c_long
+
+_lib.cmdset_preset_last_used.argtypes = [c_void_p]
+_lib.cmdset_preset_last_used.restype = c_long
+
+_lib.cmdset_preset_use_count.argtypes = [c_void_p]
+_lib.cmdset_preset_use_count.restype = c_int
+
+
+def _text(function, preset):
+    length = c_size_t()
+    data = function(preset, ctypes.byref(length))
+    return ctypes.string_at(data, length.value).decode("utf-8")
+
+
+def _preset_from_handle(preset):
+    return Preset({
+        "name": _text(_lib.cmdset_preset_name, preset),
+        "command": _text(_lib.cmdset_preset_command, preset),
+        "encrypt": bool(_lib.cmdset_preset_is_encrypted(preset)),
+        "created_at": int(_lib.cmdset_preset_created_at(preset)),
+        "last_used": int(_lib.cmdset_preset_last_used(preset)),
+        "use_count": int(_lib.cmdset_preset_use_count(preset)),
+    })
+
+def _presets_from_packed(data, count):
+    records = memoryview(data)[:count * _PACKED_RECORD.size]
+    return [
+        Preset({
+            "name": data[name_offset:name_offset + name_length].decode("utf-8"),
+            "command": data[command_offset:command_offset + command_length].decode("utf-8"),
+            "encrypt": bool(encrypt),
+            "created_at": created_at,
+            "last_used": last_used,
+            "use_count": use_count,
+        })
+        for name_offset, name_length, command_offset, command_length, created_at, last_used, use_count, encrypt
+        in _PACKED_RECORD.iter_unpack(records)
+    ]
 
 class CmdSet:
     def __init__(self):
-        self._manager = CmdsetManager()
-        rc = _lib.cmdset_init(ctypes.byref(self._manager))
-        if rc != 0:
-            msg = _lib.cmdset_get_error_message(rc)
-            raise RuntimeError(msg.decode("utf-8") if msg else "cmdset_init failed")
+        self._packed_size = 4096
+        self._transactions = weakref.WeakSet()
+        self._manager = _lib.cmdset_manager_new(None)
+        if not self._manager:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "cmdset_manager_new failed")
 
     def add(self, name: str, command: str, encrypt: bool = False) -> None:
         rc = _lib.cmdset_add_preset(
-            ctypes.byref(self._manager),
+            self._manager,
             name.encode("utf-8"),
             command.encode("utf-8"),
             1 if encrypt else 0,
@@ -134,44 +273,162 @@ class CmdSet:
             msg = _lib.cmdset_get_error_message(rc)
             raise RuntimeError(msg.decode("utf-8") if msg else "add_preset failed")
 
+    def add_many(self, presets, encrypt: bool = False) -> int:
+        """Add (name, command) pairs in one call; either all of them are added or none"""
+        parts = []
+        for name, command in presets:
+            parts += [name.encode("utf-8"), command.encode("utf-8")]
+        if any(b"\0" in part for part in parts):
+            raise ValueError("Names and commands cannot contain NUL characters")
+        entries = b"".join(part + b"\0" for part in parts)
+        rc = _lib.cmdset_add_many(self._manager, entries, len(entries), 1 if encrypt else 0)
+        if rc < 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "add_many failed")
+        return int(rc)
+
     def list(self):
         """List all presets as Preset objects"""
-        count = _lib.cmdset_get_preset_count(ctypes.byref(self._manager))
-        result = []
-        for i in range(count):
-            preset = CmdsetPreset()
-            rc = _lib.cmdset_get_preset_by_index(ctypes.byref(self._manager), i, ctypes.byref(preset))
-            if rc == 0:
-                preset_data = {
-                    "name": preset.name.decode("utf-8").rstrip("\x00"),
-                    "command": preset.command.decode("utf-8").rstrip("\x00"),
-                    "encrypt": bool(preset.encrypt),
-                    "created_at": int(preset.created_at),
-                    "last_used": int(preset.last_used),
-                    "use_count": int(preset.use_count),
-                }
-                result.append(Preset(preset_data))
-        return result
-
-    def exec(self, name: str, additional_args: str = None) -> int:
-        rc = _lib.cmdset_execute_preset(
-            ctypes.byref(self._manager),
+        needed = c_size_t()
+        while True:
+            buffer = ctypes.create_string_buffer(self._packed_size)
+            rc = _lib.cmdset_dump_packed(self._manager, buffer, len(buffer), ctypes.byref(needed))
+            if rc >= 0:
+                return _presets_from_packed(buffer.raw[:needed.value], rc)
+            if rc != CMDSET_ERROR_TRUNCATED:
+                msg = _lib.cmdset_get_last_error()
+                raise RuntimeError(msg.decode("utf-8") if msg else "dump_packed failed")
+            # The store may grow between calls, so leave some room.
+            self._packed_size = needed.value + needed.value // 4
+
+    def find(self, name: str):
+        """Return the named Preset, or None if there is no such preset"""
+        snapshot = _lib.cmdset_snapshot_acquire(self._manager)
+        if not snapshot:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "snapshot_acquire failed")
+        try:
+            preset = _lib.cmdset_snapshot_find(snapshot, name.encode("utf-8"))
+            return _preset_from_handle(preset) if preset else None
+        finally:
+            _lib.cmdset_snapshot_release(snapshot)
+
+    def where(self, expression: str):
+        """List presets matching a filter such as 'use_count > 10 && !encrypt'"""
+        query = c_void_p()
+        if _lib.cmdset_query_compile(expression.encode("utf-8"), ctypes.byref(query)) != 0:
+            msg = _lib.cmdset_get_last_error()
+            raise ValueError(msg.decode("utf-8") if msg else "query_compile failed")
+        try:
+            # Presets are matched and copied while the snapshot keeps them alive.
+            snapshot = _lib.cmdset_snapshot_acquire(self._manager)
+            if not snapshot:
+                msg = _lib.cmdset_get_last_error()
+                raise RuntimeError(msg.decode("utf-8") if msg else "snapshot_acquire failed")
+            try:
+                presets = (_lib.cmdset_snapshot_preset(snapshot, i) for i in range(_lib.cmdset_snapshot_count(snapshot)))
+                return [_preset_from_handle(preset) for preset in presets if _lib.cmdset_query_match(query, preset) == 1]
+            finally:
+                _lib.cmdset_snapshot_release(snapshot)
+        finally:
+            _lib.cmdset_query_free(query)
+
+    def transaction(self) -> "Transaction":
+        """Stage adds and removes that are validated together and saved in one write"""
+        return Transaction(self)
+
+    def write_behind(self, delay_ms: int, max_pending: int = 0) -> None:
+        """Save changes from a background thread after delay_ms, or once max_pending pile up; 0 turns it off"""
+        rc = _lib.cmdset_set_write_behind(self._manager, delay_ms, max_pending)
+        if rc != 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "set_write_behind failed")
+
+    def flush(self) -> None:
+        """Save pending changes now"""
+        rc = _lib.cmdset_flush(self._manager)
+        if rc != 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "flush failed")
+
+    def watch(self, enable: bool = True) -> None:
+        """Merge writes to the preset file by other processes as they happen"""
+        rc = _lib.cmdset_watch(self._manager, 1 if enable else 0)
+        if rc != 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "watch failed")
+
+    def refresh(self) -> None:
+        """Merge the preset file into this instance once"""
+        rc = _lib.cmdset_refresh(self._manager)
+        if rc != 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "refresh failed")
+
+    def exec(self, name: str, additional_args: str = None, wait: bool = True) -> int:
+        """Run a preset; with wait=False a preset at its limit raises instead"""
+        rc = _lib.cmdset_execute_preset_ex(
+            self._manager,
             name.encode("utf-8"),
             None if additional_args is None else additional_args.encode("utf-8"),
+            0 if wait else 1,
         )
         if rc < 0:
             msg = _lib.cmdset_get_error_message(rc)
             raise RuntimeError(msg.decode("utf-8") if msg else "execute_preset failed")
         return int(rc)
 
+    def set_max_concurrency(self, name: str, limit: int) -> None:
+        """Allow at most limit overlapping runs of a preset (0 = unlimited)"""
+        rc = _lib.cmdset_set_max_concurrency(self._manager, name.encode("utf-8"), limit)
+        if rc != 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "set_max_concurrency failed")
+
+    def max_concurrency(self, name: str) -> int:
+        rc = _lib.cmdset_get_max_concurrency(self._manager, name.encode("utf-8"))
+        if rc < 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "get_max_concurrency failed")
+        return int(rc)
+
+    def set_sched_profile(self, name: str, spec: str) -> None:
+        """Set e.g. "cpus=0-3 nice=10 io=idle"; an empty spec restores defaults"""
+        rc = _lib.cmdset_set_sched_profile(self._manager, name.encode("utf-8"), spec.encode("utf-8"))
+        if rc != 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "set_sched_profile failed")
+
+    def sched_profile(self, name: str) -> str:
+        buf = ctypes.create_string_buffer(4096)
+        rc = _lib.cmdset_get_sched_profile(self._manager, name.encode("utf-8"), buf, len(buf))
+        if rc != 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "get_sched_profile failed")
+        return buf.value.decode("utf-8")
+
+    def usage(self, name: str) -> dict:
+        """Resources used by every recorded run of a preset"""
+        usage = _Usage()
+        rc = _lib.cmdset_get_usage(self._manager, name.encode("utf-8"), ctypes.byref(usage))
+        if rc != 0:
+            msg = _lib.cmdset_get_last_error()
+            raise RuntimeError(msg.decode("utf-8") if msg else "get_usage failed")
+        return {field: getattr(usage, field) for field, _ in _Usage._fields_}
+
     def remove(self, name: str) -> None:
-        rc = _lib.cmdset_remove_preset(ctypes.byref(self._manager), name.encode("utf-8"))
+        rc = _lib.cmdset_remove_preset(self._manager, name.encode("utf-8"))
         if rc != 0:
             msg = _lib.cmdset_get_error_message(rc)
             raise RuntimeError(msg.decode("utf-8") if msg else "remove_preset failed")
 
     def close(self) -> None:
-        _lib.cmdset_cleanup(ctypes.byref(self._manager))
+        """Free the manager; open transactions are rolled back first"""
+        for txn in list(getattr(self, "_transactions", ())):
+            txn.rollback()
+        if self._manager:
+            _lib.cmdset_manager_free(self._manager)
+            self._manager = None
 
     def __del__(self):
         try:
@@ -179,4 +436,121 @@ class CmdSet:
         except Exception:
             pass
 
-__all__ = ["CmdSet"]
+
+class Transaction:
+    """A batch of adds and removes. As a context manager it commits when the
+    block succeeds and rolls back when it raises; a failed commit leaves the
+    store untouched. It keeps its CmdSet alive; closing the CmdSet rolls it
+    back."""
+    def __init__(self, cmdset: CmdSet):
+        if not cmdset._manager:
+            raise RuntimeError("CmdSet is closed")
+        self._cmdset = cmdset
+        self._txn = _lib.cmdset_txn_begin(cmdset._manager)
+        if not self._txn:
+            self._raise("txn_begin failed")
+        cmdset._transactions.add(self)
+
+    @staticmethod
+    def _raise(fallback: str):
+        msg = _lib.cmdset_get_last_error()
+        raise RuntimeError(msg.decode("utf-8") if msg else fallback)
+
+    def _handle(self):
+        if not self._txn or not self._cmdset._manager:
+            raise RuntimeError("transaction is closed")
+        return self._txn
+
+    def add(self, name: str, command: str, encrypt: bool = False) -> None:
+        rc = _lib.cmdset_txn_add(self._handle(), name.encode("utf-8"), command.encode("utf-8"), 1 if encrypt else 0)
+        if rc != 0:
+            self._raise("txn_add failed")
+
+    def remove(self, name: str) -> None:
+        rc = _lib.cmdset_txn_remove(self._handle(), name.encode("utf-8"))
+        if rc != 0:
+            self._raise("txn_remove failed")
+
+    def commit(self) -> None:
+        if not self._cmdset._manager:
+            raise RuntimeError("transaction is closed")
+        txn, self._txn = self._txn, None
+        self._cmdset._transactions.discard(self)
+        if txn and _lib.cmdset_txn_commit(txn) != 0:
+            self._raise("txn_commit failed")
+
+    def rollback(self) -> None:
+        txn, self._txn = self._txn, None
+        self._cmdset._transactions.discard(self)
+        if txn and self._cmdset._manager:
+            _lib.cmdset_txn_rollback(txn)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc, tb):
+        if exc_type is None:
+            self.commit()
+        else:
+            self.rollback()
+        return False
+
+    def __del__(self):
+        try:
+            self.rollback()
+        except Exception:
+            pass
+
+__all__ = ["CmdSet", "Transaction"]
+
+
+try:
+    # Native Manager type, available once `make python-ext` has been run.
+    import asyncio
+    from _cmdset import BusyError, Manager as _NativeManager, Run, Snapshot
+
+    class Manager(_NativeManager):
+        async def exec_async(self, name: str, args: str = None, wait: bool = True) -> int:
+            """Run a preset without blocking the event loop and return its wait status.
+
+            The command's pidfd is watched by the running loop, so many presets can be
+            awaited at once. A full concurrency limit is retried unless wait is False.
+            Cancelling the task kills the command.
+            """
+            loop = asyncio.get_running_loop()
+            delay = 0.01
+            while True:
+                try:
+                    run = self.start(name, args, wait=False)
+                    break
+                except BusyError:
+                    if not wait:
+                        raise
+                    await asyncio.sleep(delay)
+                    delay = min(delay * 2, 0.2)
+            fd = run.fileno()
+            if fd >= 0:
+                exited = loop.create_future()
+                try:
+                    loop.add_reader(fd, lambda: exited.done() or exited.set_result(None))
+                except NotImplementedError:
+                    fd = -1
+                else:
+                    try:
+                        await exited
+                    except asyncio.CancelledError:
+                        run.kill()
+                        run.wait()
+                        raise
+                    finally:
+                        loop.remove_reader(fd)
+                    return run.wait()
+            try:
+                return await loop.run_in_executor(None, run.wait)
+            except asyncio.CancelledError:
+                run.kill()
+                raise
+
+    __all__ += ["BusyError", "Manager", "Run", "Snapshot"]
+except ImportError:
+    pass
@@ -1,117 +1,981 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <stddef.h>
+#include <signal.h>
+#define CMDSET_OPAQUE
 #include "cmdset.h"
 
-static PyObject* py_cmdset_init(PyObject* self, PyObject* args) {
-    cmdset_manager_t* manager = (cmdset_manager_t*)malloc(sizeof(cmdset_manager_t));
-    if (!manager) {
-        PyErr_SetString(PyExc_RuntimeError, "Memory allocation failed");
+// A preset copied out of a snapshot. The name and command are kept as raw
+// bytes after the fixed fields and only turned into str objects when read.
+typedef struct {
+    PyObject_VAR_HEAD
+    PyObject* name;
+    PyObject* command;
+    Py_ssize_t name_length;
+    Py_ssize_t command_length;
+    int encrypt;
+    long created_at;
+    long last_used;
+    int use_count;
+    char text[1];
+} PresetObject;
+
+// Calls that drop the GIL count themselves in users, so a close() from
+// another thread only marks the manager and the last call frees it.
+typedef struct {
+    PyObject_HEAD
+    cmdset_manager_t* manager;
+    cmdset_ctx_t* ctx;
+    int users;
+    int closing;
+} ManagerObject;
+
+// A started preset. It counts as a user of its manager until it is freed.
+typedef struct {
+    PyObject_HEAD
+    ManagerObject* owner;
+    cmdset_run_t* run;
+    int waiting;
+} RunObject;
+
+// The names and commands of one store snapshot, copied once into flat, a
+// single block laid out as described in the README: name offsets, command
+// offsets (count + 1 native uint32 each), then the names and the commands
+// back to back without NULs. The store snapshot is released as soon as it is
+// copied, so this holds no reader slot. The buffer protocol exports the
+// block and every view is a slice of base, a memoryview over it, so the
+// block lives until release() and until every view is gone.
+typedef struct {
+    PyObject_HEAD
+    unsigned long version;
+    Py_ssize_t count;
+    char* flat;
+    Py_ssize_t flat_size;
+    PyObject* base;
+    PyObject* regions[4];
+    Py_ssize_t exports;
+    int released;
+} SnapshotObject;
+
+enum { REGION_NAME_OFFSETS, REGION_COMMAND_OFFSETS, REGION_NAMES, REGION_COMMANDS };
+
+typedef struct {
+    PyObject* list;
+    const cmdset_query_t* query;
+    int failed;
+} collect_t;
+
+static PyTypeObject PresetType;
+static PyTypeObject ManagerType;
+static PyTypeObject RunType;
+static PyTypeObject SnapshotType;
+static PyObject* BusyError;
+
+#define PRESET_FIELD_COUNT 6
+
+static PyObject* raise_last_error(PyObject* type, const char* fallback) {
+    const char* message = cmdset_get_last_error();
+    PyErr_SetString(type, message != NULL && message[0] != '\0' ? message : fallback);
+    return NULL;
+}
+
+static PyObject* raise_result(int result, const char* fallback) {
+    return raise_last_error(result == CMDSET_ERROR_BUSY ? BusyError : PyExc_RuntimeError, fallback);
+}
+
+static PyObject* preset_new(const cmdset_preset_t* preset) {
+    size_t name_length;
+    size_t command_length;
+    const char* name = cmdset_preset_name(preset, &name_length);
+    const char* command = cmdset_preset_command(preset, &command_length);
+    PresetObject* self = PyObject_NewVar(PresetObject, &PresetType, name_length + command_length + 2);
+    if (!self) return NULL;
+    self->name = NULL;
+    self->command = NULL;
+    self->name_length = name_length;
+    self->command_length = command_length;
+    memcpy(self->text, name, name_length + 1);
+    memcpy(self->text + name_length + 1, command, command_length + 1);
+    self->encrypt = cmdset_preset_is_encrypted(preset);
+    self->created_at = cmdset_preset_created_at(preset);
+    self->last_used = cmdset_preset_last_used(preset);
+    self->use_count = cmdset_preset_use_count(preset);
+    return (PyObject*)self;
+}
+
+static void preset_dealloc(PresetObject* self) {
+    Py_XDECREF(self->name);
+    Py_XDECREF(self->command);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* preset_get_name(PresetObject* self, void* closure) {
+    (void)closure;
+    if (!self->name) self->name = PyUnicode_DecodeUTF8(self->text, self->name_length, "surrogateescape");
+    Py_XINCREF(self->name);
+    return self->name;
+}
+
+static PyObject* preset_get_command(PresetObject* self, void* closure) {
+    (void)closure;
+    if (!self->command) self->command = PyUnicode_DecodeUTF8(self->text + self->name_length + 1, self->command_length, "surrogateescape");
+    Py_XINCREF(self->command);
+    return self->command;
+}
+
+static PyObject* preset_get_encrypt(PresetObject* self, void* closure) {
+    (void)closure;
+    return PyBool_FromLong(self->encrypt);
+}
+
+static PyObject* preset_get_created_at(PresetObject* self, void* closure) {
+    (void)closure;
+    return PyLong_FromLong(self->created_at);
+}
+
+static PyObject* preset_get_last_used(PresetObject* self, void* closure) {
+    (void)closure;
+    return PyLong_FromLong(self->last_used);
+}
+
+static PyObject* preset_get_use_count(PresetObject* self, void* closure) {
+    (void)closure;
+    return PyLong_FromLong(self->use_count);
+}
+
+static PyGetSetDef preset_getset[] = {
+    {"name", (getter)preset_get_name, NULL, "Preset name", NULL},
+    {"command", (getter)preset_get_command, NULL, "Command, still encrypted for encrypted presets", NULL},
+    {"encrypt", (getter)preset_get_encrypt, NULL, "Whether the command is encrypted", NULL},
+    {"created_at", (getter)preset_get_created_at, NULL, "Creation time (Unix seconds)", NULL},
+    {"last_used", (getter)preset_get_last_used, NULL, "Last execution time (Unix seconds, 0 if never)", NULL},
+    {"use_count", (getter)preset_get_use_count, NULL, "Number of executions", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+// Presets unpack and index like a namedtuple in field order.
+static Py_ssize_t preset_length(PyObject* self) {
+    (void)self;
+    return PRESET_FIELD_COUNT;
+}
+
+static PyObject* preset_item(PyObject* self, Py_ssize_t index) {
+    if (index < 0 || index >= PRESET_FIELD_COUNT) {
+        PyErr_SetString(PyExc_IndexError, "Preset index out of range");
         return NULL;
     }
-    int result = cmdset_init(manager);
-    if (result != 0) {
-        free(manager);
-        PyErr_SetString(PyExc_RuntimeError, "Failed to initialize CmdSet");
+    return preset_getset[index].get(self, NULL);
+}
+
+static PyObject* preset_asdict(PyObject* self, PyObject* unused) {
+    (void)unused;
+    PyObject* dict = PyDict_New();
+    if (!dict) return NULL;
+    for (int i = 0; i < PRESET_FIELD_COUNT; i++) {
+        PyObject* value = preset_getset[i].get(self, NULL);
+        if (!value || PyDict_SetItemString(dict, preset_getset[i].name, value) != 0) {
+            Py_XDECREF(value);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+    return dict;
+}
+
+static PyObject* preset_repr(PresetObject* self) {
+    PyObject* name = preset_get_name(self, NULL);
+    if (!name) return NULL;
+    PyObject* command = preset_get_command(self, NULL);
+    if (!command) {
+        Py_DECREF(name);
+        return NULL;
+    }
+    PyObject* repr = self->encrypt
+        ? PyUnicode_FromFormat("Preset(name=%R, encrypt=True, use_count=%d)", name, self->use_count)
+        : PyUnicode_FromFormat("Preset(name=%R, command=%R, use_count=%d)", name, command, self->use_count);
+    Py_DECREF(name);
+    Py_DECREF(command);
+    return repr;
+}
+
+static PySequenceMethods preset_as_sequence = {
+    .sq_length = preset_length,
+    .sq_item = preset_item,
+};
+
+static PyMethodDef preset_methods[] = {
+    {"_asdict", preset_asdict, METH_NOARGS, "Return the fields as a dict"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject PresetType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cmdset.Preset",
+    .tp_doc = "A preset read from a store snapshot",
+    .tp_basicsize = offsetof(PresetObject, text),
+    .tp_itemsize = 1,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)preset_dealloc,
+    .tp_repr = (reprfunc)preset_repr,
+    .tp_as_sequence = &preset_as_sequence,
+    .tp_methods = preset_methods,
+    .tp_getset = preset_getset,
+};
+
+static int collect_preset(const cmdset_preset_t* preset, void* user_data) {
+    collect_t* collect = (collect_t*)user_data;
+    if (collect->query && !cmdset_query_match(collect->query, preset)) return 0;
+    PyObject* item = preset_new(preset);
+    if (!item || PyList_Append(collect->list, item) != 0) {
+        Py_XDECREF(item);
+        collect->failed = 1;
+        return 1;
+    }
+    Py_DECREF(item);
+    return 0;
+}
+
+// Copies every preset (or those matching query) out of one snapshot, which
+// never blocks on the manager's lock. Raises BusyError when no snapshot slot
+// is free. The caller holds the manager.
+static PyObject* manager_collect(ManagerObject* self, const cmdset_query_t* query) {
+    cmdset_snapshot_t* snapshot = cmdset_snapshot_acquire(self->manager);
+    if (!snapshot) return raise_last_error(BusyError, "No snapshot available");
+    collect_t collect = {PyList_New(0), query, 0};
+    int count = cmdset_snapshot_count(snapshot);
+    if (!collect.list) collect.failed = 1;
+    for (int i = 0; i < count && !collect.failed; i++) collect_preset(cmdset_snapshot_preset(snapshot, i), &collect);
+    cmdset_snapshot_release(snapshot);
+    if (collect.failed) {
+        Py_XDECREF(collect.list);
         return NULL;
     }
-    PyObject* manager_obj = PyLong_FromVoidPtr(manager);
-    return manager_obj;
+    return collect.list;
+}
+
+static int manager_check(ManagerObject* self) {
+    if (self->manager && !self->closing) return 0;
+    PyErr_SetString(PyExc_ValueError, "Manager is closed");
+    return -1;
+}
+
+static void manager_close_handles(ManagerObject* self) {
+    if (self->users > 0) {
+        self->closing = 1;
+        return;
+    }
+    cmdset_manager_free(self->manager);
+    cmdset_ctx_free(self->ctx);
+    self->manager = NULL;
+    self->ctx = NULL;
+    self->closing = 0;
+}
+
+static int manager_hold(ManagerObject* self) {
+    if (manager_check(self) != 0) return -1;
+    self->users++;
+    return 0;
+}
+
+static void manager_release(ManagerObject* self) {
+    if (--self->users == 0 && self->closing) manager_close_handles(self);
+}
+
+static int manager_init(ManagerObject* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"store", "password", NULL};
+    const char* store = NULL;
+    const char* password = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zz", keywords, &store, &password)) return -1;
+    if (self->users > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Manager is in use");
+        return -1;
+    }
+    manager_close_handles(self);
+    if (store || password) {
+        self->ctx = cmdset_ctx_new();
+        if (!self->ctx) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if ((store && cmdset_ctx_set_store(self->ctx, store) != 0) || (password && cmdset_ctx_set_password(self->ctx, password) != 0)) {
+            raise_last_error(PyExc_ValueError, "Invalid store or password");
+            manager_close_handles(self);
+            return -1;
+        }
+    }
+    self->manager = cmdset_manager_new(self->ctx);
+    if (!self->manager) {
+        raise_last_error(PyExc_RuntimeError, "Failed to initialize CmdSet");
+        manager_close_handles(self);
+        return -1;
+    }
+    return 0;
+}
+
+static void manager_dealloc(ManagerObject* self) {
+    manager_close_handles(self);
+    Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
-static PyObject* py_cmdset_add_preset(PyObject* self, PyObject* args) {
-    PyObject* manager_obj;
-    char* name;
-    char* command;
+static PyObject* manager_add(ManagerObject* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"name", "command", "encrypt", NULL};
+    const char* name;
+    const char* command;
     int encrypt = 0;
-    if (!PyArg_ParseTuple(args, "Oss|i", &manager_obj, &name, &command, &encrypt)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|p", keywords, &name, &command, &encrypt)) return NULL;
+    if (manager_hold(self) != 0) return NULL;
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    result = cmdset_add_preset(self->manager, name, command, encrypt);
+    Py_END_ALLOW_THREADS
+    manager_release(self);
+    if (result != 0) return raise_result(result, "add_preset failed");
+    Py_RETURN_NONE;
+}
+
+static PyObject* manager_add_many(ManagerObject* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"presets", "encrypt", NULL};
+    PyObject* presets;
+    int encrypt = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", keywords, &presets, &encrypt)) return NULL;
+    PyObject* items = PySequence_Fast(presets, "presets must be an iterable of (name, command) pairs");
+    if (!items) return NULL;
+    // Pack the pairs back to back, each string NUL-terminated.
+    PyObject* entries = PyByteArray_FromStringAndSize(NULL, 0);
+    if (!entries) {
+        Py_DECREF(items);
         return NULL;
     }
-    cmdset_manager_t* manager = (cmdset_manager_t*)PyLong_AsVoidPtr(manager_obj);
-    if (!manager) {
-        PyErr_SetString(PyExc_RuntimeError, "Invalid manager object");
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+    for (Py_ssize_t i = 0; i < count; i++) {
+        const char* name;
+        const char* command;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(items, i), "ss", &name, &command)) break;
+        size_t name_length = strlen(name) + 1;
+        size_t command_length = strlen(command) + 1;
+        Py_ssize_t used = PyByteArray_GET_SIZE(entries);
+        if (PyByteArray_Resize(entries, used + name_length + command_length) < 0) break;
+        memcpy(PyByteArray_AS_STRING(entries) + used, name, name_length);
+        memcpy(PyByteArray_AS_STRING(entries) + used + name_length, command, command_length);
+    }
+    Py_DECREF(items);
+    if (PyErr_Occurred() || manager_hold(self) != 0) {
+        Py_DECREF(entries);
         return NULL;
     }
-    int result = cmdset_add_preset(manager, name, command, encrypt);
+    const char* buffer = PyByteArray_AS_STRING(entries);
+    size_t size = (size_t)PyByteArray_GET_SIZE(entries);
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    result = cmdset_add_many(self->manager, buffer, size, encrypt);
+    Py_END_ALLOW_THREADS
+    manager_release(self);
+    Py_DECREF(entries);
+    if (result < 0) return raise_result(result, "add_many failed");
+    return PyLong_FromLong(result);
+}
+
+static PyObject* manager_remove(ManagerObject* self, PyObject* args) {
+    const char* name;
+    if (!PyArg_ParseTuple(args, "s", &name)) return NULL;
+    if (manager_hold(self) != 0) return NULL;
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    result = cmdset_remove_preset(self->manager, name);
+    Py_END_ALLOW_THREADS
+    manager_release(self);
+    if (result != 0) return raise_result(result, "remove_preset failed");
+    Py_RETURN_NONE;
+}
+
+static PyObject* manager_exec(ManagerObject* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"name", "args", "wait", NULL};
+    const char* name;
+    const char* additional_args = NULL;
+    int wait = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|zp", keywords, &name, &additional_args, &wait)) return NULL;
+    if (manager_hold(self) != 0) return NULL;
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    result = cmdset_execute_preset_ex(self->manager, name, additional_args, wait ? CMDSET_EXEC_WAIT : CMDSET_EXEC_NOWAIT);
+    Py_END_ALLOW_THREADS
+    manager_release(self);
+    if (result < 0) return raise_result(result, "execute_preset failed");
+    return PyLong_FromLong(result);
+}
+
+static PyObject* manager_start(ManagerObject* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"name", "args", "wait", NULL};
+    const char* name;
+    const char* additional_args = NULL;
+    int wait = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|zp", keywords, &name, &additional_args, &wait)) return NULL;
+    if (manager_hold(self) != 0) return NULL;
+    cmdset_run_t* run;
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    result = cmdset_execute_start(self->manager, name, additional_args, wait ? CMDSET_EXEC_WAIT : CMDSET_EXEC_NOWAIT, &run);
+    Py_END_ALLOW_THREADS
     if (result != 0) {
-        const char* error_msg = cmdset_get_error_message(result);
-        PyErr_SetString(PyExc_RuntimeError, error_msg);
+        manager_release(self);
+        return raise_result(result, "execute_start failed");
+    }
+    RunObject* object = PyObject_New(RunObject, &RunType);
+    if (!object) {
+        Py_BEGIN_ALLOW_THREADS
+        cmdset_run_free(run);
+        Py_END_ALLOW_THREADS
+        manager_release(self);
         return NULL;
     }
+    Py_INCREF(self);
+    object->owner = self;
+    object->run = run;
+    object->waiting = 0;
+    return (PyObject*)object;
+}
+
+// Copies the named preset out of a snapshot into *found, or leaves it NULL
+// when there is no such preset. Falls back to cmdset_find_preset() when no
+// snapshot slot is free. Returns -1 with an exception set on failure.
+static int manager_lookup(ManagerObject* self, const char* name, PyObject** found) {
+    *found = NULL;
+    cmdset_snapshot_t* snapshot = cmdset_snapshot_acquire(self->manager);
+    if (snapshot) {
+        const cmdset_preset_t* preset = cmdset_snapshot_find(snapshot, name);
+        if (preset) *found = preset_new(preset);
+        cmdset_snapshot_release(snapshot);
+        return preset && !*found ? -1 : 0;
+    }
+    cmdset_preset_t* preset = cmdset_preset_array_new(1);
+    if (!preset) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    result = cmdset_find_preset(self->manager, name, preset);
+    Py_END_ALLOW_THREADS
+    if (result == 0) *found = preset_new(preset);
+    cmdset_preset_array_free(preset);
+    if (result == CMDSET_ERROR_NOT_FOUND) return 0;
+    if (result != 0) raise_result(result, "find_preset failed");
+    return *found ? 0 : -1;
+}
+
+static PyObject* manager_find(ManagerObject* self, PyObject* args) {
+    const char* name;
+    if (!PyArg_ParseTuple(args, "s", &name)) return NULL;
+    if (manager_hold(self) != 0) return NULL;
+    PyObject* preset;
+    int result = manager_lookup(self, name, &preset);
+    manager_release(self);
+    if (result != 0) return NULL;
+    if (!preset) Py_RETURN_NONE;
+    return preset;
+}
+
+static PyObject* manager_where(ManagerObject* self, PyObject* args) {
+    const char* expression;
+    if (!PyArg_ParseTuple(args, "s", &expression)) return NULL;
+    cmdset_query_t* query;
+    if (cmdset_query_compile(expression, &query) != 0) return raise_last_error(PyExc_ValueError, "Invalid filter expression");
+    if (manager_hold(self) != 0) {
+        cmdset_query_free(query);
+        return NULL;
+    }
+    PyObject* presets = manager_collect(self, query);
+    manager_release(self);
+    cmdset_query_free(query);
+    return presets;
+}
+
+static PyObject* manager_list(ManagerObject* self, PyObject* unused) {
+    (void)unused;
+    if (manager_hold(self) != 0) return NULL;
+    PyObject* presets = manager_collect(self, NULL);
+    manager_release(self);
+    return presets;
+}
+
+static char* snapshot_flatten(const cmdset_snapshot_t* snapshot, Py_ssize_t count, Py_ssize_t* size) {
+    size_t names_size = 0;
+    size_t commands_size = 0;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        size_t length;
+        cmdset_preset_name(cmdset_snapshot_preset(snapshot, (int)i), &length);
+        names_size += length;
+        cmdset_preset_command(cmdset_snapshot_preset(snapshot, (int)i), &length);
+        commands_size += length;
+    }
+    size_t tables = sizeof(uint32_t) * 2 * (count + 1);
+    *size = (Py_ssize_t)(tables + names_size + commands_size);
+    char* flat = PyMem_Malloc(*size > 0 ? *size : 1);
+    if (!flat) return NULL;
+    uint32_t* name_offsets = (uint32_t*)flat;
+    uint32_t* command_offsets = name_offsets + count + 1;
+    char* names = flat + tables;
+    char* commands = names + names_size;
+    name_offsets[0] = command_offsets[0] = 0;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        const cmdset_preset_t* preset = cmdset_snapshot_preset(snapshot, (int)i);
+        size_t length;
+        const char* text = cmdset_preset_name(preset, &length);
+        memcpy(names + name_offsets[i], text, length);
+        name_offsets[i + 1] = name_offsets[i] + (uint32_t)length;
+        text = cmdset_preset_command(preset, &length);
+        memcpy(commands + command_offsets[i], text, length);
+        command_offsets[i + 1] = command_offsets[i] + (uint32_t)length;
+    }
+    return flat;
+}
+
+static PyObject* manager_snapshot(ManagerObject* self, PyObject* unused) {
+    (void)unused;
+    if (manager_hold(self) != 0) return NULL;
+    cmdset_snapshot_t* snapshot = cmdset_snapshot_acquire(self->manager);
+    if (!snapshot) {
+        manager_release(self);
+        return raise_last_error(PyExc_RuntimeError, "snapshot_acquire failed");
+    }
+    SnapshotObject* object = PyObject_GC_New(SnapshotObject, &SnapshotType);
+    if (object) {
+        object->version = cmdset_snapshot_version(snapshot);
+        object->count = cmdset_snapshot_count(snapshot);
+        object->base = NULL;
+        memset(object->regions, 0, sizeof(object->regions));
+        object->exports = 0;
+        object->released = 0;
+        object->flat = snapshot_flatten(snapshot, object->count, &object->flat_size);
+    }
+    cmdset_snapshot_release(snapshot);
+    manager_release(self);
+    if (!object) return NULL;
+    PyObject_GC_Track(object);
+    if (!object->flat) {
+        Py_DECREF(object);
+        return PyErr_NoMemory();
+    }
+    return (PyObject*)object;
+}
+
+static PyObject* manager_save(ManagerObject* self, PyObject* unused) {
+    (void)unused;
+    if (manager_hold(self) != 0) return NULL;
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    result = cmdset_save_presets(self->manager);
+    Py_END_ALLOW_THREADS
+    manager_release(self);
+    if (result != 0) return raise_result(result, "save_presets failed");
     Py_RETURN_NONE;
 }
 
-static PyObject* py_cmdset_list_presets(PyObject* self, PyObject* args) {
-    PyObject* manager_obj;
-    if (!PyArg_ParseTuple(args, "O", &manager_obj)) return NULL;
-    cmdset_manager_t* manager = (cmdset_manager_t*)PyLong_AsVoidPtr(manager_obj);
-    if (!manager) {
-        PyErr_SetString(PyExc_RuntimeError, "Invalid manager object");
+static PyObject* manager_close(ManagerObject* self, PyObject* unused) {
+    (void)unused;
+    manager_close_handles(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject* manager_enter(ManagerObject* self, PyObject* unused) {
+    (void)unused;
+    if (manager_check(self) != 0) return NULL;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* manager_exit(ManagerObject* self, PyObject* args) {
+    (void)args;
+    manager_close_handles(self);
+    Py_RETURN_FALSE;
+}
+
+static PyObject* manager_iter(ManagerObject* self) {
+    PyObject* presets = manager_list(self, NULL);
+    if (!presets) return NULL;
+    PyObject* iterator = PyObject_GetIter(presets);
+    Py_DECREF(presets);
+    return iterator;
+}
+
+static Py_ssize_t manager_length(ManagerObject* self) {
+    if (manager_hold(self) != 0) return -1;
+    cmdset_snapshot_t* snapshot = cmdset_snapshot_acquire(self->manager);
+    if (!snapshot) {
+        manager_release(self);
+        raise_last_error(BusyError, "No snapshot available");
+        return -1;
+    }
+    Py_ssize_t count = cmdset_snapshot_count(snapshot);
+    cmdset_snapshot_release(snapshot);
+    manager_release(self);
+    return count;
+}
+
+static int manager_contains(ManagerObject* self, PyObject* key) {
+    const char* name = PyUnicode_AsUTF8(key);
+    if (!name || manager_hold(self) != 0) return -1;
+    PyObject* preset;
+    int result = manager_lookup(self, name, &preset);
+    manager_release(self);
+    if (result != 0) return -1;
+    Py_XDECREF(preset);
+    return preset != NULL;
+}
+
+static PyObject* manager_subscript(ManagerObject* self, PyObject* key) {
+    const char* name = PyUnicode_AsUTF8(key);
+    if (!name || manager_hold(self) != 0) return NULL;
+    PyObject* preset;
+    int result = manager_lookup(self, name, &preset);
+    manager_release(self);
+    if (result == 0 && !preset) PyErr_SetObject(PyExc_KeyError, key);
+    return preset;
+}
+
+static PyMethodDef manager_methods[] = {
+    {"add", (PyCFunction)(void(*)(void))manager_add, METH_VARARGS | METH_KEYWORDS, "Add a new preset"},
+    {"add_many", (PyCFunction)(void(*)(void))manager_add_many, METH_VARARGS | METH_KEYWORDS, "Add (name, command) pairs in one transaction"},
+    {"remove", (PyCFunction)manager_remove, METH_VARARGS, "Remove a preset"},
+    {"exec", (PyCFunction)(void(*)(void))manager_exec, METH_VARARGS | METH_KEYWORDS, "Execute a preset and return its wait status"},
+    {"start", (PyCFunction)(void(*)(void))manager_start, METH_VARARGS | METH_KEYWORDS, "Start a preset without waiting for it and return a Run"},
+    {"find", (PyCFunction)manager_find, METH_VARARGS, "Return the named preset, or None"},
+    {"where", (PyCFunction)manager_where, METH_VARARGS, "List presets matching a filter expression"},
+    {"list", (PyCFunction)manager_list, METH_NOARGS, "List all presets"},
+    {"snapshot", (PyCFunction)manager_snapshot, METH_NOARGS, "Pin the current presets and return a Snapshot"},
+    {"save", (PyCFunction)manager_save, METH_NOARGS, "Save presets to the store"},
+    {"close", (PyCFunction)manager_close, METH_NOARGS, "Release the manager; later calls raise ValueError"},
+    {"__enter__", (PyCFunction)manager_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)manager_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods manager_as_sequence = {
+    .sq_length = (lenfunc)manager_length,
+    .sq_contains = (objobjproc)manager_contains,
+};
+
+static PyMappingMethods manager_as_mapping = {
+    .mp_length = (lenfunc)manager_length,
+    .mp_subscript = (binaryfunc)manager_subscript,
+};
+
+static PyTypeObject ManagerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cmdset.Manager",
+    .tp_doc = "Manager(store=None, password=None)\n\nA CmdSet manager. The store and password default to the CLI's.",
+    .tp_basicsize = sizeof(ManagerObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)manager_init,
+    .tp_dealloc = (destructor)manager_dealloc,
+    .tp_iter = (getiterfunc)manager_iter,
+    .tp_as_sequence = &manager_as_sequence,
+    .tp_as_mapping = &manager_as_mapping,
+    .tp_methods = manager_methods,
+};
+
+static void run_dealloc(RunObject* self) {
+    Py_BEGIN_ALLOW_THREADS
+    cmdset_run_free(self->run);
+    Py_END_ALLOW_THREADS
+    manager_release(self->owner);
+    Py_DECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* run_get_pid(RunObject* self, void* closure) {
+    (void)closure;
+    return PyLong_FromLong(cmdset_run_pid(self->run));
+}
+
+static PyObject* run_fileno(RunObject* self, PyObject* unused) {
+    (void)unused;
+    return PyLong_FromLong(cmdset_run_fd(self->run));
+}
+
+static PyObject* run_reap(RunObject* self, int blocking) {
+    if (self->waiting) {
+        PyErr_SetString(PyExc_RuntimeError, "Run is already being waited for");
         return NULL;
     }
-    int count = cmdset_get_preset_count(manager);
-    PyObject* preset_list = PyList_New(0);
-    for (int i = 0; i < count; i++) {
-        cmdset_preset_t preset;
-        if (cmdset_get_preset_by_index(manager, i, &preset) == 0) {
-            PyObject* preset_dict = PyDict_New();
-            PyDict_SetItemString(preset_dict, "name", PyUnicode_FromString(preset.name));
-            PyDict_SetItemString(preset_dict, "command", PyUnicode_FromString(preset.command));
-            PyDict_SetItemString(preset_dict, "encrypt", PyBool_FromLong(preset.encrypt));
-            PyDict_SetItemString(preset_dict, "created_at", PyLong_FromLong(preset.created_at));
-            PyDict_SetItemString(preset_dict, "last_used", PyLong_FromLong(preset.last_used));
-            PyDict_SetItemString(preset_dict, "use_count", PyLong_FromLong(preset.use_count));
-            PyList_Append(preset_list, preset_dict);
-        }
+    self->waiting = 1;
+    int status = -1;
+    int finished;
+    Py_BEGIN_ALLOW_THREADS
+    finished = blocking ? cmdset_run_wait(self->run, &status) == 0 : cmdset_run_poll(self->run, &status) == 1;
+    Py_END_ALLOW_THREADS
+    self->waiting = 0;
+    if (!finished) Py_RETURN_NONE;
+    return PyLong_FromLong(status);
+}
+
+static PyObject* run_poll(RunObject* self, PyObject* unused) {
+    (void)unused;
+    return run_reap(self, 0);
+}
+
+static PyObject* run_wait(RunObject* self, PyObject* unused) {
+    (void)unused;
+    return run_reap(self, 1);
+}
+
+static PyObject* run_kill(RunObject* self, PyObject* args) {
+    int sig = SIGKILL;
+    if (!PyArg_ParseTuple(args, "|i", &sig)) return NULL;
+    int result = cmdset_run_kill(self->run, sig);
+    if (result != 0) return raise_result(result, "run_kill failed");
+    Py_RETURN_NONE;
+}
+
+static PyGetSetDef run_getset[] = {
+    {"pid", (getter)run_get_pid, NULL, "Process id of the shell running the command", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyMethodDef run_methods[] = {
+    {"fileno", (PyCFunction)run_fileno, METH_NOARGS, "pidfd that becomes readable when the command exits, or -1"},
+    {"poll", (PyCFunction)run_poll, METH_NOARGS, "Return the wait status if the command has exited, else None"},
+    {"wait", (PyCFunction)run_wait, METH_NOARGS, "Wait for the command and return its wait status"},
+    {"kill", (PyCFunction)run_kill, METH_VARARGS, "Send the command a signal, SIGKILL by default"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject RunType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cmdset.Run",
+    .tp_doc = "A preset started with Manager.start(). Dropping a run that is still going kills it",
+    .tp_basicsize = sizeof(RunObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)run_dealloc,
+    .tp_methods = run_methods,
+    .tp_getset = run_getset,
+};
+
+static void snapshot_free(SnapshotObject* self) {
+    PyMem_Free(self->flat);
+    self->flat = NULL;
+}
+
+static int snapshot_check(SnapshotObject* self) {
+    if (!self->released) return 0;
+    PyErr_SetString(PyExc_ValueError, "Snapshot is released");
+    return -1;
+}
+
+static int snapshot_getbuffer(SnapshotObject* self, Py_buffer* view, int flags) {
+    if (self->released) {
+        PyErr_SetString(PyExc_BufferError, "Snapshot is released");
+        return -1;
+    }
+    if (PyBuffer_FillInfo(view, (PyObject*)self, self->flat, self->flat_size, 1, flags) < 0) return -1;
+    self->exports++;
+    return 0;
+}
+
+static void snapshot_releasebuffer(SnapshotObject* self, Py_buffer* view) {
+    (void)view;
+    if (--self->exports == 0 && self->released) snapshot_free(self);
+}
+
+// One region of the flat block as a memoryview, made once and kept. The
+// offset tables are cast to native uint32 ("I").
+static PyObject* snapshot_region(SnapshotObject* self, int region) {
+    if (self->regions[region]) return self->regions[region];
+    if (!self->base && !(self->base = PyMemoryView_FromObject((PyObject*)self))) return NULL;
+    Py_ssize_t tables = (Py_ssize_t)sizeof(uint32_t) * (self->count + 1);
+    const uint32_t* name_offsets = (const uint32_t*)self->flat;
+    Py_ssize_t names_size = name_offsets[self->count];
+    Py_ssize_t starts[] = {0, tables, 2 * tables, 2 * tables + names_size, self->flat_size};
+    PyObject* view = PySequence_GetSlice(self->base, starts[region], starts[region + 1]);
+    if (view && region <= REGION_COMMAND_OFFSETS) {
+        PyObject* cast = PyObject_CallMethod(view, "cast", "s", "I");
+        Py_DECREF(view);
+        view = cast;
     }
-    return preset_list;
+    self->regions[region] = view;
+    return view;
 }
 
-static PyObject* py_cmdset_execute_preset(PyObject* self, PyObject* args) {
-    PyObject* manager_obj;
-    char* name;
-    char* additional_args = NULL;
-    if (!PyArg_ParseTuple(args, "Os|s", &manager_obj, &name, &additional_args)) return NULL;
-    cmdset_manager_t* manager = (cmdset_manager_t*)PyLong_AsVoidPtr(manager_obj);
-    if (!manager) {
-        PyErr_SetString(PyExc_RuntimeError, "Invalid manager object");
+// A memoryview over the name or command of the preset at index.
+static PyObject* snapshot_view(SnapshotObject* self, Py_ssize_t index, int command) {
+    PyObject* region = snapshot_region(self, command ? REGION_COMMANDS : REGION_NAMES);
+    if (!region) return NULL;
+    const uint32_t* offsets = (const uint32_t*)self->flat + (command ? self->count + 1 : 0);
+    return PySequence_GetSlice(region, offsets[index], offsets[index + 1]);
+}
+
+static PyObject* snapshot_pair(SnapshotObject* self, Py_ssize_t index) {
+    PyObject* name = snapshot_view(self, index, 0);
+    if (!name) return NULL;
+    PyObject* command = snapshot_view(self, index, 1);
+    if (!command) {
+        Py_DECREF(name);
         return NULL;
     }
-    int result = cmdset_execute_preset(manager, name, additional_args);
-    if (result < 0) {
-        const char* error_msg = cmdset_get_error_message(result);
-        PyErr_SetString(PyExc_RuntimeError, error_msg);
+    PyObject* pair = PyTuple_Pack(2, name, command);
+    Py_DECREF(name);
+    Py_DECREF(command);
+    return pair;
+}
+
+static void snapshot_drop_views(SnapshotObject* self) {
+    for (int i = 0; i < 4; i++) Py_CLEAR(self->regions[i]);
+    Py_CLEAR(self->base);
+}
+
+static PyObject* snapshot_release(SnapshotObject* self, PyObject* unused) {
+    (void)unused;
+    self->released = 1;
+    snapshot_drop_views(self);
+    if (self->exports == 0) snapshot_free(self);
+    Py_RETURN_NONE;
+}
+
+static int snapshot_traverse(SnapshotObject* self, visitproc visit, void* arg) {
+    for (int i = 0; i < 4; i++) Py_VISIT(self->regions[i]);
+    Py_VISIT(self->base);
+    return 0;
+}
+
+static int snapshot_clear(SnapshotObject* self) {
+    snapshot_drop_views(self);
+    return 0;
+}
+
+static void snapshot_dealloc(SnapshotObject* self) {
+    PyObject_GC_UnTrack(self);
+    snapshot_drop_views(self);
+    snapshot_free(self);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t snapshot_length(SnapshotObject* self) {
+    if (snapshot_check(self) != 0) return -1;
+    return self->count;
+}
+
+static PyObject* snapshot_item(SnapshotObject* self, Py_ssize_t index) {
+    if (snapshot_check(self) != 0) return NULL;
+    if (index < 0 || index >= self->count) {
+        PyErr_SetString(PyExc_IndexError, "snapshot index out of range");
         return NULL;
     }
-    return PyLong_FromLong(result);
+    return snapshot_pair(self, index);
 }
 
-static PyObject* py_cmdset_cleanup(PyObject* self, PyObject* args) {
-    PyObject* manager_obj;
-    if (!PyArg_ParseTuple(args, "O", &manager_obj)) return NULL;
-    cmdset_manager_t* manager = (cmdset_manager_t*)PyLong_AsVoidPtr(manager_obj);
-    if (manager) {
-        cmdset_cleanup(manager);
-        free(manager);
+// Looks the name up in the copy, so it needs no store snapshot.
+static PyObject* snapshot_find(SnapshotObject* self, PyObject* args) {
+    const char* name;
+    Py_ssize_t length;
+    if (!PyArg_ParseTuple(args, "s#", &name, &length)) return NULL;
+    if (snapshot_check(self) != 0) return NULL;
+    const uint32_t* offsets = (const uint32_t*)self->flat;
+    const char* names = self->flat + sizeof(uint32_t) * 2 * (self->count + 1);
+    for (Py_ssize_t i = 0; i < self->count; i++) {
+        if ((Py_ssize_t)(offsets[i + 1] - offsets[i]) == length && memcmp(names + offsets[i], name, length) == 0) return snapshot_pair(self, i);
     }
     Py_RETURN_NONE;
 }
 
-static PyMethodDef cmdset_methods[] = {
-    {"init", py_cmdset_init, METH_VARARGS, "Initialize CmdSet manager"},
-    {"add_preset", py_cmdset_add_preset, METH_VARARGS, "Add a new preset"},
-    {"list_presets", py_cmdset_list_presets, METH_VARARGS, "List all presets"},
-    {"execute_preset", py_cmdset_execute_preset, METH_VARARGS, "Execute a preset"},
-    {"cleanup", py_cmdset_cleanup, METH_VARARGS, "Cleanup CmdSet manager"},
+static PyObject* snapshot_get_version(SnapshotObject* self, void* closure) {
+    (void)closure;
+    if (snapshot_check(self) != 0) return NULL;
+    return PyLong_FromUnsignedLong(self->version);
+}
+
+static PyObject* snapshot_get_region(SnapshotObject* self, void* closure) {
+    if (snapshot_check(self) != 0) return NULL;
+    PyObject* region = snapshot_region(self, (int)(Py_ssize_t)closure);
+    Py_XINCREF(region);
+    return region;
+}
+
+static PyObject* snapshot_enter(SnapshotObject* self, PyObject* unused) {
+    (void)unused;
+    if (snapshot_check(self) != 0) return NULL;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* snapshot_exit(SnapshotObject* self, PyObject* args) {
+    (void)args;
+    Py_XDECREF(snapshot_release(self, NULL));
+    Py_RETURN_FALSE;
+}
+
+static PyBufferProcs snapshot_as_buffer = {
+    .bf_getbuffer = (getbufferproc)snapshot_getbuffer,
+    .bf_releasebuffer = (releasebufferproc)snapshot_releasebuffer,
+};
+
+static PySequenceMethods snapshot_as_sequence = {
+    .sq_length = (lenfunc)snapshot_length,
+    .sq_item = (ssizeargfunc)snapshot_item,
+};
+
+static PyGetSetDef snapshot_getset[] = {
+    {"version", (getter)snapshot_get_version, NULL, "Version of the store this snapshot copied", NULL},
+    {"name_offsets", (getter)snapshot_get_region, NULL, "uint32 memoryview: name i is names[name_offsets[i]:name_offsets[i + 1]]", (void*)REGION_NAME_OFFSETS},
+    {"command_offsets", (getter)snapshot_get_region, NULL, "uint32 memoryview: command i is commands[command_offsets[i]:command_offsets[i + 1]]", (void*)REGION_COMMAND_OFFSETS},
+    {"names", (getter)snapshot_get_region, NULL, "Every name back to back, as one memoryview", (void*)REGION_NAMES},
+    {"commands", (getter)snapshot_get_region, NULL, "Every command back to back, as one memoryview", (void*)REGION_COMMANDS},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyMethodDef snapshot_methods[] = {
+    {"find", (PyCFunction)snapshot_find, METH_VARARGS, "Return (name, command) memoryviews for the named preset, or None"},
+    {"release", (PyCFunction)snapshot_release, METH_NOARGS, "Free the copied presets once no views are left"},
+    {"__enter__", (PyCFunction)snapshot_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)snapshot_exit, METH_VARARGS, NULL},
     {NULL, NULL, 0, NULL}
 };
 
+static PyTypeObject SnapshotType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cmdset.Snapshot",
+    .tp_doc = "Presets copied by Manager.snapshot(). Items are (name, command) memoryviews; names, commands and their offsets cover them all at once.",
+    .tp_basicsize = sizeof(SnapshotObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_dealloc = (destructor)snapshot_dealloc,
+    .tp_traverse = (traverseproc)snapshot_traverse,
+    .tp_clear = (inquiry)snapshot_clear,
+    .tp_as_sequence = &snapshot_as_sequence,
+    .tp_as_buffer = &snapshot_as_buffer,
+    .tp_methods = snapshot_methods,
+    .tp_getset = snapshot_getset,
+};
+
 static struct PyModuleDef cmdset_module = {
     PyModuleDef_HEAD_INIT,
-    "cmdset",
+    "_cmdset",
     "CmdSet Python Extension",
     -1,
-    cmdset_methods
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
 };
 
-PyMODINIT_FUNC PyInit_cmdset(void) {
-    return PyModule_Create(&cmdset_module);
+PyMODINIT_FUNC PyInit__cmdset(void) {
+    if (PyType_Ready(&PresetType) < 0 || PyType_Ready(&ManagerType) < 0 || PyType_Ready(&RunType) < 0 || PyType_Ready(&SnapshotType) < 0) return NULL;
+    PyObject* fields = Py_BuildValue("(ssssss)", "name", "command", "encrypt", "created_at", "last_used", "use_count");
+    if (!fields || PyDict_SetItemString(PresetType.tp_dict, "_fields", fields) != 0) {
+        Py_XDECREF(fields);
+        return NULL;
+    }
+    Py_DECREF(fields);
+    PyType_Modified(&PresetType);
+    PyObject* module = PyModule_Create(&cmdset_module);
+    if (!module) return NULL;
+    BusyError = PyErr_NewException("cmdset.BusyError", PyExc_RuntimeError, NULL);
+    if (!BusyError || PyModule_AddObjectRef(module, "BusyError", BusyError) < 0 ||
+        PyModule_AddType(module, &PresetType) < 0 || PyModule_AddType(module, &ManagerType) < 0 || PyModule_AddType(module, &RunType) < 0 ||
+        PyModule_AddType(module, &SnapshotType) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
 }